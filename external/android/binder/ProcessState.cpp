@@ -297,6 +297,8 @@ void ProcessState::spawnPooledThread(bool isMain)
 }
 
 status_t ProcessState::setThreadPoolMaxThreadCount(size_t maxThreads) {
+  mMaxThreads = maxThreads;
+  mClient->SetMaxThreads(maxThreads);
   return NO_ERROR;
 }
 
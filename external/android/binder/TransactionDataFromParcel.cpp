@@ -107,12 +107,12 @@ void InitParcelFromTransactionData(android::Parcel &p, const std::unique_ptr<bin
 TransactionDataFromParcel::TransactionDataFromParcel(
     binderd::Client *client, const uint32_t &code, const Parcel *parcel, bool one_way) : code_{code}, one_way_{one_way} {
 
-  data_ = binderd::CreateBufferWithSize(parcel->ipcDataSize());
+  data_ = binderd::CreateUninitializedBufferWithSize(parcel->ipcDataSize());
   ::memcpy(data_->GetData(),
            reinterpret_cast<uint8_t*>(parcel->ipcData()),
            data_->GetSize());
 
-  objects_ = binderd::CreateBufferWithSize(parcel->ipcObjectsCount() * sizeof(binder_size_t));
+  objects_ = binderd::CreateUninitializedBufferWithSize(parcel->ipcObjectsCount() * sizeof(binder_size_t));
   ::memcpy(objects_->GetData(),
            reinterpret_cast<uint8_t*>(parcel->ipcObjects()),
            objects_->GetSize());
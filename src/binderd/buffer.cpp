@@ -16,74 +16,106 @@
  */
 
 #include "binderd/buffer.h"
+#include "binderd/constants.h"
+#include "binderd/common/slab_allocator.h"
+#include "binderd/common/variable_length_array.h"
 
 #include <memory.h>
 
+#include <algorithm>
+#include <stdexcept>
+
 namespace binderd {
 
 struct Buffer::Implementation {
-  Implementation(std::size_t size) : size_{size} {
-    allocate(size);
+  Implementation(std::size_t size, bool zero_fill) :
+    storage_{size},
+    data_{storage_.GetData()},
+    size_{size} {
+    if (zero_fill && size > 0)
+      ::memset(data_, 0, size);
   }
 
   Implementation(std::uint8_t *data, std::size_t size) :
-    size_{size},
+    storage_{0},
     data_{data},
+    size_{size},
     immutable_{true} {}
 
-  ~Implementation() {
-    if (!immutable_)
-      free(data_);
+  // Slices don't cache the parent's data pointer as the parent might
+  // still grow and move its memory.
+  Implementation(const BufferPtr &parent, std::size_t offset, std::size_t size) :
+    storage_{0},
+    size_{size},
+    immutable_{true},
+    parent_{parent},
+    offset_{offset} {}
+
+  std::uint8_t* data() const {
+    return parent_ ? parent_->GetData() + offset_ : data_;
   }
 
-  void allocate(std::size_t size) {
-    if (size == 0)
-      return;
+  std::size_t capacity() const {
+    return immutable_ ? size_ : storage_.GetCapacity();
+  }
 
-    data_ = reinterpret_cast<std::uint8_t*>(malloc(size * sizeof(std::uint8_t)));
-    if (!data_)
-      throw std::runtime_error("Not enough memory to allocate buffer");
+  void reserve(std::size_t capacity) {
+    if (immutable_)
+      throw std::runtime_error("Tried to resize an immutable buffer");
 
-    ::memset(data_, 0, size);
-    size_ = size;
+    storage_.Reserve(capacity);
+    data_ = storage_.GetData();
   }
 
+  // Growing beyond the capacity at least doubles it so that a buffer
+  // filled by many small writes is only reallocated a few times.
   void resize(std::size_t size) {
     if (immutable_)
       throw std::runtime_error("Tried to resize an immutable buffer");
 
-    data_ = reinterpret_cast<std::uint8_t*>(realloc(data_, size));
-    if (!data_)
-      throw std::runtime_error("Not enough memory to allocate buffer");
+    if (size > storage_.GetCapacity())
+      storage_.Reserve(std::max(size, storage_.GetCapacity() * 2));
 
+    storage_.Resize(size);
+    data_ = storage_.GetData();
     size_ = size;
   }
 
+  // Memory of buffers we own. Small ones never leave the object.
+  VariableLengthArray<kInlineBufferSize> storage_;
   std::uint8_t *data_ = nullptr;
   std::size_t size_ = 0;
   bool immutable_ = false;
+  BufferPtr parent_;
+  std::size_t offset_ = 0;
 };
 
 std::shared_ptr<Buffer> Buffer::Create(std::size_t size) {
-  return std::shared_ptr<Buffer>(new Buffer(size));
+  return std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), size);
 }
 
 std::shared_ptr<Buffer> Buffer::Create(std::uint8_t *data, std::size_t size) {
-  return std::shared_ptr<Buffer>(new Buffer(data, size));
+  return std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), data, size);
 }
 
 Buffer::Buffer(std::size_t size) :
-  impl{new Implementation(size)} {}
+  impl{std::allocate_shared<Implementation>(slab::Allocator<Implementation>(), size, true)} {}
+
+Buffer::Buffer(std::size_t size, const Uninitialized&) :
+  impl{std::allocate_shared<Implementation>(slab::Allocator<Implementation>(), size, false)} {}
 
 Buffer::Buffer(std::uint8_t *data, std::size_t size) :
-  impl{new Implementation(data, size)} {}
+  impl{std::allocate_shared<Implementation>(slab::Allocator<Implementation>(), data, size)} {}
+
+Buffer::Buffer(const std::shared_ptr<Buffer> &parent, std::size_t offset, std::size_t size) :
+  impl{std::allocate_shared<Implementation>(slab::Allocator<Implementation>(), parent, offset, size)} {}
 
 std::uint8_t* Buffer::GetBegin() const {
-  return impl->data_;
+  return impl->data();
 }
 
 std::uint8_t* Buffer::GetEnd() const {
-  return impl->data_ + impl->size_;
+  return impl->data() + impl->size_;
 }
 
 std::size_t Buffer::GetSize() const {
@@ -91,14 +123,38 @@ std::size_t Buffer::GetSize() const {
 }
 
 std::uint8_t* Buffer::GetData() const {
-  return impl->data_;
+  return impl->data();
+}
+
+std::size_t Buffer::GetCapacity() const {
+  return impl->capacity();
 }
 
 void Buffer::Resize(std::size_t size) {
   impl->resize(size);
 }
 
+void Buffer::Reserve(std::size_t capacity) {
+  impl->reserve(capacity);
+}
+
 BufferPtr CreateBufferWithSize(std::size_t size) {
-  return std::make_shared<Buffer>(size);
+  return std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), size);
+}
+
+BufferPtr CreateUninitializedBufferWithSize(std::size_t size) {
+  return std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), size, Buffer::Uninitialized{});
+}
+
+BufferPtr CreateBufferSlice(const BufferPtr &parent, std::size_t offset, std::size_t size) {
+  if (offset > parent->GetSize() || parent->GetSize() - offset < size)
+    throw std::out_of_range{"Slice exceeds its parent buffer"};
+  return std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), parent, offset, size);
+}
+
+BufferPtr CreateBufferWithCapacity(std::size_t capacity) {
+  auto buffer = std::allocate_shared<Buffer>(slab::Allocator<Buffer>(), 0);
+  buffer->Reserve(capacity);
+  return buffer;
 }
 } // namespace binderd
@@ -30,8 +30,14 @@ class Buffer {
   static std::shared_ptr<Buffer> Create(std::size_t size = 0);
   static std::shared_ptr<Buffer> Create(std::uint8_t *data, std::size_t size);
 
+  // Tag for buffers whose content is written right after creation
+  // and therefore doesn't need to be zeroed first.
+  struct Uninitialized {};
+
   Buffer(std::size_t size);
+  Buffer(std::size_t size, const Uninitialized&);
   Buffer(std::uint8_t *data, std::size_t size);
+  Buffer(const std::shared_ptr<Buffer> &parent, std::size_t offset, std::size_t size);
 
   std::uint8_t* GetBegin() const;
   std::uint8_t* GetEnd() const;
@@ -39,7 +45,12 @@ class Buffer {
   std::size_t GetSize() const;
   std::uint8_t* GetData() const;
 
+  // Capacity is the number of bytes the buffer can grow to without
+  // reallocating. Bytes gained by growing are not initialized.
+  std::size_t GetCapacity() const;
+
   void Resize(std::size_t GetSize);
+  void Reserve(std::size_t capacity);
 
  private:
   struct Implementation;
@@ -48,6 +59,13 @@ class Buffer {
 
 using BufferPtr = std::shared_ptr<Buffer>;
 BufferPtr CreateBufferWithSize(std::size_t size);
+BufferPtr CreateUninitializedBufferWithSize(std::size_t size);
+// Creates a buffer sharing size bytes of parent's memory starting at
+// offset. The slice keeps parent alive but can't change its size.
+BufferPtr CreateBufferSlice(const BufferPtr &parent, std::size_t offset, std::size_t size);
+// Creates an empty buffer which can grow to capacity bytes without
+// reallocating.
+BufferPtr CreateBufferWithCapacity(std::size_t capacity);
 } // namespace binderd
 
 #endif
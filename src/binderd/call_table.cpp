@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "binderd/call_table.h"
+#include "binderd/status.h"
+
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+// Call cookies are marked so that they never collide with the cookies
+// of messages which don't wait for a reply.
+constexpr const std::uint64_t kCallCookieFlag{1ULL << 63};
+constexpr const std::uint32_t kIndexBits{32};
+
+void FutexWait(std::atomic<std::uint32_t> *word, std::uint32_t expected) {
+  ::syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+void FutexWake(std::atomic<std::uint32_t> *word) {
+  ::syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+}
+
+namespace binderd {
+CallTable::CallTable() {}
+
+CallTable::~CallTable() {}
+
+std::uint64_t CallTable::Start(bool wait_after_delivery) {
+  return Start(wait_after_delivery, nullptr);
+}
+
+std::uint64_t CallTable::Start(bool wait_after_delivery, const CompletionHandler &handler) {
+  // All slots being taken means as many threads are blocked in calls
+  // so we just wait for one of them to finish.
+  for (;;) {
+    for (std::size_t n = 0; n < kNumSlots; n++) {
+      const auto index = next_slot_++ % kNumSlots;
+      auto &slot = slots_[index];
+
+      std::uint32_t expected = Free;
+      if (!slot.state.compare_exchange_strong(expected, Pending))
+        continue;
+
+      slot.wait_after_delivery = wait_after_delivery;
+      slot.handler = handler;
+      const auto generation = slot.generation.load();
+      return kCallCookieFlag | (static_cast<std::uint64_t>(generation) << kIndexBits) | index;
+    }
+    std::this_thread::yield();
+  }
+}
+
+CallTable::Slot* CallTable::FindSlot(std::uint64_t cookie) {
+  if ((cookie & kCallCookieFlag) == 0)
+    return nullptr;
+
+  const auto index = cookie & ((1ULL << kIndexBits) - 1);
+  if (index >= kNumSlots)
+    return nullptr;
+
+  auto &slot = slots_[index];
+  const auto generation = static_cast<std::uint32_t>((cookie & ~kCallCookieFlag) >> kIndexBits);
+  if (slot.generation.load() != generation)
+    return nullptr;
+
+  return &slot;
+}
+
+bool CallTable::Complete(const MessagePtr &msg) {
+  auto slot = FindSlot(msg->GetCookie());
+  if (!slot)
+    return false;
+
+  if (slot->wait_after_delivery && msg->GetType() == Message::Type::Status) {
+    auto reader = msg->GetReader();
+    if (static_cast<Status>(reader.ReadInt32()) == Status::OK)
+      return true;
+  }
+
+  Complete(*slot, msg);
+  return true;
+}
+
+void CallTable::Complete(Slot &slot, const MessagePtr &msg) {
+  auto state = slot.state.load();
+  for (;;) {
+    if (state != Pending && state != Parked)
+      return;
+    if (slot.state.compare_exchange_weak(state, Completing))
+      break;
+  }
+
+  if (slot.handler) {
+    auto handler = std::move(slot.handler);
+    slot.handler = nullptr;
+    Release(slot);
+    handler(msg);
+    return;
+  }
+
+  slot.reply = msg;
+  slot.state = Done;
+  if (state == Parked)
+    FutexWake(&slot.state);
+}
+
+bool CallTable::IsCompleted(std::uint64_t cookie) {
+  auto slot = FindSlot(cookie);
+  return !slot || slot->state == Done;
+}
+
+MessagePtr CallTable::Wait(std::uint64_t cookie) {
+  auto slot = FindSlot(cookie);
+  if (!slot)
+    return nullptr;
+
+  auto state = slot->state.load();
+  while (state != Done) {
+    if (state == Pending) {
+      if (!slot->state.compare_exchange_weak(state, Parked))
+        continue;
+      state = Parked;
+    }
+
+    if (state == Parked)
+      FutexWait(&slot->state, Parked);
+    else
+      // The reader is about to store the reply
+      std::this_thread::yield();
+
+    state = slot->state.load();
+  }
+
+  auto reply = std::move(slot->reply);
+  slot->reply.reset();
+  Release(*slot);
+  return reply;
+}
+
+void CallTable::Release(Slot &slot) {
+  // The generation has to fit between the flag and the index
+  slot.generation = (slot.generation + 1) & ~(1U << 31);
+  slot.state = Free;
+}
+
+void CallTable::Cancel(std::uint64_t cookie) {
+  auto slot = FindSlot(cookie);
+  if (!slot)
+    return;
+
+  Complete(*slot, nullptr);
+  Wait(cookie);
+}
+
+void CallTable::Abort() {
+  for (auto &slot : slots_)
+    Complete(slot, nullptr);
+}
+} // namespace binderd
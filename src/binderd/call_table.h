@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef BINDERD_CALL_TABLE_H_
+#define BINDERD_CALL_TABLE_H_
+
+#include "binderd/macros.h"
+#include "binderd/message.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace binderd {
+// CallTable tracks the calls a client waits for a reply to. Calls live
+// in a fixed array of slots and the cookie a call is sent with tells
+// the slot it lives in and its generation so a late or duplicated
+// reply never completes a call which reused the slot.
+//
+// The thread waiting for a call parks on a futex in its slot and is
+// woken by the reader thread which completes the call directly. Only
+// when the reply arrives before the waiter parked no syscall is made
+// at all.
+class CallTable {
+ public:
+  static constexpr const std::size_t kNumSlots{1024};
+
+  // Called with the reply or nullptr if the call was aborted
+  using CompletionHandler = std::function<void(const MessagePtr&)>;
+
+  CallTable();
+  ~CallTable();
+
+  // Reserves a slot for a new call and returns its cookie. Transactions
+  // expecting a reply are acknowledged with a Status message first
+  // which then doesn't complete the call unless delivery failed.
+  std::uint64_t Start(bool wait_after_delivery);
+  // Starts a call nobody waits for. The handler runs on the thread
+  // completing the call and the slot is free again by then.
+  std::uint64_t Start(bool wait_after_delivery, const CompletionHandler &handler);
+
+  // Completes the call the message replies to. Returns false if no
+  // call waits for it.
+  bool Complete(const MessagePtr &msg);
+
+  // Returns true once the call got its reply or was aborted.
+  bool IsCompleted(std::uint64_t cookie);
+
+  // Blocks until the call is completed and frees its slot. Returns
+  // nullptr if the call was aborted.
+  MessagePtr Wait(std::uint64_t cookie);
+
+  // Frees the slot of a call which couldn't be sent.
+  void Cancel(std::uint64_t cookie);
+
+  // Completes all pending calls without a reply.
+  void Abort();
+
+ private:
+  enum State : std::uint32_t {
+    Free,
+    Pending,
+    // The waiter sleeps on the futex and needs to be woken up
+    Parked,
+    // The reader is storing the reply
+    Completing,
+    Done,
+  };
+
+  struct Slot {
+    std::atomic<std::uint32_t> state{Free};
+    std::atomic<std::uint32_t> generation{0};
+    bool wait_after_delivery = false;
+    MessagePtr reply;
+    CompletionHandler handler;
+  };
+
+  Slot* FindSlot(std::uint64_t cookie);
+  void Release(Slot &slot);
+  void Complete(Slot &slot, const MessagePtr &msg);
+
+  std::atomic<std::uint32_t> next_slot_{0};
+  Slot slots_[kNumSlots];
+
+  DISALLOW_COPY_AND_ASSIGN(CallTable);
+};
+} // namespace binderd
+
+#endif
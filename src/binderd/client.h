@@ -28,6 +28,7 @@
 #include <memory>
 #include <chrono>
 #include <functional>
+#include <future>
 
 namespace binderd {
 class Client {
@@ -67,6 +68,27 @@ class Client {
                           std::unique_ptr<TransactionData> request,
                           std::unique_ptr<TransactionData> *reply) = 0;
 
+  // Runs a function on a thread of the caller's choice.
+  using Executor = std::function<void(const std::function<void()>&)>;
+  using TransactCallback = std::function<void(Status, std::unique_ptr<TransactionData>)>;
+
+  struct TransactResult {
+    Status status;
+    std::unique_ptr<TransactionData> reply;
+  };
+
+  // Sends the transaction without waiting for its reply. The callback
+  // gets the reply through the executor or, if there is none, on an
+  // internal thread of the client. It may call back into the client,
+  // blocking calls included. Calls which fail without a reply complete
+  // right away on the thread giving up on them.
+  virtual void TransactAsync(int32_t handle,
+                             std::unique_ptr<TransactionData> request,
+                             const TransactCallback &callback,
+                             const Executor &executor = nullptr) = 0;
+  virtual std::future<TransactResult> TransactAsync(int32_t handle,
+                                                    std::unique_ptr<TransactionData> request) = 0;
+
   virtual uint64_t NewCookie() = 0;
 
   virtual Status AddReference(uint64_t handle) = 0;
@@ -83,6 +105,8 @@ class Client {
   virtual Status BecomeMonitor() = 0;
   virtual void SetLogMessageHandler(const std::shared_ptr<LogMessageHandler> &handler) = 0;
 
+  // Limits how many binder threads the pool spawns on demand
+  virtual void SetMaxThreads(std::size_t max_threads) = 0;
   virtual void StartThreadPool() = 0;
   virtual void JoinThreadPool() = 0;
   virtual bool ProcessAndExecuteCommand() = 0;
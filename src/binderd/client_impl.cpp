@@ -23,9 +23,13 @@
 #include "binderd/transaction_status.h"
 #include "binderd/binder_api.h"
 #include "binderd/remote_object.h"
+#include "binderd/shm_messenger.h"
+#include "binderd/common/utils.h"
 
-#include <future>
+#include <algorithm>
+#include <chrono>
 #include <functional>
+
 namespace {
 constexpr const unsigned int max_binder_threads{15};
 }
@@ -38,28 +42,45 @@ ClientImpl::ClientImpl(const std::shared_ptr<asio::io_service> &io,
                        std::size_t num_workers) :
   state_(ClientImpl::State::Disconnected),
   io_(io),
-  strand_(*io_),
+  dispatch_io_{std::make_shared<asio::io_service>()},
+  strand_(*dispatch_io_),
+  dispatch_work_{std::make_unique<asio::io_service::work>(*dispatch_io_)},
   messenger_(messenger),
   next_cookie_{0},
   object_pool_{std::make_shared<ObjectPool>()},
-  object_translator_{std::make_shared<ObjectTranslator>()} {
+  object_translator_{std::make_shared<ObjectTranslator>()},
+  out_of_line_threshold_{kDefaultOutOfLineThreshold},
+  max_threads_{max_binder_threads} {
+
+  const auto threshold = utils::get_env_value("BINDERD_OUT_OF_LINE_THRESHOLD", "");
+  if (!threshold.empty()) {
+    try {
+      out_of_line_threshold_ = std::stoul(threshold);
+    } catch (std::exception&) {
+      WARNING("Ignoring invalid out of line threshold '%s'", threshold);
+    }
+  }
+
+  leader_follower_ = !utils::is_env_set("BINDERD_DISABLE_LEADER_FOLLOWER");
+
+  dispatch_thread_ = std::thread{[this]() {
+    for (;;) {
+      try {
+        dispatch_io_->run();
+        break;
+      } catch (std::exception &err) {
+        ERROR("%s", err.what());
+      }
+    }
+  }};
 
   if (!connect)
     return;
 
   Connect(socket_path);
 
-  for (unsigned int i = 0; i < num_workers; i++) {
-    io_workers_.push_back(std::thread{[this]() {
-      while (!should_exit_) {
-       try {
-         io_->run();
-       } catch (std::exception &err) {
-         ERROR("%s", err.what());
-       }
-      }
-    }});
-  }
+  for (unsigned int i = 0; i < num_workers; i++)
+    io_workers_.push_back(std::thread{[this]() { RunIoWorker(); }});
 
   running_ = true;
 }
@@ -72,6 +93,97 @@ ClientImpl::~ClientImpl() {
         worker.join();
     }
   }
+
+  // Binder threads are detached and have to be gone before we are
+  {
+    std::unique_lock<std::mutex> l(read_lock_);
+    should_exit_ = true;
+    can_read_.notify_all();
+    loopers_changed_.wait(l, [&]() { return num_loopers_ == 0; });
+  }
+
+  dispatch_work_.reset();
+  dispatch_io_->stop();
+  if (dispatch_thread_.joinable())
+    dispatch_thread_.join();
+}
+
+void ClientImpl::RunIoWorker() {
+  while (!should_exit_) {
+    if (!leader_follower_) {
+      try {
+        io_->run();
+      } catch (std::exception &err) {
+        ERROR("%s", err.what());
+      }
+      continue;
+    }
+
+    {
+      // Threads waiting for a reply always go first
+      std::unique_lock<std::mutex> l(leader_lock_);
+      leader_changed_.wait(l, [&]() {
+        return should_exit_ || (leader_ == Leader::None && leader_requests_ == 0);
+      });
+      if (should_exit_)
+        break;
+      leader_ = Leader::Worker;
+    }
+
+    try {
+      io_->run_one();
+    } catch (std::exception &err) {
+      ERROR("%s", err.what());
+    }
+
+    {
+      std::lock_guard<std::mutex> l(leader_lock_);
+      leader_ = Leader::None;
+    }
+    leader_changed_.notify_all();
+  }
+}
+
+MessagePtr ClientImpl::WaitForCall(std::uint64_t cookie) {
+  if (!leader_follower_)
+    return calls_.Wait(cookie);
+
+  {
+    std::unique_lock<std::mutex> l(leader_lock_);
+    if (leader_ == Leader::Worker) {
+      // The worker is most likely waiting in the reactor. A no-op
+      // handler gets it out of there so that we can take over.
+      leader_requests_++;
+      io_->post([]() {});
+      leader_changed_.wait(l, [&]() { return should_exit_ || leader_ != Leader::Worker; });
+      leader_requests_--;
+    }
+
+    // Another caller reads for us and hands over our reply
+    if (should_exit_ || leader_ != Leader::None)
+      return calls_.Wait(cookie);
+
+    leader_ = Leader::Caller;
+  }
+
+  // Handlers run here are only the ones of the messenger and
+  // OnNewMessage which completes our call directly.
+  while (!calls_.IsCompleted(cookie)) {
+    try {
+      if (io_->run_one() == 0)
+        break;
+    } catch (std::exception &err) {
+      ERROR("%s", err.what());
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> l(leader_lock_);
+    leader_ = Leader::None;
+  }
+  leader_changed_.notify_all();
+
+  return calls_.Wait(cookie);
 }
 
 void ClientImpl::Connect(const std::string &socket_path) {
@@ -80,14 +192,95 @@ void ClientImpl::Connect(const std::string &socket_path) {
     return;
   }
   state_ = ClientImpl::State::Connected;
+  NegotiateTransport();
+  SetSessionOptions();
   ReadNextMessage();
 }
 
+Status ClientImpl::WriteAndWaitForStatus(const MessagePtr &msg, const std::vector<Fd> &fds) {
+  if (fds.empty())
+    messenger_->WriteData(msg->Pack());
+  else
+    messenger_->WriteData(msg->Pack(), fds);
+
+  // Nothing else uses our io_service yet so we can simply wait here
+  // for the server to answer.
+  auto status = Status::UnknownError;
+  bool done = false;
+  messenger_->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    done = true;
+    if (err)
+      return;
+
+    MessageParser parser(buffer, buffer->GetSize());
+    auto reply = parser.Next();
+    if (reply && reply->GetType() == Message::Type::Status && reply->GetCookie() == msg->GetCookie())
+      status = static_cast<Status>(reply->GetReader().ReadInt32());
+  });
+
+  while (!done && io_->run_one() > 0) {}
+  io_->reset();
+
+  return status;
+}
+
+void ClientImpl::NegotiateTransport() {
+  auto socket_messenger = std::dynamic_pointer_cast<SocketMessenger>(messenger_);
+  if (!socket_messenger || utils::is_env_set("BINDERD_DISABLE_SHM_TRANSPORT"))
+    return;
+
+  auto shm_messenger = ShmMessenger::Create(io_, socket_messenger);
+  if (!shm_messenger)
+    return;
+
+  auto msg = Message::Create(Message::Type::Version);
+  msg->SetCookie(NewCookie());
+  auto writer = msg->GetWriter();
+  writer.WriteUint32(ShmMessenger::kVersion);
+  writer.WriteUint64(shm_messenger->GetCapacity());
+
+  const auto status = WriteAndWaitForStatus(msg, shm_messenger->GetFds());
+  if (status != Status::OK) {
+    DEBUG("Server does not support the shared memory transport (%s)", status);
+    return;
+  }
+
+  messenger_ = shm_messenger;
+}
+
+void ClientImpl::SetSessionOptions() {
+  // A successful delivery is implied by the reply we wait for anyway
+  // so we don't need a Status message for it.
+  if (utils::is_env_set("BINDERD_ACK_ALL_TRANSACTIONS"))
+    return;
+
+  // Same as for the transport we can only talk to a server through
+  // the messengers we know.
+  if (!std::dynamic_pointer_cast<SocketMessenger>(messenger_) &&
+      !std::dynamic_pointer_cast<ShmMessenger>(messenger_))
+    return;
+
+  auto msg = Message::Create(Message::Type::SetOptions);
+  msg->SetCookie(NewCookie());
+  msg->GetWriter().WriteUint32(static_cast<std::uint32_t>(Message::Option::AckFailedDeliveryOnly));
+
+  const auto status = WriteAndWaitForStatus(msg, std::vector<Fd>{});
+  if (status != Status::OK)
+    DEBUG("Server does not support session options (%s)", status);
+}
+
 void ClientImpl::Terminate() {
   should_exit_ = true;
+  calls_.Abort();
   messenger_->Close();
   can_read_.notify_all();
   io_->stop();
+
+  // Threads might just be about to wait for the leader to change
+  {
+    std::lock_guard<std::mutex> l(leader_lock_);
+  }
+  leader_changed_.notify_all();
 }
 
 void ClientImpl::ReadNextMessage() {
@@ -102,9 +295,10 @@ void ClientImpl::OnNewMessage(const asio::error_code &err, const BufferPtr &buff
     return;
   }
 
-  std::unique_lock<std::mutex> l(read_lock_);
   MessageParser parser(buffer, buffer->GetSize());
   while (auto msg = parser.Next()) {
+    auto incoming = TakeFds(msg);
+
     if (msg->GetType() == Message::Type::LogEntry) {
       if (log_message_handler_) {
         auto reader = msg->GetReader();
@@ -115,29 +309,16 @@ void ClientImpl::OnNewMessage(const asio::error_code &err, const BufferPtr &buff
       continue;
     }
 
-    const auto reply_cookie = msg->GetCookie();
-    auto pending = pending_calls_.find(reply_cookie);
-    if (pending != pending_calls_.end()) {
-      auto call = std::get<1>(*pending);
-
-      // Only transaction messages are acknowledged on reception on the server
-      // side with a status message but still need to await their response from
-      // the remote object.
-      if (msg->GetType() == Message::Type::Status &&
-          call.msg_type == Message::Type::Transaction &&
-          !call.one_way) {
-        auto reader = msg->GetReader();
-        if (static_cast<Status>(reader.ReadInt32()) == Status::OK)
-          continue;
-      }
-
-      auto promise = call.promise;
-      promise->set_value(msg);
-      strand_.post([this, reply_cookie]() { FinishCall(reply_cookie); });
+    // Completing an async call hands its reply to an executor. This
+    // happens without our lock held so the executor may call back
+    // into the client.
+    if (calls_.Complete(msg)) {
+      continue;
     } else if (msg->GetType() == Message::Type::Transaction && context_obj_) {
       strand_.post([this, msg]() { HandleContextObjectMessage(msg); });
     } else {
-      in_messages_.push_back(msg);
+      std::lock_guard<std::mutex> l(read_lock_);
+      in_messages_.push_back(std::move(incoming));
       can_read_.notify_one();
     }
   }
@@ -145,6 +326,76 @@ void ClientImpl::OnNewMessage(const asio::error_code &err, const BufferPtr &buff
   ReadNextMessage();
 }
 
+ClientImpl::IncomingMessage ClientImpl::TakeFds(const MessagePtr &msg) {
+  IncomingMessage incoming;
+  incoming.msg = msg;
+
+  if (msg->GetType() != Message::Type::Transaction &&
+      msg->GetType() != Message::Type::TransactionReply)
+    return incoming;
+
+  // Fds arrive in the same order as the messages they belong to. We
+  // have to claim them now as messages are processed concurrently
+  // later on.
+  try {
+    TransactionDataFromMessage data(msg);
+    const auto num_fds = data.GetNumFds();
+    if (num_fds > 0)
+      msg->SetFds(messenger_->TakeFds(num_fds));
+
+    if (msg->GetType() == Message::Type::Transaction) {
+      incoming.one_way = data.IsOneWay();
+      incoming.node = data.GetCookie();
+    }
+  } catch (std::exception&) {
+  }
+
+  return incoming;
+}
+
+bool ClientImpl::TakeNextMessage(IncomingMessage &next) {
+  while (!in_messages_.empty()) {
+    auto incoming = std::move(in_messages_.front());
+    in_messages_.pop_front();
+
+    if (incoming.one_way && !incoming.continues_node) {
+      // Waits until the node finished the one-way transaction before
+      auto node = busy_nodes_.find(incoming.node);
+      if (node != busy_nodes_.end()) {
+        node->second.push_back(std::move(incoming));
+        continue;
+      }
+      busy_nodes_[incoming.node];
+    }
+
+    next = std::move(incoming);
+    return true;
+  }
+  return false;
+}
+
+void ClientImpl::FinishMessage(const IncomingMessage &msg) {
+  if (!msg.one_way)
+    return;
+
+  auto node = busy_nodes_.find(msg.node);
+  if (node == busy_nodes_.end())
+    return;
+
+  if (node->second.empty()) {
+    busy_nodes_.erase(node);
+    return;
+  }
+
+  // The next one-way transaction for the node goes first so that it
+  // doesn't wait behind everything which arrived in the meantime.
+  auto next = std::move(node->second.front());
+  node->second.pop_front();
+  next.continues_node = true;
+  in_messages_.push_front(std::move(next));
+  can_read_.notify_one();
+}
+
 void ClientImpl::HandleContextObjectMessage(const MessagePtr &msg) {
   if (msg->GetType() != Message::Type::Transaction)
     return;
@@ -177,26 +428,6 @@ void ClientImpl::SendStatus(const MessagePtr &msg, const Status &status) {
   messenger_->WriteData(reply->Pack());
 }
 
-void ClientImpl::FinishCall(std::uint64_t cookie) {
-  pending_calls_.erase(cookie);
-}
-
-ClientImpl::CallPromisePtr ClientImpl::StartCall(const MessagePtr &msg, bool one_way) {
-  msg->SetCookie(NewCookie());
-
-  if (pending_calls_.find(msg->GetCookie()) != pending_calls_.end()) {
-    // FIXME maybe we should do a bit better here and try a few more
-    // handles until we find one we don't track yet. The uint64_t should
-    // flip at somepoint (if we have a overrun) and simply start again.
-    throw std::runtime_error("Message with same cookie is already waiting for a reply");
-  }
-
-  auto p = std::make_shared<std::promise<MessagePtr>>();
-  pending_calls_.insert({msg->GetCookie(), {p, msg->GetType(), one_way}});
-
-  return p;
-}
-
 ClientImpl::State ClientImpl::GetState() const {
   return state_;
 }
@@ -205,63 +436,179 @@ void ClientImpl::QueueMessage(const MessagePtr &msg) {
   if (should_exit_ || !running_)
     throw std::runtime_error("Not connected");
 
-  messenger_->WriteData(msg->Pack());
+  FlushReferences();
+
+  if (msg->GetFds().empty())
+    messenger_->WriteData(msg->Pack());
+  else
+    messenger_->WriteData(msg->Pack(), msg->GetFds());
 }
 
 MessagePtr ClientImpl::DequeueMessage() {
   std::unique_lock<std::mutex> l(read_lock_);
-  while (in_messages_.size() == 0 && !should_exit_)
+  IncomingMessage next;
+  idle_loopers_++;
+  while (!should_exit_ && !TakeNextMessage(next))
     can_read_.wait(l);
+  idle_loopers_--;
   if (should_exit_)
     return nullptr;
-  auto msg = in_messages_.front();
-  in_messages_.pop_front();
-  return msg;
+
+  // We don't know when the caller is done with the message so it
+  // only keeps its order when dequeued.
+  FinishMessage(next);
+  return next.msg;
 }
 
 MessagePtr ClientImpl::Transact(const MessagePtr &msg, bool one_way) {
   if (state_ != State::Connected)
     return nullptr;
 
-  auto p = StartCall(msg, one_way);
-
-  QueueMessage(msg);
-
-  auto ft = p->get_future();
-  ft.wait();
+  // Only transactions are acknowledged on reception on the server
+  // side with a status message but still need to await their response
+  // from the remote object.
+  const auto cookie = calls_.Start(msg->GetType() == Message::Type::Transaction && !one_way);
+  msg->SetCookie(cookie);
+
+  try {
+    QueueMessage(msg);
+  } catch (...) {
+    calls_.Cancel(cookie);
+    throw;
+  }
 
-  return ft.get();
+  return WaitForCall(cookie);
 }
 
 Status ClientImpl::Transact(int32_t handle, std::unique_ptr<TransactionData> request, std::unique_ptr<TransactionData> *reply) {
   if (!request || (!request->IsOneWay() && !reply))
     return Status::BadValue;
 
-  auto msg = Message::Create(Message::Type::Transaction);
-  msg->SetDestination(handle);
-  msg->SetCookie(NewCookie());
-
-  object_translator_->ProcessTransaction(request.get(), ObjectTranslator::Direction::Out);
+  MessagePtr msg;
+  auto status = CreateTransaction(handle, request.get(), &msg);
+  if (status != Status::OK)
+    return status;
 
-  msg->GetWriter().WriteData(request->Pack());
   auto rmsg = Transact(msg, request->IsOneWay());
   if (!rmsg)
     return Status::FailedTransaction;
-  else if (request->IsOneWay() && rmsg->GetType() == Message::Type::Status) {
-    auto reader = rmsg->GetReader();
-    return static_cast<Status>(reader.ReadInt32());
+
+  return ProcessReply(rmsg, reply);
+}
+
+void ClientImpl::TransactAsync(int32_t handle,
+                               std::unique_ptr<TransactionData> request,
+                               const TransactCallback &callback,
+                               const Executor &executor) {
+  // Without an executor the callback runs right away unless it gets a
+  // reply. Replies are read on a thread which has to go on reading so
+  // they are handed to our dispatch thread. There the callback can
+  // block or wait for another call.
+  auto complete = [this, callback, executor](Status status, std::unique_ptr<TransactionData> reply,
+                                             bool got_reply) {
+    if (!executor && !got_reply) {
+      callback(status, std::move(reply));
+      return;
+    }
+
+    // Executors take copyable functions only
+    auto shared_reply = std::make_shared<std::unique_ptr<TransactionData>>(std::move(reply));
+    auto run = [callback, status, shared_reply]() { callback(status, std::move(*shared_reply)); };
+    if (executor)
+      executor(run);
+    else
+      dispatch_io_->post(run);
+  };
+
+  if (!request) {
+    complete(Status::BadValue, nullptr, false);
+    return;
+  }
+
+  MessagePtr msg;
+  auto status = CreateTransaction(handle, request.get(), &msg);
+  if (status != Status::OK) {
+    complete(status, nullptr, false);
+    return;
+  }
+
+  if (state_ != State::Connected) {
+    complete(Status::FailedTransaction, nullptr, false);
+    return;
   }
 
-  if (rmsg->GetType() != Message::Type::TransactionReply)
+  const auto one_way = request->IsOneWay();
+  const auto cookie = calls_.Start(!one_way, [this, complete](const MessagePtr &rmsg) {
+    if (!rmsg) {
+      complete(Status::FailedTransaction, nullptr, false);
+      return;
+    }
+
+    std::unique_ptr<TransactionData> reply;
+    const auto status = ProcessReply(rmsg, &reply);
+    complete(status, std::move(reply), true);
+  });
+  msg->SetCookie(cookie);
+
+  try {
+    QueueMessage(msg);
+  } catch (std::exception&) {
+    // Completes the call as failed
+    calls_.Cancel(cookie);
+  }
+}
+
+std::future<Client::TransactResult> ClientImpl::TransactAsync(int32_t handle,
+                                                              std::unique_ptr<TransactionData> request) {
+  auto promise = std::make_shared<std::promise<TransactResult>>();
+  TransactAsync(handle, std::move(request), [promise](Status status, std::unique_ptr<TransactionData> reply) {
+    promise->set_value(TransactResult{status, std::move(reply)});
+  });
+  return promise->get_future();
+}
+
+Status ClientImpl::CreateTransaction(int32_t handle, TransactionData *request, MessagePtr *msg) {
+  auto tr = Message::Create(Message::Type::Transaction);
+  tr->SetDestination(handle);
+
+  std::vector<Fd> fds;
+  auto status = object_translator_->ProcessTransaction(request, ObjectTranslator::Direction::Out, &fds);
+  if (status != Status::OK)
+    return status;
+
+  tr->GetWriter().WriteData(request->Pack(&fds, out_of_line_threshold_));
+  tr->SetFds(fds);
+  *msg = tr;
+  return Status::OK;
+}
+
+Status ClientImpl::ProcessReply(const MessagePtr &rmsg, std::unique_ptr<TransactionData> *reply) {
+  // One-way transactions and failed deliveries are only answered with
+  // a Status.
+  if (rmsg->GetType() == Message::Type::Status)
+    return static_cast<Status>(rmsg->GetReader().ReadInt32());
+  else if (rmsg->GetType() != Message::Type::TransactionReply)
     return Status::BadValue;
 
-  auto reply_data = std::make_unique<TransactionDataFromMessage>(rmsg);
+  std::unique_ptr<TransactionDataFromMessage> reply_data;
+  try {
+    reply_data = std::make_unique<TransactionDataFromMessage>(rmsg);
+  } catch (std::exception &err) {
+    WARNING("Received invalid reply: %s", err.what());
+    return Status::BadValue;
+  }
+
   if (reply_data->HasStatus())
     return reply_data->GetStatus();
 
-  object_translator_->ProcessTransaction(reply_data.get(), ObjectTranslator::Direction::In);
+  auto reply_fds = rmsg->GetFds();
+  auto status = object_translator_->ProcessTransaction(reply_data.get(), ObjectTranslator::Direction::In, &reply_fds);
+  if (status != Status::OK)
+    return status;
 
-  *reply = std::move(reply_data);
+  // Nobody is interested in the reply of a one-way transaction
+  if (reply)
+    *reply = std::move(reply_data);
 
   return Status::OK;
 }
@@ -271,43 +618,41 @@ uint64_t ClientImpl::NewCookie() {
 }
 
 Status ClientImpl::AddReference(uint64_t handle) {
-  auto msg = Message::Create(Message::Type::Acquire);
-  if (!msg) {
-    WARNING("Failed to acquire reference for handle %d: no memory", handle);
-    return Status::NoMemory;
-  }
-
-  auto writer = msg->GetWriter();
-  writer.WriteUint64(handle);
+  return QueueReferenceChange(handle, 1);
+}
 
-  auto reply = Transact(msg);
-  if (!reply) {
-    WARNING("Failed to acquire reference for handle %d: received no reply", handle);
-    return Status::FailedTransaction;
-  }
+Status ClientImpl::ReleaseReference(uint64_t handle) {
+  return QueueReferenceChange(handle, -1);
+}
 
-  auto reader = reply->GetReader();
-  return static_cast<Status>(reader.ReadInt32());
+Status ClientImpl::QueueReferenceChange(uint64_t handle, int32_t delta) {
+  // Like with the kernel driver reference changes are not sent right
+  // away but with the next message we send.
+  std::lock_guard<std::mutex> l(refs_lock_);
+  auto iter = pending_refs_.insert({handle, 0}).first;
+  iter->second += delta;
+  if (iter->second == 0)
+    pending_refs_.erase(iter);
+  return Status::OK;
 }
 
-Status ClientImpl::ReleaseReference(uint64_t handle) {
-  auto msg = Message::Create(Message::Type::Release);
-  if (!msg) {
-    WARNING("Failed to acquire reference for handle %d: no memory", handle);
-    return Status::NoMemory;
-  }
+void ClientImpl::FlushReferences() {
+  // Keep the lock while writing so that concurrent flushes can't
+  // reorder changes for the same handle.
+  std::lock_guard<std::mutex> l(refs_lock_);
+  if (pending_refs_.empty())
+    return;
 
+  auto msg = Message::Create(Message::Type::UpdateReferences);
   auto writer = msg->GetWriter();
-  writer.WriteUint64(handle);
-
-  auto reply = Transact(msg);
-  if (!reply) {
-    WARNING("Failed to acquire reference for handle %d: received no reply", handle);
-    return Status::FailedTransaction;
+  writer.WriteUint32(static_cast<uint32_t>(pending_refs_.size()));
+  for (const auto &ref : pending_refs_) {
+    writer.WriteUint64(ref.first);
+    writer.WriteInt32(ref.second);
   }
+  pending_refs_.clear();
 
-  auto reader = reply->GetReader();
-  return static_cast<Status>(reader.ReadInt32());
+  messenger_->WriteData(msg->Pack());
 }
 
 Client::ReleaseReferenceFunc ClientImpl::GetReleaseReferenceClosure(uint64_t handle) {
@@ -415,34 +760,117 @@ void ClientImpl::SetLogMessageHandler(const std::shared_ptr<LogMessageHandler> &
   log_message_handler_ = handler;
 }
 
+void ClientImpl::SetMaxThreads(std::size_t max_threads) {
+  std::lock_guard<std::mutex> l(read_lock_);
+  max_threads_ = std::max<std::size_t>(max_threads, 1);
+}
+
 void ClientImpl::StartThreadPool() {
-  for (int n = 0; n < max_binder_threads; n++) {
-    workers_.push_back(std::thread([this]() {
-      while (!should_exit_)
-        ProcessAndExecuteCommand();
-    }));
-  }
+  std::lock_guard<std::mutex> l(read_lock_);
+  if (thread_pool_started_)
+    return;
+
+  // More threads are only spawned once this one gets busy
+  thread_pool_started_ = true;
+  SpawnLooper();
 }
 
 void ClientImpl::JoinThreadPool() {
-  for (auto &worker : workers_) {
-    if (worker.joinable())
-      worker.join();
+  std::unique_lock<std::mutex> l(read_lock_);
+  loopers_changed_.wait(l, [&]() { return num_loopers_ == 0; });
+}
+
+void ClientImpl::SpawnLooper() {
+  num_loopers_++;
+  std::thread{[this]() { RunLooper(); }}.detach();
+}
+
+void ClientImpl::RunLooper() {
+  std::unique_lock<std::mutex> l(read_lock_);
+  while (!should_exit_) {
+    idle_loopers_++;
+    const auto has_work = can_read_.wait_for(l, std::chrono::milliseconds{kLooperIdleTimeoutMs}, [&]() {
+      return should_exit_ || !in_messages_.empty();
+    });
+    idle_loopers_--;
+
+    if (should_exit_)
+      break;
+
+    // The first looper always stays around
+    if (!has_work) {
+      if (num_loopers_ > 1)
+        break;
+      continue;
+    }
+
+    IncomingMessage next;
+    if (!TakeNextMessage(next))
+      continue;
+
+    // Nobody would be left to pick up the next message while we are
+    // busy with this one.
+    if (idle_loopers_ == 0 && num_loopers_ < max_threads_)
+      SpawnLooper();
+
+    l.unlock();
+    try {
+      ExecuteCommand(next.msg);
+    } catch (std::exception &err) {
+      ERROR("%s", err.what());
+    }
+    l.lock();
+    FinishMessage(next);
   }
+
+  num_loopers_--;
+  loopers_changed_.notify_all();
 }
 
 bool ClientImpl::ProcessAndExecuteCommand() {
-  auto msg = DequeueMessage();
-  if (!msg)
+  std::unique_lock<std::mutex> l(read_lock_);
+  IncomingMessage next;
+  idle_loopers_++;
+  while (!should_exit_ && !TakeNextMessage(next))
+    can_read_.wait(l);
+  idle_loopers_--;
+  if (should_exit_)
     return false;
+  l.unlock();
+
+  auto result = false;
+  try {
+    result = ExecuteCommand(next.msg);
+  } catch (...) {
+    l.lock();
+    FinishMessage(next);
+    throw;
+  }
+
+  l.lock();
+  FinishMessage(next);
+  return result;
+}
 
+bool ClientImpl::ExecuteCommand(const MessagePtr &msg) {
   switch (msg->GetType()) {
   case Message::Type::Transaction: {
-    auto request = std::make_unique<TransactionDataFromMessage>(msg);
+    std::unique_ptr<TransactionDataFromMessage> request;
+    try {
+      request = std::make_unique<TransactionDataFromMessage>(msg);
+    } catch (std::exception &err) {
+      WARNING("Received invalid transaction: %s", err.what());
+      SendStatus(msg, Status::BadValue);
+      break;
+    }
 
     // Translate all passed objects back to real objects if we
     // own them. Otherwise we just leave things as they are.
-    object_translator_->ProcessTransaction(request.get(), ObjectTranslator::Direction::In);
+    auto fds = msg->GetFds();
+    if (object_translator_->ProcessTransaction(request.get(), ObjectTranslator::Direction::In, &fds) != Status::OK) {
+      SendStatus(msg, Status::BadValue);
+      break;
+    }
 
     // Find the right object we hand the transaction to. This
     // is either specified by the cookie or the context object
@@ -463,7 +891,14 @@ bool ClientImpl::ProcessAndExecuteCommand() {
 
     std::unique_ptr<TransactionData> reply;
     std::shared_ptr<Client> c(this, [](auto p) { });
-    const auto status = obj->Transact(shared_from_this(), std::move(request), &reply);
+    auto status = obj->Transact(shared_from_this(), std::move(request), &reply);
+
+    // If the reply passes any objects to the other side, we have
+    // to ensure they are properly translated so that we never
+    // pass real memory addresses.
+    std::vector<Fd> reply_fds;
+    if (status == Status::OK && reply)
+      status = object_translator_->ProcessTransaction(reply.get(), ObjectTranslator::Direction::Out, &reply_fds);
 
     auto rmsg = Message::Create(Message::Type::TransactionReply);
     rmsg->SetCookie(msg->GetCookie());
@@ -473,15 +908,10 @@ bool ClientImpl::ProcessAndExecuteCommand() {
       TransactionStatus data(static_cast<Status>(status));
       writer.WriteData(data.Pack());
     } else {
-      if (reply) {
-        // If the reply passes any objects to the other side, we have
-        // to ensure they are properly translated so that we never
-        // pass real memory addresses.
-        object_translator_->ProcessTransaction(reply.get(), ObjectTranslator::Direction::Out);
-      } else {
+      if (!reply)
         reply = std::make_unique<TransactionStatus>(Status::OK);
-      }
-      writer.WriteData(reply->Pack());
+      writer.WriteData(reply->Pack(&reply_fds, out_of_line_threshold_));
+      rmsg->SetFds(reply_fds);
     }
 
     QueueMessage(rmsg);
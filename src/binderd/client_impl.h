@@ -19,6 +19,7 @@
 #define BINDERD_CLIENT_IMPL_H_
 
 #include "binderd/client.h"
+#include "binderd/call_table.h"
 #include "binderd/socket_messenger.h"
 #include "binderd/object_translator.h"
 
@@ -27,7 +28,6 @@
 #include <condition_variable>
 #include <atomic>
 #include <deque>
-#include <future>
 
 #include <asio.hpp>
 
@@ -35,9 +35,6 @@ namespace binderd {
 class ClientImpl : public Client,
                    public std::enable_shared_from_this<ClientImpl> {
  public:
-  using CallPromisePtr = std::shared_ptr<std::promise<MessagePtr>>;
-
-
   ClientImpl(const std::shared_ptr<asio::io_service> &io,
              const std::shared_ptr<Messenger> &messenger,
              const std::string &socket_path,
@@ -55,6 +52,12 @@ class ClientImpl : public Client,
   Status Transact(int32_t handle,
                   std::unique_ptr<TransactionData> request,
                   std::unique_ptr<TransactionData> *reply) override;
+  void TransactAsync(int32_t handle,
+                     std::unique_ptr<TransactionData> request,
+                     const TransactCallback &callback,
+                     const Executor &executor = nullptr) override;
+  std::future<TransactResult> TransactAsync(int32_t handle,
+                                            std::unique_ptr<TransactionData> request) override;
 
   uint64_t NewCookie() override;
 
@@ -71,6 +74,7 @@ class ClientImpl : public Client,
   Status BecomeMonitor() override;
   void SetLogMessageHandler(const std::shared_ptr<LogMessageHandler> &handler) override;
 
+  void SetMaxThreads(std::size_t max_threads) override;
   void StartThreadPool() override;
   void JoinThreadPool() override;
 
@@ -79,40 +83,90 @@ class ClientImpl : public Client,
   ObjectPoolPtr GetObjectPool() override;
 
  private:
-  CallPromisePtr StartCall(const MessagePtr &msg, bool one_way);
-  void FinishCall(std::uint64_t cookie);
   void SendStatus(const MessagePtr &msg, const Status &status);
+  // One-way transactions are executed one after the other per node
+  // like the binder driver does. Everything else runs in parallel.
+  struct IncomingMessage {
+    MessagePtr msg;
+    bool one_way = false;
+    std::uintptr_t node = 0;
+    // The node was handed over from the previous one-way transaction
+    bool continues_node = false;
+  };
+
+  IncomingMessage TakeFds(const MessagePtr &msg);
+  bool TakeNextMessage(IncomingMessage &next);
+  void FinishMessage(const IncomingMessage &msg);
   void HandleContextObjectMessage(const MessagePtr &msg);
   void OnNewMessage(const asio::error_code &err, const BufferPtr &buffer);
   void ReadNextMessage();
+  Status CreateTransaction(int32_t handle, TransactionData *request, MessagePtr *msg);
+  Status ProcessReply(const MessagePtr &rmsg, std::unique_ptr<TransactionData> *reply);
+  void RunIoWorker();
+  void SpawnLooper();
+  void RunLooper();
+  bool ExecuteCommand(const MessagePtr &msg);
+  MessagePtr WaitForCall(std::uint64_t cookie);
   void Terminate();
   void Connect(const std::string &socket_path);
-
-  struct PendingCall {
-    CallPromisePtr promise;
-    Message::Type msg_type;
-    bool one_way = false;
+  void NegotiateTransport();
+  Status QueueReferenceChange(uint64_t handle, int32_t delta);
+  void FlushReferences();
+  void SetSessionOptions();
+  Status WriteAndWaitForStatus(const MessagePtr &msg, const std::vector<Fd> &fds);
+
+  // Leader/follower: only a single thread runs the io_service at a
+  // time. A thread waiting for a reply takes over from the io workers
+  // so that it reads its reply itself. All other waiting threads are
+  // followers and get their replies handed over.
+  enum class Leader {
+    None,
+    Worker,
+    Caller,
   };
 
   std::atomic<Client::State> state_;
   std::shared_ptr<asio::io_service> io_;
+  // Transactions for the context object are dispatched here so that
+  // they never block the thread reading from the server.
+  std::shared_ptr<asio::io_service> dispatch_io_;
   asio::strand strand_;
+  std::unique_ptr<asio::io_service::work> dispatch_work_;
+  std::thread dispatch_thread_;
+  bool leader_follower_ = true;
+  std::mutex leader_lock_;
+  std::condition_variable leader_changed_;
+  Leader leader_ = Leader::None;
+  unsigned int leader_requests_ = 0;
   std::thread io_thread_;
   std::vector<std::thread> io_workers_;
   std::shared_ptr<Messenger> messenger_;
   std::mutex read_lock_;
   std::condition_variable can_read_;
-  std::deque<MessagePtr> in_messages_;
+  std::deque<IncomingMessage> in_messages_;
+  // Nodes currently executing a one-way transaction and the ones
+  // queued up behind it
+  std::unordered_map<std::uintptr_t,std::deque<IncomingMessage>> busy_nodes_;
   std::atomic_bool running_{false};
   std::atomic_bool should_exit_{false};
-  std::unordered_map<std::uint64_t,PendingCall> pending_calls_;
+  CallTable calls_;
+  // Reference count changes not sent yet. Changes for the same handle
+  // cancel each other out.
+  std::mutex refs_lock_;
+  std::unordered_map<std::uint64_t,std::int32_t> pending_refs_;
   std::atomic<std::uint64_t> next_cookie_;
   std::shared_ptr<Object> context_obj_;
   std::shared_ptr<Client::LogMessageHandler> log_message_handler_;
   ObjectPoolPtr object_pool_;
   ObjectTranslatorPtr object_translator_;
-  std::thread processor_thread_;
-  std::vector<std::thread> workers_;
+  std::size_t out_of_line_threshold_;
+  // Binder threads are spawned when all of them are busy and retire
+  // again when idle. All of this is protected by read_lock_.
+  bool thread_pool_started_ = false;
+  std::size_t max_threads_;
+  std::size_t num_loopers_ = 0;
+  std::size_t idle_loopers_ = 0;
+  std::condition_variable loopers_changed_;
 
   struct DeadRecipient {
     int id;
@@ -22,9 +22,34 @@ binderd::cmds::Server::Server()
     : CommandWithFlagsAndAction{
           cli::Name{"server"}, cli::Usage{"server"},
           cli::Description{"Run the binder server component"}} {
-  action([](const cli::Command::Context&) {
 
-    auto server = binderd::Server::Create();
+  flag(cli::make_flag(cli::Name{"max-message-size"},
+                      cli::Description{"Maximum size in bytes of a single message a client can send"},
+                      max_message_size_));
+  flag(cli::make_flag(cli::Name{"io-backend"},
+                      cli::Description{"I/O backend to use for client connections (asio or io_uring)"},
+                      io_backend_));
+  flag(cli::make_flag(cli::Name{"workers"},
+                      cli::Description{"Number of threads processing client connections"},
+                      num_workers_));
+
+  action([this](const cli::Command::Context &ctxt) {
+    auto io_backend = binderd::Server::IoBackend::Asio;
+    if (io_backend_ == "io_uring") {
+      io_backend = binderd::Server::IoBackend::IoUring;
+    } else if (io_backend_ != "asio") {
+      ctxt.cout << "Unknown I/O backend " << io_backend_ << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (num_workers_ == 0) {
+      ctxt.cout << "Need at least one worker" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    auto server = binderd::Server::Create(kDefaultSocketPath, max_message_size_, io_backend);
+    // The calling thread is one of the workers
+    server->RunAsync(num_workers_ - 1);
     server->Run();
     return EXIT_SUCCESS;
   });
@@ -19,12 +19,18 @@
 #define BINDER_CMDS_SERVER_H_
 
 #include "binderd/cli.h"
+#include "binderd/constants.h"
 
 namespace binderd {
 namespace cmds {
 class Server : public cli::CommandWithFlagsAndAction {
  public:
   Server();
+
+ private:
+  std::size_t max_message_size_{kDefaultMaxMessageSize};
+  std::string io_backend_{"asio"};
+  std::size_t num_workers_{1};
 };
 }  // namespace cmds
 }  // namespace binderd
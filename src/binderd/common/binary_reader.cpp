@@ -17,6 +17,7 @@
  */
 
 #include "binderd/common/binary_reader.h"
+#include "binderd/common/slab_allocator.h"
 #include "binderd/logger.h"
 
 #include <cstring>
@@ -38,7 +39,7 @@ static size_t pad_size(std::size_t s) {
 }
 
 namespace binderd {
-struct BinaryReader::Implementation {
+struct BinaryReader::Implementation : public slab::Allocated {
   Implementation(const BufferPtr &buffer, const std::size_t &offset) :
     buffer{buffer} {
     if (buffer) {
@@ -80,7 +81,8 @@ T BinaryReader::ReadValue() {
   if (impl->current + sizeof(T) > impl->end)
     throw std::out_of_range{"Read buffer exhausted"};
 
-  T v = static_cast<T>(*impl->current);
+  T v;
+  ::memcpy(&v, impl->current, sizeof(v));
   impl->current += sizeof(v);
 
   return v;
@@ -119,8 +121,9 @@ BufferPtr BinaryReader::ReadData(std::size_t size) {
   if (impl->current + padded > impl->end)
     throw std::out_of_range{"Read buffer exhausted"};
 
-  auto data = Buffer::Create(impl->current, size);
-  ::memcpy(data->GetData(), impl->current, size);
+  // The data stays in the buffer we're reading from which the slice
+  // keeps alive.
+  auto data = CreateBufferSlice(impl->buffer, impl->current - impl->begin, size);
 
   impl->current += padded;
 
@@ -141,7 +144,7 @@ std::string BinaryReader::ReadString() {
   if (impl->current + padded > impl->end)
     throw std::out_of_range{"Read buffer exhausted"};
 
-  auto data = CreateBufferWithSize(data_size);
+  auto data = CreateUninitializedBufferWithSize(data_size);
   ::memcpy(data->GetData(), &(*impl->current), data_size);
 
   impl->current += padded;
@@ -158,7 +161,7 @@ std::u16string BinaryReader::ReadString16() {
   if (impl->current + padded > impl->end)
     throw std::out_of_range{"Read buffer exhausted"};
 
-  auto data = CreateBufferWithSize(data_size);
+  auto data = CreateUninitializedBufferWithSize(data_size);
   ::memcpy(data->GetData(), &(*impl->current), data_size);
 
   impl->current += padded;
@@ -46,6 +46,7 @@ class BinaryReader {
   std::int16_t ReadInt16();
   std::int32_t ReadInt32();
   std::int64_t ReadInt64();
+  // Returns a slice of the buffer we read from rather than a copy.
   BufferPtr ReadData(std::size_t size);
   BufferPtr ReadSizedData();
   std::string ReadString();
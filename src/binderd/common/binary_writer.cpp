@@ -17,6 +17,7 @@
  */
 
 #include "binderd/common/binary_writer.h"
+#include "binderd/common/slab_allocator.h"
 #include "binderd/logger.h"
 
 #include <cstring>
@@ -45,7 +46,7 @@ static const uint32_t pad_mask[4] = { 0x00000000, 0x00ffffff, 0x0000ffff, 0x0000
 }
 
 namespace binderd {
-struct BinaryWriter::Implementation {
+struct BinaryWriter::Implementation : public slab::Allocated {
   Implementation(const BufferPtr &buffer) :
     buffer{buffer},
     current{buffer->GetBegin()} {}
@@ -79,6 +80,12 @@ BinaryWriter& BinaryWriter::operator=(BinaryWriter&& rhs) {
   return *this;
 }
 
+void BinaryWriter::Reserve(std::size_t size) {
+  const auto pos = impl->current - impl->buffer->GetBegin();
+  impl->buffer->Reserve(pos + size);
+  impl->current = impl->buffer->GetBegin() + pos;
+}
+
 std::size_t BinaryWriter::GetBytesWritten() const {
   return impl->current - impl->buffer->GetBegin();
 }
@@ -144,6 +151,8 @@ void BinaryWriter::WriteSizedData(const BufferPtr &buffer) {
 }
 
 void BinaryWriter::WriteSizedData(const std::uint8_t *data, std::size_t size) {
+  if (size <= INT32_MAX)
+    Reserve(sizeof(std::int32_t) + (impl->use_padding_ ? pad_size(size) : size));
   WriteInt32(size);
   WriteData(data, size);
 }
@@ -153,6 +162,9 @@ void BinaryWriter::WriteString(const std::string &str) {
 }
 
 void BinaryWriter::WriteString(const std::u16string &str) {
+  if (str.size() > 0)
+    Reserve(sizeof(std::int32_t) + pad_size((str.size() + 1) * sizeof(uint16_t)));
+
   WriteInt32(str.size());
   if (str.size() == 0)
     return;
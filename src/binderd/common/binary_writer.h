@@ -55,6 +55,10 @@ class BinaryWriter {
   void WriteString(const std::u16string &str);
   void WriteString(const char *s, std::size_t size);
 
+  // Makes sure size more bytes can be written without growing the
+  // buffer again.
+  void Reserve(std::size_t size);
+
   std::size_t GetBytesWritten() const;
   BufferPtr Finalize() const;
 
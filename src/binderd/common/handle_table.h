@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef BINDERD_COMMON_HANDLE_TABLE_H_
+#define BINDERD_COMMON_HANDLE_TABLE_H_
+
+#include "binderd/macros.h"
+#include "binderd/common/rcu_pointer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+
+namespace binderd {
+// HandleTable stores values in a dense array of slots and hands out
+// handles which combine the index of the slot with a generation. The
+// generation changes every time a slot is reused so a stale handle
+// never finds the value which took over its slot.
+//
+// Handles have to fit into the 32 bit handle field of a binder object
+// and into a positive int32 so the lower 20 bits hold the slot index
+// and the next 11 bits the generation. Handle 0 is never used. A slot
+// is retired once it used up all generations so no handle is ever
+// handed out twice.
+//
+// Slots live in chunks which are never moved or freed and point to an
+// immutable entry holding the handle and the value. This lets readers
+// look up values without taking a lock while the table grows. Removed
+// entries are only freed once no reader can still see them. Writers
+// have to be serialized by the caller.
+template<typename T>
+class HandleTable {
+ public:
+  static constexpr const std::uint32_t kIndexBits{20};
+  static constexpr const std::uint32_t kGenerationBits{11};
+  static constexpr const std::size_t kMaxSlots{1 << kIndexBits};
+  static constexpr const std::uint32_t kMaxGeneration{(1 << kGenerationBits) - 1};
+
+  HandleTable() {
+    for (auto &chunk : chunks_)
+      chunk = nullptr;
+  }
+
+  ~HandleTable() {
+    for (auto &chunk : chunks_) {
+      auto c = chunk.load();
+      if (!c)
+        continue;
+      for (auto &slot : c->slots)
+        delete slot.entry.load();
+      delete c;
+    }
+  }
+
+  // Stores the value in a free slot and returns its handle or 0 when
+  // the table is full.
+  std::uint64_t Insert(const std::shared_ptr<T> &value) {
+    std::uint32_t index = 0;
+    if (!free_slots_.empty()) {
+      index = free_slots_.front();
+      free_slots_.pop_front();
+    } else if (num_slots_ < kMaxSlots) {
+      index = num_slots_++;
+      auto &chunk = chunks_[index / kChunkSize];
+      if (!chunk.load())
+        chunk = new Chunk;
+    } else {
+      return 0;
+    }
+
+    auto &slot = GetSlot(index);
+    const auto handle = (static_cast<std::uint64_t>(slot.generation) << kIndexBits) | index;
+    slot.entry.store(new Entry{handle, value});
+    size_++;
+    return handle;
+  }
+
+  // Returns the value for the handle or nullptr when it was removed.
+  std::shared_ptr<T> Find(std::uint64_t handle) const {
+    if (handle >> (kIndexBits + kGenerationBits) != 0)
+      return nullptr;
+
+    const auto index = handle & (kMaxSlots - 1);
+    auto chunk = chunks_[index / kChunkSize].load();
+    if (!chunk)
+      return nullptr;
+
+    const auto &slot = chunk->slots[index % kChunkSize];
+    return epochs_.Read([&]() -> std::shared_ptr<T> {
+      // An entry with another handle took over the slot after ours
+      // was removed.
+      const auto entry = slot.entry.load();
+      if (!entry || entry->handle != handle)
+        return nullptr;
+      return entry->value;
+    });
+  }
+
+  bool Remove(std::uint64_t handle) {
+    if (handle >> (kIndexBits + kGenerationBits) != 0)
+      return false;
+
+    const auto index = static_cast<std::uint32_t>(handle & (kMaxSlots - 1));
+    if (index >= num_slots_)
+      return false;
+
+    auto &slot = GetSlot(index);
+    const auto entry = slot.entry.load();
+    if (!entry || entry->handle != handle)
+      return false;
+
+    slot.entry.store(nullptr);
+    epochs_.Synchronize();
+    delete entry;
+    size_--;
+
+    // Generation 0 is skipped so that no handle is ever 0. A slot
+    // which went through all other generations is never used again
+    // as wrapping around would hand out its first handle once more.
+    if (slot.generation == kMaxGeneration)
+      return true;
+    slot.generation++;
+
+    // Freed slots are reused in the order they were freed
+    free_slots_.push_back(index);
+    return true;
+  }
+
+  std::size_t Size() const { return size_; }
+
+ private:
+  static constexpr const std::size_t kChunkSize{1024};
+
+  struct Entry {
+    const std::uint64_t handle;
+    const std::shared_ptr<T> value;
+  };
+
+  struct Slot {
+    std::atomic<Entry*> entry{nullptr};
+    std::uint32_t generation = 1;
+  };
+
+  struct Chunk {
+    Slot slots[kChunkSize];
+  };
+
+  Slot& GetSlot(std::uint32_t index) {
+    return chunks_[index / kChunkSize].load()->slots[index % kChunkSize];
+  }
+
+  std::atomic<Chunk*> chunks_[kMaxSlots / kChunkSize];
+  std::deque<std::uint32_t> free_slots_;
+  std::uint32_t num_slots_ = 0;
+  std::atomic<std::size_t> size_{0};
+  RcuEpochs epochs_;
+
+  DISALLOW_COPY_AND_ASSIGN(HandleTable);
+};
+} // namespace binderd
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_COMMON_MPSC_QUEUE_H_
+#define BINDERD_COMMON_MPSC_QUEUE_H_
+
+#include "binderd/macros.h"
+
+#include <atomic>
+#include <utility>
+
+namespace binderd {
+// MpscQueue is an unbounded lock-free queue which allows any number of
+// threads to push items concurrently while a single thread pops them.
+// It is based on the intrusive MPSC node queue by Dmitry Vyukov.
+//
+// Pop() can transiently return false while a producer is in the middle
+// of Push() even though other items were already pushed after it. The
+// consumer is expected to retry later in that case.
+template<typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_{&stub_}, tail_{&stub_} {}
+
+  ~MpscQueue() {
+    T value;
+    while (Pop(value)) {}
+  }
+
+  void Push(T value) {
+    auto node = new Node;
+    node->value = std::move(value);
+    Push(node);
+  }
+
+  bool Pop(T &value) {
+    auto tail = tail_;
+    auto next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &stub_) {
+      if (!next)
+        return false;
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next) {
+      tail_ = next;
+      value = std::move(tail->value);
+      delete tail;
+      return true;
+    }
+
+    // A producer has swapped the head but not yet linked its node
+    if (tail != head_.load(std::memory_order_acquire))
+      return false;
+
+    Push(&stub_);
+
+    next = tail->next.load(std::memory_order_acquire);
+    if (!next)
+      return false;
+
+    tail_ = next;
+    value = std::move(tail->value);
+    delete tail;
+    return true;
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    T value;
+  };
+
+  void Push(Node *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  Node stub_;
+  std::atomic<Node*> head_;
+  Node *tail_;
+
+  DISALLOW_COPY_AND_ASSIGN(MpscQueue);
+};
+} // namespace binderd
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_COMMON_RCU_POINTER_H_
+#define BINDERD_COMMON_RCU_POINTER_H_
+
+#include "binderd/macros.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace binderd {
+// RcuEpochs lets readers access shared data without taking any lock
+// while writers wait for all readers which might still see an old
+// version before freeing it.
+//
+// Readers announce themselves in one of two counters selected by the
+// current generation. A writer flips the generation after publishing
+// and only has to wait for the counter of the previous one to drain
+// as every reader coming later sees the new value. Writers have to be
+// serialized by the caller.
+class RcuEpochs {
+ public:
+  RcuEpochs() = default;
+
+  // Calls f as a reader. Nothing f loaded from the shared data must
+  // be used after f returned.
+  template<typename F>
+  auto Read(F f) const -> decltype(f()) {
+    std::uint64_t generation = 0;
+    for (;;) {
+      generation = generation_.load();
+      readers_[generation & 1]++;
+      // A writer might have flipped the generation before we got
+      // counted. It then doesn't wait for us.
+      if (generation_.load() == generation)
+        break;
+      readers_[generation & 1]--;
+    }
+
+    struct Exit {
+      ~Exit() { counter--; }
+      std::atomic<unsigned int> &counter;
+    } exit{readers_[generation & 1]};
+
+    return f();
+  }
+
+  // Waits until no reader can see anything unpublished before.
+  void Synchronize() {
+    const auto generation = generation_++;
+    while (readers_[generation & 1].load() > 0)
+      std::this_thread::yield();
+  }
+
+ private:
+  std::atomic<std::uint64_t> generation_{0};
+  mutable std::atomic<unsigned int> readers_[2] = {{0}, {0}};
+
+  DISALLOW_COPY_AND_ASSIGN(RcuEpochs);
+};
+
+// RcuPointer holds an immutable value which readers access without
+// taking any lock. Writers publish a modified copy and wait for all
+// readers which might still see the old one before freeing it.
+template<typename T>
+class RcuPointer {
+ public:
+  RcuPointer() : value_{new T} {}
+
+  ~RcuPointer() {
+    delete value_.load();
+  }
+
+  // Calls f with the current value. The value must not be used after
+  // f returned.
+  template<typename F>
+  auto Read(F f) const -> decltype(f(std::declval<const T&>())) {
+    return epochs_.Read([&]() { return f(*value_.load()); });
+  }
+
+  // Publishes a copy of the current value modified by f.
+  template<typename F>
+  void Update(F f) {
+    std::unique_ptr<T> next{new T(*value_.load())};
+    f(*next);
+
+    std::unique_ptr<T> previous{value_.exchange(next.release())};
+    epochs_.Synchronize();
+  }
+
+ private:
+  std::atomic<T*> value_;
+  RcuEpochs epochs_;
+
+  DISALLOW_COPY_AND_ASSIGN(RcuPointer);
+};
+} // namespace binderd
+
+#endif
@@ -21,7 +21,9 @@
 #include "binderd/macros.h"
 
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <utility>
 
 namespace binderd {
 template<typename T>
@@ -33,12 +35,11 @@ class RefCounted {
     ++ref_count_;
   }
 
+  // An object nobody ever took a reference of is deleted right away.
+  // Otherwise only the one dropping the last reference deletes it.
   void Release() const {
-    if (ref_count_ > 0)
-      --ref_count_;
-    if (ref_count_ == 0) {
+    if (ref_count_.load() == 0 || ref_count_.fetch_sub(1) == 1)
       delete static_cast<const T*>(this);
-    }
   }
 
   uint32_t GetCount() const { return ref_count_; }
@@ -51,6 +52,62 @@ class RefCounted {
 
   DISALLOW_COPY_AND_ASSIGN(RefCounted);
 };
+
+// RefPtr holds a reference of an object derived from RefCounted. It
+// mirrors the parts of std::shared_ptr we use but keeps the count in
+// the object itself so no separate control block is needed.
+template<typename T>
+class RefPtr {
+ public:
+  RefPtr() = default;
+  RefPtr(std::nullptr_t) {}
+
+  RefPtr(T *ptr) : ptr_{ptr} {
+    if (ptr_)
+      ptr_->AddRef();
+  }
+
+  RefPtr(const RefPtr &other) : RefPtr(other.ptr_) {}
+
+  RefPtr(RefPtr &&other) : ptr_{other.ptr_} {
+    other.ptr_ = nullptr;
+  }
+
+  ~RefPtr() {
+    if (ptr_)
+      ptr_->Release();
+  }
+
+  RefPtr& operator=(RefPtr other) {
+    std::swap(ptr_, other.ptr_);
+    return *this;
+  }
+
+  void reset() { RefPtr().swap(*this); }
+  void swap(RefPtr &other) { std::swap(ptr_, other.ptr_); }
+
+  T* get() const { return ptr_; }
+  T* operator->() const { return ptr_; }
+  T& operator*() const { return *ptr_; }
+
+  explicit operator bool() const { return ptr_ != nullptr; }
+
+ private:
+  T *ptr_ = nullptr;
+};
+
+template<typename T, typename U>
+bool operator==(const RefPtr<T> &lhs, const RefPtr<U> &rhs) { return lhs.get() == rhs.get(); }
+template<typename T, typename U>
+bool operator!=(const RefPtr<T> &lhs, const RefPtr<U> &rhs) { return lhs.get() != rhs.get(); }
+template<typename T>
+bool operator==(const RefPtr<T> &lhs, std::nullptr_t) { return !lhs; }
+template<typename T>
+bool operator==(std::nullptr_t, const RefPtr<T> &rhs) { return !rhs; }
+template<typename T>
+bool operator!=(const RefPtr<T> &lhs, std::nullptr_t) { return static_cast<bool>(lhs); }
+template<typename T>
+bool operator!=(std::nullptr_t, const RefPtr<T> &rhs) { return static_cast<bool>(rhs); }
 } // namespace binderd
 
 #endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "binderd/common/slab_allocator.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+
+namespace {
+constexpr const std::size_t kGranularity{16};
+constexpr const std::size_t kNumSizeClasses{16};
+// Upper limit of blocks a thread keeps per size class. Anything freed
+// beyond goes back to operator delete.
+constexpr const std::size_t kMaxCachedBlocks{256};
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+class ThreadCache;
+
+// Caches of all running threads and the counters of those which are
+// gone already. It is never destroyed as threads might still exit
+// after static destructors ran.
+struct Registry {
+  std::mutex lock;
+  std::unordered_set<ThreadCache*> caches;
+  binderd::slab::Stats retired;
+};
+
+Registry& GetRegistry() {
+  static Registry *registry = new Registry;
+  return *registry;
+}
+
+// Only the owning thread changes the counters. They are atomic so
+// that GetStats() can read them from any other one.
+void Increment(std::atomic<std::uint64_t> &counter) {
+  counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+thread_local bool cache_destroyed = false;
+
+class ThreadCache {
+ public:
+  ThreadCache() {
+    auto &registry = GetRegistry();
+    std::lock_guard<std::mutex> l(registry.lock);
+    registry.caches.insert(this);
+  }
+
+  ~ThreadCache() {
+    for (auto &list : lists_) {
+      while (list) {
+        auto block = list;
+        list = block->next;
+        ::operator delete(block);
+      }
+    }
+
+    auto &registry = GetRegistry();
+    {
+      std::lock_guard<std::mutex> l(registry.lock);
+      AddTo(registry.retired);
+      registry.caches.erase(this);
+    }
+    cache_destroyed = true;
+  }
+
+  void* Allocate(std::size_t index) {
+    Increment(allocations_);
+    auto block = lists_[index];
+    if (!block)
+      return ::operator new((index + 1) * kGranularity);
+
+    lists_[index] = block->next;
+    lengths_[index]--;
+    Increment(hits_);
+    return block;
+  }
+
+  void Free(void *ptr, std::size_t index) {
+    if (lengths_[index] >= kMaxCachedBlocks) {
+      ::operator delete(ptr);
+      return;
+    }
+
+    auto block = static_cast<FreeBlock*>(ptr);
+    block->next = lists_[index];
+    lists_[index] = block;
+    lengths_[index]++;
+    Increment(recycled_);
+  }
+
+  void AddTo(binderd::slab::Stats &stats) const {
+    stats.allocations += allocations_.load(std::memory_order_relaxed);
+    stats.hits += hits_.load(std::memory_order_relaxed);
+    stats.recycled += recycled_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  FreeBlock *lists_[kNumSizeClasses] = {};
+  std::size_t lengths_[kNumSizeClasses] = {};
+  std::atomic<std::uint64_t> allocations_{0};
+  std::atomic<std::uint64_t> hits_{0};
+  std::atomic<std::uint64_t> recycled_{0};
+};
+
+// Memory freed while a thread exits, after its cache is gone, goes
+// straight back to operator delete.
+ThreadCache* GetThreadCache() {
+  if (cache_destroyed)
+    return nullptr;
+  static thread_local ThreadCache cache;
+  return &cache;
+}
+
+bool GetSizeClass(std::size_t size, std::size_t *index) {
+  if (size == 0 || size > kGranularity * kNumSizeClasses)
+    return false;
+  *index = (size - 1) / kGranularity;
+  return true;
+}
+}
+
+namespace binderd {
+namespace slab {
+void* Allocate(std::size_t size) {
+  std::size_t index = 0;
+  if (!GetSizeClass(size, &index))
+    return ::operator new(size);
+
+  auto cache = GetThreadCache();
+  if (!cache)
+    return ::operator new((index + 1) * kGranularity);
+
+  return cache->Allocate(index);
+}
+
+void Free(void *ptr, std::size_t size) {
+  if (!ptr)
+    return;
+
+  std::size_t index = 0;
+  auto cache = GetSizeClass(size, &index) ? GetThreadCache() : nullptr;
+  if (!cache) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  cache->Free(ptr, index);
+}
+
+Stats GetStats() {
+  auto &registry = GetRegistry();
+  std::lock_guard<std::mutex> l(registry.lock);
+  auto stats = registry.retired;
+  for (const auto cache : registry.caches)
+    cache->AddTo(stats);
+  return stats;
+}
+} // namespace slab
+} // namespace binderd
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef BINDERD_COMMON_SLAB_ALLOCATOR_H_
+#define BINDERD_COMMON_SLAB_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace binderd {
+namespace slab {
+// Small objects living only for the duration of a message, like
+// messages, buffers and transaction data, are allocated in blocks of
+// a few size classes. Every thread keeps freed blocks in free lists
+// of its own and hands them out again for the next allocation of the
+// same class without going through malloc. Blocks may be freed on any
+// thread. Larger allocations go straight to operator new.
+void* Allocate(std::size_t size);
+// Size has to be the one passed to Allocate().
+void Free(void *ptr, std::size_t size);
+
+struct Stats {
+  // Allocations small enough for a size class
+  std::uint64_t allocations = 0;
+  // Allocations served from a free list
+  std::uint64_t hits = 0;
+  // Blocks freed into a free list rather than to operator delete
+  std::uint64_t recycled = 0;
+};
+// Counters summed up over all threads which ever allocated from us.
+Stats GetStats();
+
+// Deriving from Allocated makes new and delete of a class use the
+// slab allocator.
+class Allocated {
+ public:
+  static void* operator new(std::size_t size) { return Allocate(size); }
+  static void operator delete(void *ptr, std::size_t size) { Free(ptr, size); }
+};
+
+// Standard allocator to place objects managed by std::shared_ptr
+// together with their control block in a slab.
+template<typename T>
+class Allocator {
+ public:
+  typedef T value_type;
+
+  Allocator() = default;
+  template<typename U>
+  Allocator(const Allocator<U>&) {}
+
+  T* allocate(std::size_t n) { return static_cast<T*>(Allocate(n * sizeof(T))); }
+  void deallocate(T *ptr, std::size_t n) { Free(ptr, n * sizeof(T)); }
+};
+
+template<typename T, typename U>
+bool operator==(const Allocator<T>&, const Allocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const Allocator<T>&, const Allocator<U>&) { return false; }
+} // namespace slab
+} // namespace binderd
+
+#endif
@@ -19,29 +19,45 @@
 #ifndef BINDER_COMMON_VARIABLE_LENGTH_ARRAY_H_
 #define BINDER_COMMON_VARIABLE_LENGTH_ARRAY_H_
 
+#include "binderd/macros.h"
+
 #include <sys/types.h>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 
 namespace binderd {
+// VariableLengthArray keeps up to BuiltInBufferSize bytes inside the
+// object and only goes to the heap for anything larger. Content is
+// kept when the array grows or shrinks. Once on the heap it stays
+// there as shrinking never gives memory back.
 template <size_t BuiltInBufferSize>
 class VariableLengthArray {
  public:
-  explicit VariableLengthArray(size_t size) : size_{size} {
-    /* Don't call resize if the initial values of member variables are valid */
-    if (size > BuiltInBufferSize) Resize(size);
+  explicit VariableLengthArray(size_t size) : size_{0} {
+    /* Don't call reserve if the initial values of member variables are valid */
+    if (size > BuiltInBufferSize) Reserve(size);
+    size_ = size;
   }
 
   void Resize(size_t size) {
-    if (size > BuiltInBufferSize)
-      effective_buffer = BufferUPtr{new unsigned char[size], HeapDeleter};
-    else
-      effective_buffer = BufferUPtr{builtin_buffer, NullDeleter};
-
+    Reserve(size);
     size_ = size;
   }
 
+  void Reserve(size_t capacity) {
+    if (capacity <= capacity_)
+      return;
+
+    BufferUPtr buffer{new unsigned char[capacity], HeapDeleter};
+    ::memcpy(buffer.get(), effective_buffer.get(), size_);
+    effective_buffer = std::move(buffer);
+    capacity_ = capacity;
+  }
+
   std::uint8_t* GetData() const { return effective_buffer.get(); }
   size_t GetSize() const { return size_; }
+  size_t GetCapacity() const { return capacity_; }
 
  private:
   typedef std::unique_ptr<unsigned char, void (*)(unsigned char*)> BufferUPtr;
@@ -52,6 +68,9 @@ class VariableLengthArray {
   std::uint8_t builtin_buffer[BuiltInBufferSize];
   BufferUPtr effective_buffer{builtin_buffer, NullDeleter};
   size_t size_;
+  size_t capacity_ = BuiltInBufferSize;
+
+  DISALLOW_COPY_AND_ASSIGN(VariableLengthArray);
 };
 }  // namespace binderd
 
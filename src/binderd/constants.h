@@ -19,6 +19,7 @@
 #define BINDER_CONSTANTS_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define BINDER_PACK_CHARS(c1, c2, c3, c4) \
   (((c1) << 24) | ((c2) << 16) | ((c3) << 8) | (c4))
@@ -27,6 +28,31 @@ namespace binderd {
 // Default path we're using for the server socket
 constexpr const char* kDefaultSocketPath{"/run/binder.sock"};
 
+// Upper limit for the size of a single message a peer is allowed to
+// send. Anything larger is rejected and the connection closed.
+constexpr const size_t kDefaultMaxMessageSize{16 * 1024 * 1024};
+
+// Messages larger than this are split into several frames on the wire
+// so that a single huge message can't stall the read path.
+constexpr const size_t kFrameChunkSize{64 * 1024};
+
+// Buffers keep up to this many bytes inside the object itself so that
+// small payloads like status replies, reference count updates and
+// death notifications don't need an allocation of their own.
+constexpr const size_t kInlineBufferSize{64};
+
+// Size of each of the two rings a shared memory transport between a
+// client and the server uses. Needs to be a power of two.
+constexpr const size_t kDefaultShmRingCapacity{1024 * 1024};
+
+// Transactions with a data section of at least this size pass it in
+// a sealed memfd instead of copying it through the messenger.
+constexpr const size_t kDefaultOutOfLineThreshold{256 * 1024};
+
+// Binder threads of a client beyond the first one exit after being
+// idle for this long.
+constexpr const unsigned int kLooperIdleTimeoutMs{5000};
+
 // The context manager always as 0 as its handle
 const uint32_t kContextManagerHandle{0};
 
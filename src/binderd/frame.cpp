@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "binderd/frame.h"
+#include "binderd/constants.h"
+#include "binderd/logger.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <cstring>
+
+namespace {
+// Large enough to always hold an incomplete frame of maximum size
+// next to the space we're reading into.
+constexpr const std::size_t kReceiveBufferSize{2 * (binderd::kFrameChunkSize + binderd::FrameHeader::kSize)};
+// Receive buffers still referenced by frames somebody holds on to are
+// kept for reuse up to this number. Any further ones are freed with
+// their last frame.
+constexpr const std::size_t kMaxSpareReceiveBuffers{4};
+}
+
+namespace binderd {
+constexpr std::uint8_t FrameHeader::kVersion;
+constexpr std::size_t FrameHeader::kSize;
+
+void FrameHeader::Encode(std::uint8_t *data) const {
+  data[0] = version;
+  data[1] = flags;
+  data[2] = 0;
+  data[3] = 0;
+  data[4] = static_cast<std::uint8_t>((length >> 24) & 0xff);
+  data[5] = static_cast<std::uint8_t>((length >> 16) & 0xff);
+  data[6] = static_cast<std::uint8_t>((length >> 8) & 0xff);
+  data[7] = static_cast<std::uint8_t>((length >> 0) & 0xff);
+}
+
+FrameHeader FrameHeader::Decode(const std::uint8_t *data) {
+  FrameHeader header;
+  header.version = data[0];
+  header.flags = data[1];
+  header.length = (static_cast<std::uint32_t>(data[4]) << 24) |
+                  (static_cast<std::uint32_t>(data[5]) << 16) |
+                  (static_cast<std::uint32_t>(data[6]) << 8) |
+                  (static_cast<std::uint32_t>(data[7]) << 0);
+  return header;
+}
+
+BufferPtr CreateFrame(const BufferPtr &data) {
+  auto frame = CreateUninitializedBufferWithSize(FrameHeader::kSize + data->GetSize());
+
+  FrameHeader header;
+  header.length = static_cast<std::uint32_t>(data->GetSize());
+  header.Encode(frame->GetData());
+  std::copy(data->GetBegin(), data->GetEnd(), frame->GetData() + FrameHeader::kSize);
+
+  return frame;
+}
+
+FrameReceiver::FrameReceiver(std::size_t max_message_size) :
+  max_message_size_{max_message_size},
+  buffer_{CreateUninitializedBufferWithSize(kReceiveBufferSize)} {}
+
+std::uint8_t* FrameReceiver::PrepareSpace(std::size_t *size) {
+  if (start_ > 0 && buffer_.use_count() > 1) {
+    // Frames we handed out are still in use so we continue in a
+    // buffer nobody references anymore.
+    auto next = std::find_if(spare_buffers_.begin(), spare_buffers_.end(),
+                             [](const BufferPtr &buffer) { return buffer.use_count() == 1; });
+    BufferPtr buffer;
+    if (next != spare_buffers_.end()) {
+      buffer = *next;
+      *next = buffer_;
+    } else {
+      buffer = CreateUninitializedBufferWithSize(kReceiveBufferSize);
+      if (spare_buffers_.size() < kMaxSpareReceiveBuffers)
+        spare_buffers_.push_back(buffer_);
+    }
+    // Whoever released the buffer last must be done with its memory
+    // before we write to it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    std::memcpy(buffer->GetData(), buffer_->GetData() + start_, end_ - start_);
+    buffer_ = buffer;
+    end_ -= start_;
+    start_ = 0;
+  } else if (start_ > 0) {
+    // Only an incomplete frame is left which we move to the front so
+    // that the next read gets as much space as possible.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    std::memmove(buffer_->GetData(), buffer_->GetData() + start_, end_ - start_);
+    end_ -= start_;
+    start_ = 0;
+  }
+
+  *size = buffer_->GetSize() - end_;
+  return buffer_->GetData() + end_;
+}
+
+void FrameReceiver::Commit(std::size_t size) {
+  end_ += size;
+}
+
+asio::error_code FrameReceiver::Validate(const FrameHeader &header) const {
+  if (header.version != FrameHeader::kVersion) {
+    ERROR("Received frame with unsupported version %d", static_cast<int>(header.version));
+    return asio::error::invalid_argument;
+  }
+
+  // We never accept anything beyond the limit as we can't
+  // resynchronize the stream afterwards anyway. The owner of the
+  // messenger is expected to close it.
+  const auto assembled = assembly_ ? assembly_->GetSize() - FrameHeader::kSize : 0;
+  if (header.length > kFrameChunkSize || assembled + header.length > max_message_size_) {
+    ERROR("Message exceeds maximum size of %d bytes", max_message_size_);
+    return asio::error::message_size;
+  }
+
+  if ((header.flags & FrameHeader::Detached) && (header.length > 0 || assembly_)) {
+    ERROR("Received invalid detached frame");
+    return asio::error::invalid_argument;
+  }
+
+  return asio::error_code{};
+}
+
+FrameReceiver::Result FrameReceiver::Deliver(const Messenger::ReadHandler &handler) {
+  const auto data = buffer_->GetData();
+  auto start = start_;
+  auto pos = start_;
+
+  while (end_ - pos >= FrameHeader::kSize) {
+    const auto header = FrameHeader::Decode(data + pos);
+    const auto err = Validate(header);
+    if (err) {
+      // Hand out all good frames first, the error is reported with
+      // the next call.
+      if (pos > start)
+        break;
+      handler(err, nullptr);
+      return Result::Delivered;
+    }
+
+    const auto frame_size = FrameHeader::kSize + header.length;
+    if (end_ - pos < frame_size)
+      break;
+
+    const bool more = header.flags & FrameHeader::More;
+    const bool detached = header.flags & FrameHeader::Detached;
+    if (!more && !detached && !assembly_) {
+      pos += frame_size;
+      continue;
+    }
+
+    // All complete frames in front of a detached or chunked message
+    // have to go out first.
+    if (pos > start)
+      break;
+
+    if (detached) {
+      start_ = pos + frame_size;
+      return Result::Detached;
+    }
+
+    // Frames of a chunked message are collected into a separate
+    // buffer which gets a single frame header once complete.
+    if (!assembly_)
+      assembly_ = CreateUninitializedBufferWithSize(FrameHeader::kSize);
+
+    const auto offset = assembly_->GetSize();
+    assembly_->Resize(offset + header.length);
+    std::memcpy(assembly_->GetData() + offset, data + pos + FrameHeader::kSize, header.length);
+
+    pos += frame_size;
+    start = start_ = pos;
+
+    if (!more) {
+      FrameHeader assembled;
+      assembled.length = static_cast<std::uint32_t>(assembly_->GetSize() - FrameHeader::kSize);
+      assembled.Encode(assembly_->GetData());
+
+      auto message = std::move(assembly_);
+      assembly_.reset();
+      handler(asio::error_code{}, message);
+      return Result::Delivered;
+    }
+  }
+
+  if (pos == start)
+    return Result::NeedMoreData;
+
+  // Hand out all complete frames at once without copying them.
+  start_ = pos;
+  handler(asio::error_code{}, CreateBufferSlice(buffer_, start, pos - start));
+  return Result::Delivered;
+}
+} // namespace binderd
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_FRAME_H_
+#define BINDERD_FRAME_H_
+
+#include "binderd/buffer.h"
+#include "binderd/messenger.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace binderd {
+// Every message written to a messenger is prefixed with a frame header
+// on the wire. The header starts with a version byte so that we can
+// change the framing later without misinterpreting the stream of an
+// older peer, followed by a flags byte, two reserved bytes and the
+// length of the payload following the header as 32 bit value in
+// network byte order.
+//
+// Messages larger than kFrameChunkSize are split into several frames
+// where all but the last one carry the More flag. The receiver appends
+// the payloads of all frames until it sees one without the flag.
+struct FrameHeader {
+  enum Flags : std::uint8_t {
+    None = 0,
+    More = (1 << 0),
+    // The message was sent over a different channel of the messenger
+    // and the empty frame only marks its position in the stream.
+    Detached = (1 << 1),
+  };
+
+  static constexpr std::uint8_t kVersion{1};
+  static constexpr std::size_t kSize{8};
+
+  void Encode(std::uint8_t *data) const;
+  static FrameHeader Decode(const std::uint8_t *data);
+
+  std::uint8_t version = kVersion;
+  std::uint8_t flags = Flags::None;
+  std::uint32_t length = 0;
+};
+
+// Prefixes data with a single frame header. This is the format the
+// read handler of a messenger and MessageParser expect.
+BufferPtr CreateFrame(const BufferPtr &data);
+
+// FrameReceiver collects the bytes a messenger reads from its peer and
+// hands out all complete frames at once as a slice of its buffer. An
+// incomplete frame is kept until the rest of it arrives. Messages split
+// into several frames are reassembled into a separate buffer.
+//
+// As long as anybody holds on to frames handed out the buffer is not
+// touched anymore and reading continues in a spare one.
+class FrameReceiver {
+ public:
+  enum class Result {
+    // Not a single complete frame is available
+    NeedMoreData,
+    // The handler was called with frames or an error
+    Delivered,
+    // The next message is a detached one which the messenger has to
+    // get from its other channel
+    Detached,
+  };
+
+  explicit FrameReceiver(std::size_t max_message_size);
+
+  // Returns where the next read should store its data. All frames
+  // handed out before are dropped from the buffer, which moves to
+  // another one if they are still in use.
+  std::uint8_t* PrepareSpace(std::size_t *size);
+  void Commit(std::size_t size);
+
+  Result Deliver(const Messenger::ReadHandler &handler);
+
+ private:
+  asio::error_code Validate(const FrameHeader &header) const;
+
+  std::size_t max_message_size_;
+  BufferPtr buffer_;
+  // Buffers we read into before which are reused once nobody
+  // references frames in them anymore.
+  std::vector<BufferPtr> spare_buffers_;
+  std::size_t start_ = 0;
+  std::size_t end_ = 0;
+  BufferPtr assembly_;
+};
+} // namespace binderd
+
+#endif
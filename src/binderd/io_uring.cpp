@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "binderd/io_uring.h"
+#include "binderd/logger.h"
+
+#ifdef BINDERD_HAVE_IO_URING
+#include <algorithm>
+#include <mutex>
+
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+constexpr const unsigned int kNumEntries{256};
+// Receive buffers are shared by all receive operations and handed
+// back to the kernel as soon as the data was passed on.
+constexpr const unsigned int kNumReceiveBuffers{256};
+constexpr const std::size_t kReceiveBufferSize{64 * 1024};
+constexpr const std::uint16_t kReceiveBufferGroup{0};
+// The kernel doesn't allow more than 253 fds per message anyway
+constexpr const std::size_t kMaxFdsPerReceive{253};
+
+int io_uring_setup(unsigned int entries, io_uring_params *params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int num_args) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, num_args));
+}
+
+asio::error_code make_error(int res) {
+  if (res == -ECANCELED)
+    return asio::error::operation_aborted;
+  return asio::error_code(-res, asio::error::get_system_category());
+}
+}
+
+namespace binderd {
+struct IoUring::Implementation {
+  struct Operation {
+    int fd = -1;
+    ReceiveHandler receive_handler;
+    SendHandler send_handler;
+    msghdr msg;
+    std::vector<iovec> iov;
+    std::vector<std::uint8_t> control;
+    std::vector<Fd> fds;
+  };
+
+  explicit Implementation(const std::shared_ptr<asio::io_service> &io);
+  ~Implementation();
+
+  bool Setup();
+  bool SetupReceiveBuffers();
+  bool ProbeMultishotReceive();
+
+  io_uring_sqe* GetSqe();
+  void Submit();
+  void Enter();
+  void PrepareReceive(io_uring_sqe *sqe, Operation *op);
+  void PrepareSend(io_uring_sqe *sqe, Operation *op);
+
+  void WaitForCompletions();
+  void ProcessCompletions();
+  void Dispatch(const io_uring_cqe &cqe);
+  void OnReceive(Operation *op, const io_uring_cqe &cqe);
+  void OnSend(Operation *op, const io_uring_cqe &cqe);
+  void ReturnBuffer(std::uint16_t id);
+  void Cancel(std::uint64_t id);
+
+  std::shared_ptr<asio::io_service> io;
+  int ring_fd = -1;
+  io_uring_params params;
+
+  void *sq_ring = MAP_FAILED;
+  std::size_t sq_ring_size = 0;
+  void *cq_ring = MAP_FAILED;
+  std::size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  std::size_t sqes_size = 0;
+
+  unsigned int *sq_head = nullptr;
+  unsigned int *sq_tail = nullptr;
+  unsigned int *sq_flags = nullptr;
+  unsigned int *sq_array = nullptr;
+  unsigned int sq_mask = 0;
+  unsigned int sq_entries = 0;
+  unsigned int *cq_head = nullptr;
+  unsigned int *cq_tail = nullptr;
+  unsigned int cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+
+  // Submissions made while we process completions are collected and
+  // handed to the kernel with a single call afterwards.
+  std::mutex sq_lock;
+  unsigned int sq_local_tail = 0;
+  unsigned int num_unsubmitted = 0;
+  bool processing = false;
+
+  io_uring_buf_ring *buffer_ring = nullptr;
+  std::size_t buffer_ring_size = 0;
+  std::vector<std::uint8_t> buffers;
+  std::uint16_t buffer_tail = 0;
+
+  Fd event_fd;
+  asio::posix::stream_descriptor wakeup;
+  std::uint64_t wakeup_value = 0;
+};
+
+IoUring::Implementation::Implementation(const std::shared_ptr<asio::io_service> &io) :
+  io{io},
+  wakeup{*io} {
+  std::memset(&params, 0, sizeof(params));
+}
+
+IoUring::Implementation::~Implementation() {
+  asio::error_code err;
+  wakeup.close(err);
+
+  // Closing the ring cancels everything still in flight
+  if (ring_fd >= 0)
+    ::close(ring_fd);
+  if (buffer_ring)
+    ::munmap(buffer_ring, buffer_ring_size);
+  if (sqes)
+    ::munmap(sqes, sqes_size);
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    ::munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED)
+    ::munmap(sq_ring, sq_ring_size);
+}
+
+bool IoUring::Implementation::Setup() {
+  params.flags = IORING_SETUP_CLAMP;
+  ring_fd = io_uring_setup(kNumEntries, &params);
+  if (ring_fd < 0) {
+    WARNING("Failed to setup io_uring: %s", strerror(errno));
+    return false;
+  }
+
+  // Without fast poll every socket operation would end up on a kernel
+  // worker thread which defeats the purpose.
+  if (!(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP)) {
+    WARNING("Kernel lacks io_uring features we depend on");
+    return false;
+  }
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+  sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return false;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      return false;
+  }
+
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  auto sqes_memory = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd, IORING_OFF_SQES);
+  if (sqes_memory == MAP_FAILED)
+    return false;
+  sqes = reinterpret_cast<io_uring_sqe*>(sqes_memory);
+
+  auto sq = reinterpret_cast<std::uint8_t*>(sq_ring);
+  sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+  sq_flags = reinterpret_cast<unsigned int*>(sq + params.sq_off.flags);
+  sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+  sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+  sq_entries = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_entries);
+  sq_local_tail = *sq_tail;
+
+  auto cq = reinterpret_cast<std::uint8_t*>(cq_ring);
+  cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+  cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  if (!SetupReceiveBuffers() || !ProbeMultishotReceive())
+    return false;
+
+  event_fd = Fd{::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+  int fd = event_fd;
+  if (fd < 0 || io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &fd, 1) < 0)
+    return false;
+
+  asio::error_code err;
+  wakeup.assign(::dup(event_fd), err);
+  if (err)
+    return false;
+
+  WaitForCompletions();
+  return true;
+}
+
+bool IoUring::Implementation::SetupReceiveBuffers() {
+  buffer_ring_size = kNumReceiveBuffers * sizeof(io_uring_buf);
+  auto memory = ::mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return false;
+  buffer_ring = reinterpret_cast<io_uring_buf_ring*>(memory);
+
+  io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<std::uint64_t>(buffer_ring);
+  reg.ring_entries = kNumReceiveBuffers;
+  reg.bgid = kReceiveBufferGroup;
+  if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    WARNING("Failed to register receive buffers: %s", strerror(errno));
+    return false;
+  }
+
+  buffers.resize(kNumReceiveBuffers * kReceiveBufferSize);
+  for (std::uint16_t id = 0; id < kNumReceiveBuffers; id++)
+    ReturnBuffer(id);
+
+  return true;
+}
+
+bool IoUring::Implementation::ProbeMultishotReceive() {
+  // Multishot receives with ancillary data arrived later than the
+  // other features we use and can't be detected through the probe
+  // interface. We simply try one on a socket pair.
+  int sockets[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+    return false;
+  Fd first{sockets[0]}, second{sockets[1]};
+
+  Operation op;
+  op.fd = first;
+  auto sqe = GetSqe();
+  PrepareReceive(sqe, &op);
+  sqe->user_data = 0;
+  num_unsubmitted++;
+
+  const std::uint8_t byte = 0;
+  if (::write(second, &byte, sizeof(byte)) != sizeof(byte))
+    return false;
+
+  Enter();
+  if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+    return false;
+
+  auto head = *cq_head;
+  const auto cqe = cqes[head & cq_mask];
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+  if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+    ReturnBuffer(static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+
+  const bool supported = cqe.res > 0 && (cqe.flags & IORING_CQE_F_MORE);
+  if (!supported) {
+    WARNING("Kernel does not support multishot receives");
+    return false;
+  }
+
+  // Closing the peer terminates the operation. Its last completion is
+  // dropped before we start to dispatch any.
+  second = Fd{};
+  if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+    return false;
+
+  head = *cq_head;
+  for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+    const auto &last = cqes[head & cq_mask];
+    if (last.flags & IORING_CQE_F_BUFFER)
+      ReturnBuffer(static_cast<std::uint16_t>(last.flags >> IORING_CQE_BUFFER_SHIFT));
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  return supported;
+}
+
+void IoUring::Implementation::ReturnBuffer(std::uint16_t id) {
+  // The ring is a plain array of io_uring_buf whose first entry also
+  // holds the tail. We don't use the bufs member as the flexible array
+  // emulation of the kernel headers places it at a wrong offset in C++.
+  auto bufs = reinterpret_cast<io_uring_buf*>(buffer_ring);
+  auto &buffer = bufs[buffer_tail & (kNumReceiveBuffers - 1)];
+  buffer.addr = reinterpret_cast<std::uint64_t>(buffers.data() + id * kReceiveBufferSize);
+  buffer.len = kReceiveBufferSize;
+  buffer.bid = id;
+  buffer_tail++;
+  __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* IoUring::Implementation::GetSqe() {
+  // The kernel consumes all entries on enter so a full queue only
+  // needs to be flushed.
+  if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    Enter();
+  if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    return nullptr;
+
+  const auto index = sq_local_tail & sq_mask;
+  auto sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sq_local_tail++;
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+void IoUring::Implementation::Submit() {
+  num_unsubmitted++;
+  if (!processing)
+    Enter();
+}
+
+void IoUring::Implementation::Enter() {
+  while (num_unsubmitted > 0) {
+    const auto submitted = io_uring_enter(ring_fd, num_unsubmitted, 0, 0);
+    if (submitted < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR("Failed to submit to io_uring: %s", strerror(errno));
+      return;
+    }
+    num_unsubmitted -= static_cast<unsigned int>(submitted);
+  }
+}
+
+void IoUring::Implementation::PrepareReceive(io_uring_sqe *sqe, Operation *op) {
+  // The data, ancillary data and a small header describing both are
+  // placed together in one of the registered buffers.
+  op->control.resize(CMSG_SPACE(sizeof(int) * kMaxFdsPerReceive));
+  std::memset(&op->msg, 0, sizeof(op->msg));
+  op->msg.msg_controllen = op->control.size();
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = op->fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&op->msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_CMSG_CLOEXEC;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kReceiveBufferGroup;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+}
+
+void IoUring::Implementation::PrepareSend(io_uring_sqe *sqe, Operation *op) {
+  std::memset(&op->msg, 0, sizeof(op->msg));
+  op->msg.msg_iov = op->iov.data();
+  op->msg.msg_iovlen = op->iov.size();
+
+  if (!op->fds.empty()) {
+    op->control.resize(CMSG_SPACE(sizeof(int) * op->fds.size()));
+    op->msg.msg_control = op->control.data();
+    op->msg.msg_controllen = op->control.size();
+
+    auto cmsg = CMSG_FIRSTHDR(&op->msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * op->fds.size());
+    auto fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+    for (const auto &fd : op->fds)
+      *fds++ = fd;
+  }
+
+  // With MSG_WAITALL the kernel retries short sends itself so that a
+  // completion normally covers all of the data.
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = op->fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&op->msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+}
+
+void IoUring::Implementation::WaitForCompletions() {
+  wakeup.async_read_some(asio::buffer(&wakeup_value, sizeof(wakeup_value)),
+                         [this](const asio::error_code &err, std::size_t) {
+    if (err)
+      return;
+    ProcessCompletions();
+    WaitForCompletions();
+  });
+}
+
+void IoUring::Implementation::ProcessCompletions() {
+  {
+    std::lock_guard<std::mutex> l(sq_lock);
+    processing = true;
+  }
+
+  auto head = *cq_head;
+  while (true) {
+    const auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // Completions which didn't fit into the queue are kept by the
+      // kernel until we ask for them.
+      if (!(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+        break;
+      io_uring_enter(ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+      continue;
+    }
+
+    const auto cqe = cqes[head & cq_mask];
+    head++;
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    Dispatch(cqe);
+  }
+
+  std::lock_guard<std::mutex> l(sq_lock);
+  processing = false;
+  Enter();
+}
+
+void IoUring::Implementation::Dispatch(const io_uring_cqe &cqe) {
+  auto op = reinterpret_cast<Operation*>(cqe.user_data);
+  if (!op)
+    return;
+
+  if (op->receive_handler)
+    OnReceive(op, cqe);
+  else
+    OnSend(op, cqe);
+}
+
+void IoUring::Implementation::OnReceive(Operation *op, const io_uring_cqe &cqe) {
+  const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (cqe.res < 0) {
+    // Running out of buffers only stops the operation. The owner is
+    // expected to start a new one.
+    const auto err = cqe.res == -ENOBUFS ? asio::error_code{} : make_error(cqe.res);
+    op->receive_handler(err, nullptr, 0, std::vector<Fd>{}, more);
+    if (!more)
+      delete op;
+    return;
+  }
+
+  const auto id = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+  auto data = buffers.data() + id * kReceiveBufferSize;
+  auto out = reinterpret_cast<const io_uring_recvmsg_out*>(data);
+  auto control = data + sizeof(io_uring_recvmsg_out) + op->msg.msg_namelen;
+  auto payload = control + op->msg.msg_controllen;
+
+  std::vector<Fd> fds;
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = out->controllen;
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    const auto num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const auto received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+    for (std::size_t n = 0; n < num_fds; n++)
+      fds.push_back(Fd{received[n]});
+  }
+
+  asio::error_code err;
+  if (out->flags & MSG_CTRUNC)
+    err = asio::error::no_buffer_space;
+  else if (out->payloadlen == 0 && fds.empty())
+    err = asio::error::eof;
+
+  op->receive_handler(err, payload, out->payloadlen, std::move(fds), more);
+  ReturnBuffer(id);
+
+  if (!more)
+    delete op;
+  else if (err)
+    Cancel(reinterpret_cast<std::uint64_t>(op));
+}
+
+void IoUring::Implementation::Cancel(std::uint64_t id) {
+  std::lock_guard<std::mutex> l(sq_lock);
+  auto sqe = GetSqe();
+  if (!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = id;
+  sqe->user_data = 0;
+  Submit();
+}
+
+void IoUring::Implementation::OnSend(Operation *op, const io_uring_cqe &cqe) {
+  if (cqe.res < 0) {
+    op->send_handler(make_error(cqe.res));
+    delete op;
+    return;
+  }
+
+  // Skip over whatever was sent already and try again with the rest
+  auto sent = static_cast<std::size_t>(cqe.res);
+  std::vector<iovec> remaining;
+  for (const auto &iov : op->iov) {
+    if (sent >= iov.iov_len) {
+      sent -= iov.iov_len;
+      continue;
+    }
+    remaining.push_back(iovec{reinterpret_cast<std::uint8_t*>(iov.iov_base) + sent, iov.iov_len - sent});
+    sent = 0;
+  }
+
+  if (remaining.empty()) {
+    op->send_handler(asio::error_code{});
+    delete op;
+    return;
+  }
+
+  op->iov = std::move(remaining);
+  op->fds.clear();
+  op->control.clear();
+
+  std::lock_guard<std::mutex> l(sq_lock);
+  auto sqe = GetSqe();
+  if (!sqe) {
+    op->send_handler(asio::error::no_buffer_space);
+    delete op;
+    return;
+  }
+  PrepareSend(sqe, op);
+  Submit();
+}
+
+std::shared_ptr<IoUring> IoUring::Create(const std::shared_ptr<asio::io_service> &io) {
+  auto uring = std::shared_ptr<IoUring>(new IoUring(io));
+  if (!uring->impl->Setup())
+    return nullptr;
+  return uring;
+}
+
+IoUring::IoUring(const std::shared_ptr<asio::io_service> &io) :
+  impl{new Implementation(io)} {}
+
+IoUring::~IoUring() {}
+
+std::uint64_t IoUring::Receive(int fd, const ReceiveHandler &handler) {
+  auto op = new Implementation::Operation;
+  op->fd = fd;
+  op->receive_handler = handler;
+
+  std::lock_guard<std::mutex> l(impl->sq_lock);
+  auto sqe = impl->GetSqe();
+  if (!sqe) {
+    delete op;
+    impl->io->post([handler]() {
+      handler(asio::error::no_buffer_space, nullptr, 0, std::vector<Fd>{}, false);
+    });
+    return 0;
+  }
+
+  impl->PrepareReceive(sqe, op);
+  impl->Submit();
+  return reinterpret_cast<std::uint64_t>(op);
+}
+
+void IoUring::Send(int fd,
+                   const std::vector<asio::const_buffer> &buffers,
+                   const std::vector<Fd> &fds,
+                   const SendHandler &handler) {
+  auto op = new Implementation::Operation;
+  op->fd = fd;
+  op->send_handler = handler;
+  op->fds = fds;
+  op->iov.reserve(buffers.size());
+  for (const auto &buffer : buffers)
+    op->iov.push_back(iovec{const_cast<void*>(asio::buffer_cast<const void*>(buffer)),
+                            asio::buffer_size(buffer)});
+
+  std::lock_guard<std::mutex> l(impl->sq_lock);
+  auto sqe = impl->GetSqe();
+  if (!sqe) {
+    delete op;
+    impl->io->post([handler]() { handler(asio::error::no_buffer_space); });
+    return;
+  }
+
+  impl->PrepareSend(sqe, op);
+  impl->Submit();
+}
+
+void IoUring::Cancel(std::uint64_t id) {
+  if (id != 0)
+    impl->Cancel(id);
+}
+} // namespace binderd
+#else
+namespace binderd {
+struct IoUring::Implementation {};
+
+std::shared_ptr<IoUring> IoUring::Create(const std::shared_ptr<asio::io_service>&) {
+  WARNING("binderd was built without io_uring support");
+  return nullptr;
+}
+
+IoUring::IoUring(const std::shared_ptr<asio::io_service>&) {}
+
+IoUring::~IoUring() {}
+
+std::uint64_t IoUring::Receive(int, const ReceiveHandler&) {
+  return 0;
+}
+
+void IoUring::Send(int, const std::vector<asio::const_buffer>&, const std::vector<Fd>&, const SendHandler&) {
+}
+
+void IoUring::Cancel(std::uint64_t) {
+}
+} // namespace binderd
+#endif
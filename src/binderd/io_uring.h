@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_IO_URING_H_
+#define BINDERD_IO_URING_H_
+
+#include "binderd/macros.h"
+#include "binderd/common/fd.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <asio.hpp>
+
+namespace binderd {
+// IoUring drives socket operations through an io_uring instance and
+// dispatches their completions from an asio::io_service. The kernel
+// signals completions through an eventfd which asio waits on, so both
+// can live on the same threads.
+//
+// Receives are multishot operations drawing from a ring of buffers
+// registered with the kernel. A single submission keeps delivering
+// data until it is canceled or the peer goes away.
+class IoUring {
+ public:
+  // Called for every chunk of data received. data is only valid for
+  // the duration of the call. more is false for the last call of a
+  // receive operation which then either carries an error or tells
+  // that the operation has to be started again.
+  using ReceiveHandler = std::function<void(const asio::error_code &err,
+                                            const std::uint8_t *data,
+                                            std::size_t size,
+                                            std::vector<Fd> fds,
+                                            bool more)>;
+  using SendHandler = std::function<void(const asio::error_code &err)>;
+
+  // Returns nullptr if io_uring or one of the features we rely on is
+  // not available.
+  static std::shared_ptr<IoUring> Create(const std::shared_ptr<asio::io_service> &io);
+
+  ~IoUring();
+
+  std::uint64_t Receive(int fd, const ReceiveHandler &handler);
+  // All buffers are sent in order, fds go with the first byte.
+  void Send(int fd,
+            const std::vector<asio::const_buffer> &buffers,
+            const std::vector<Fd> &fds,
+            const SendHandler &handler);
+  void Cancel(std::uint64_t id);
+
+ private:
+  struct Implementation;
+
+  explicit IoUring(const std::shared_ptr<asio::io_service> &io);
+
+  std::unique_ptr<Implementation> impl;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUring);
+};
+} // namespace binderd
+
+#endif
@@ -21,67 +21,126 @@
 
 #include <memory.h>
 
-namespace binderd {
-struct Message::Implementation {
-  Implementation(const Message::Type &type) : type{type}, cookie{0}, destination{0}, data{CreateBufferWithSize(0)} {}
+#include <algorithm>
+#include <stdexcept>
 
-  Message::Type type;
-  std::uint64_t cookie;
-  std::uint64_t destination;
-  BufferPtr data;
-};
+namespace {
+// Offsets of the header fields inside a packed message. See Pack().
+constexpr const std::size_t kDestinationOffset{4};
+constexpr const std::size_t kCookieOffset{12};
+}
 
-std::shared_ptr<Message> Message::Create(const Type &type) {
-  return std::shared_ptr<Message>(new Message(type));
+namespace binderd {
+constexpr const std::size_t Message::kHeaderSize;
+
+RefPtr<Message> Message::Create(const Type &type) {
+  RefPtr<Message> msg{new Message(type)};
+  msg->payload_ = CreateBufferWithSize(0);
+  return msg;
 }
 
-std::shared_ptr<Message> Message::CreateFromData(const BufferPtr &data, const std::size_t &offset) {
-  auto msg = Create();
+RefPtr<Message> Message::CreateFromData(const BufferPtr &data, const std::size_t &offset) {
+  RefPtr<Message> msg{new Message(Type::Unknown)};
   msg->Unpack(data, offset);
   return msg;
 }
 
-Message::Message(const Type &type) : impl{new Message::Implementation{type}} {}
+Message::Message(const Type &type) : type_{type} {}
 
 Message::~Message() {}
 
-Message::Type Message::GetType() const { return impl->type; }
+void Message::DetachFromFrame() {
+  if (!frame_valid_)
+    return;
+
+  auto copy = CreateUninitializedBufferWithSize(payload_->GetSize());
+  std::copy(payload_->GetBegin(), payload_->GetEnd(), copy->GetData());
+  payload_ = copy;
+  frame_valid_ = false;
+}
+
+void Message::PatchFrame(std::size_t offset, std::uint64_t value) {
+  if (!frame_valid_)
+    return;
+  ::memcpy(frame_buffer_->GetData() + offset, &value, sizeof(value));
+}
+
+Message::Type Message::GetType() const { return type_; }
 
-std::uint64_t Message::GetCookie() const { return impl->cookie; }
+std::uint64_t Message::GetCookie() const { return cookie_; }
 
-std::uint64_t Message::GetDestination() const { return impl->destination; }
+std::uint64_t Message::GetDestination() const { return destination_; }
 
-BinaryReader Message::GetReader() const { return BinaryReader(impl->data, 0); }
+BinaryReader Message::GetReader() const { return BinaryReader(payload_, 0); }
 
-BinaryWriter Message::GetWriter() { return BinaryWriter(impl->data); }
+BinaryWriter Message::GetWriter() {
+  DetachFromFrame();
+  return BinaryWriter(payload_);
+}
 
 void Message::SetCookie(std::uint64_t cookie) {
-  impl->cookie = cookie;
+  cookie_ = cookie;
+  PatchFrame(kCookieOffset, cookie);
 }
 
 void Message::SetDestination(std::uint64_t destination) {
-  impl->destination = destination;
+  destination_ = destination;
+  PatchFrame(kDestinationOffset, destination);
+}
+
+const std::vector<Fd>& Message::GetFds() const {
+  return fds_;
+}
+
+void Message::SetFds(const std::vector<Fd> &fds) {
+  fds_ = fds;
 }
 
 std::size_t Message::Unpack(const BufferPtr &data, const std::size_t &offset) {
   BinaryReader reader(data, offset);
-  impl->type = static_cast<Type>(reader.ReadUint32());
-  impl->destination = reader.ReadUint64();
-  impl->cookie = reader.ReadUint64();
-  impl->data = reader.ReadSizedData();
-  return reader.GetBytesRead();
+  type_ = static_cast<Type>(reader.ReadUint32());
+  destination_ = reader.ReadUint64();
+  cookie_ = reader.ReadUint64();
+
+  const auto payload_size = reader.ReadInt32();
+  const auto size = kHeaderSize + ((static_cast<std::size_t>(payload_size) + 3) & ~3);
+  if (payload_size < 0 || size > data->GetSize() - offset)
+    throw std::out_of_range{"Read buffer exhausted"};
+
+  // We share the memory of the buffer we're unpacking from instead of
+  // copying the message out of it. Messengers never reuse a receive
+  // buffer somebody still holds a slice of. Pack() hands out the
+  // whole packed message again as is.
+  if (offset == 0 && size == data->GetSize())
+    frame_buffer_ = data;
+  else
+    frame_buffer_ = CreateBufferSlice(data, offset, size);
+  frame_size_ = size;
+  payload_ = CreateBufferSlice(frame_buffer_, kHeaderSize, static_cast<std::size_t>(payload_size));
+  frame_valid_ = true;
+
+  return size;
 }
 
 BufferPtr Message::Pack() const {
-  auto data = CreateBufferWithSize(0);
+  if (frame_valid_)
+    return frame_buffer_;
+
+  auto data = CreateBufferWithCapacity(GetPackedSize());
   BinaryWriter writer(data);
-  writer.WriteUint32(static_cast<std::uint32_t>(impl->type));
-  writer.WriteUint64(impl->destination);
-  writer.WriteUint64(impl->cookie);
-  writer.WriteSizedData(impl->data);
+  writer.WriteUint32(static_cast<std::uint32_t>(type_));
+  writer.WriteUint64(destination_);
+  writer.WriteUint64(cookie_);
+  writer.WriteSizedData(payload_);
   return data;
 }
 
+std::size_t Message::GetPackedSize() const {
+  if (frame_valid_)
+    return frame_size_;
+  return kHeaderSize + ((payload_->GetSize() + 3) & ~3);
+}
+
 std::ostream& operator<<(std::ostream &out, const Message::Type &type) {
   switch (type) {
   case Message::Type::Unknown:
@@ -120,6 +179,12 @@ std::ostream& operator<<(std::ostream &out, const Message::Type &type) {
   case Message::Type::Status:
     out << "status";
     break;
+  case Message::Type::SetOptions:
+    out << "set-options";
+    break;
+  case Message::Type::UpdateReferences:
+    out << "update-references";
+    break;
   default:
     break;
   }
@@ -21,13 +21,17 @@
 #include "binderd/buffer.h"
 #include "binderd/common/binary_writer.h"
 #include "binderd/common/binary_reader.h"
+#include "binderd/common/fd.h"
+#include "binderd/common/ref_counted.h"
+#include "binderd/common/slab_allocator.h"
 
 #include <memory>
 #include <ostream>
+#include <vector>
 #include <cstdint>
 
 namespace binderd {
-class Message {
+class Message : public RefCounted<Message>, public slab::Allocated {
  public:
   enum class Type : std::uint32_t {
     Unknown = 0,
@@ -61,13 +65,32 @@ class Message {
     // Status is sent as reply for all non transaction messages like
     // SetContextMgr and carries a int32_t status field.
     Status,
+
+    // SetOptions changes how the server treats the session and carries
+    // a uint32_t field of Option bits.
+    SetOptions,
+
+    // UpdateReferences carries a uint32_t count followed by pairs of a
+    // uint64_t handle and the int32_t change of its reference count.
+    // It is not answered.
+    UpdateReferences,
   };
 
-  static std::shared_ptr<Message> Create(const Type &GetType = Type::Unknown);
-  static std::shared_ptr<Message> CreateFromData(const BufferPtr &data,
-                                                 const std::size_t &offset = 0);
+  enum class Option : std::uint32_t {
+    // Successful delivery of a two-way transaction is not acknowledged
+    // with a Status anymore as the reply implies it. Failures still
+    // are.
+    AckFailedDeliveryOnly = 0x1,
+  };
 
-  ~Message();
+  // Size of the fixed header of a packed message: type, destination,
+  // cookie and payload size.
+  static constexpr const std::size_t kHeaderSize{24};
+
+  static RefPtr<Message> Create(const Type &GetType = Type::Unknown);
+  // Messages created from a buffer share its memory and keep it alive.
+  static RefPtr<Message> CreateFromData(const BufferPtr &data,
+                                        const std::size_t &offset = 0);
 
   BinaryWriter GetWriter();
   BinaryReader GetReader() const;
@@ -79,16 +102,49 @@ class Message {
   void SetCookie(std::uint64_t cookie);
   void SetDestination(std::uint64_t destination);
 
+  // Fds are not part of the packed message but travel next to it as
+  // ancillary data of the messenger.
+  const std::vector<Fd>& GetFds() const;
+  void SetFds(const std::vector<Fd> &fds);
+
+  // Messages which were unpacked and not written to since return the
+  // buffer they were unpacked from with the current cookie and
+  // destination patched in. Changes made in place to their payload
+  // are part of it.
   BufferPtr Pack() const;
   std::size_t Unpack(const BufferPtr &data, const std::size_t &offset = 0);
 
+  // Number of bytes Pack() produces.
+  std::size_t GetPackedSize() const;
+
  private:
+  friend class RefCounted<Message>;
+
   Message(const Type &GetType);
+  ~Message();
 
-  struct Implementation;
-  std::unique_ptr<Implementation> impl;
+  // Once the payload is changed in size the packed message we got
+  // it from doesn't reflect it anymore.
+  void DetachFromFrame();
+  void PatchFrame(std::size_t offset, std::uint64_t value);
+
+  Type type_;
+  std::uint64_t cookie_ = 0;
+  std::uint64_t destination_ = 0;
+  BufferPtr payload_;
+  std::vector<Fd> fds_;
+  // A message we unpacked keeps its packed form around with the
+  // payload pointing into it. That allows forwarding it again without
+  // copying anything. The frame stays alive even when detached as
+  // readers might still point into it. It is a slice of the buffer
+  // we unpacked from.
+  std::size_t frame_size_ = 0;
+  BufferPtr frame_buffer_;
+  bool frame_valid_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(Message);
 };
-typedef std::shared_ptr<Message> MessagePtr;
+typedef RefPtr<Message> MessagePtr;
 std::ostream& operator<<(std::ostream &out, const Message::Type &type);
 std::ostream& operator<<(std::ostream &out, const Message &msg);
 } // namespace binderd
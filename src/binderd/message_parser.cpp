@@ -16,6 +16,8 @@
  */
 
 #include "binderd/message_parser.h"
+#include "binderd/frame.h"
+#include "binderd/logger.h"
 
 namespace binderd {
 MessageParser::MessageParser(const BufferPtr &buffer, const std::size_t &size) :
@@ -24,15 +26,24 @@ MessageParser::MessageParser(const BufferPtr &buffer, const std::size_t &size) :
 MessageParser::~MessageParser() {}
 
 MessagePtr MessageParser::Next() {
-  if (consumed >= bytes_available)
+  if (bytes_available - consumed < FrameHeader::kSize)
     return nullptr;
 
-  auto msg = Message::Create();
-  const auto used = msg->Unpack(buffer, consumed);
-  if (used <= 0)
+  const auto header = FrameHeader::Decode(buffer->GetData() + consumed);
+  if (bytes_available - consumed - FrameHeader::kSize < header.length)
     return nullptr;
 
-  consumed += used;
+  // Limit the message to its frame so that a malformed one can't make
+  // us read into the next frame.
+  auto frame = CreateBufferSlice(buffer, consumed + FrameHeader::kSize, header.length);
+  auto msg = Message::CreateFromData(frame);
+  const auto used = msg->GetPackedSize();
+  if (used != header.length) {
+    WARNING("Message size %d does not match its frame size %d", used, header.length);
+    return nullptr;
+  }
+
+  consumed += FrameHeader::kSize + header.length;
 
   return msg;
 }
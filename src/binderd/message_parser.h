@@ -22,6 +22,11 @@
 #include "binderd/message.h"
 
 namespace binderd {
+// Parses all messages out of a buffer holding one or more complete
+// frames as handed out by a messenger. Every frame carries exactly
+// one message; messages split into several frames on the wire are
+// reassembled by the messenger before they reach us. The messages
+// share the memory of the buffer rather than copying out of it.
 class MessageParser {
  public:
   explicit MessageParser(const BufferPtr &buffer, const std::size_t &size);
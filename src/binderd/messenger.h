@@ -19,8 +19,10 @@
 #define BINDERD_MESSENGER_H_
 
 #include "binderd/buffer.h"
+#include "binderd/common/fd.h"
 
 #include <functional>
+#include <vector>
 
 #include <asio.hpp>
 
@@ -34,9 +36,18 @@ class Messenger {
   virtual bool Connect(const std::string &socket_path) = 0;
   virtual void Close() = 0;
 
+  // Calls handler with a buffer holding one or more complete frames
+  // which can be parsed with MessageParser. The buffer may point into
+  // memory of the messenger which is not reused before every reference
+  // to the buffer is gone.
   virtual void ReadMessageAsync(const ReadHandler &handler) = 0;
   virtual void WriteData(const BufferPtr &data) = 0;
 
+  // Sends fds along with data. The peer receives them in the same
+  // order and takes them with TakeFds once it processes the message.
+  virtual void WriteData(const BufferPtr &data, const std::vector<Fd> &fds) = 0;
+  virtual std::vector<Fd> TakeFds(std::size_t count) = 0;
+
   virtual void Flush() = 0;
 };
 } // namespace binderd
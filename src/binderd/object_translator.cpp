@@ -19,6 +19,10 @@
 #include "binderd/binder_api.h"
 #include "binderd/logger.h"
 
+#include <cstring>
+
+#include <fcntl.h>
+
 namespace binderd {
 ObjectTranslator::ObjectTranslator() {}
 
@@ -31,17 +35,18 @@ uintptr_t ObjectTranslator::TranslateCookie(uint64_t cookie) {
   return iter->second;
 }
 
-Status ObjectTranslator::ProcessTransaction(TransactionData *request, const Direction &direction) {
+Status ObjectTranslator::ProcessTransaction(TransactionData *request, const Direction &direction,
+                                            std::vector<Fd> *fds) {
   if (request->GetNumObjectOffsets() == 0)
     return Status::OK;
 
-  // FIXME: We really don't want the const_cast<> here.
-  Buffer objects(const_cast<uint8_t*>(request->GetObjectOffsets()),
-                 request->GetNumObjectOffsets() * sizeof(binder_size_t));
+  std::size_t num_fds = 0;
+  for (size_t n = 0; n < request->GetNumObjectOffsets(); n++) {
+    binder_size_t offset = 0;
+    ::memcpy(&offset, request->GetObjectOffsets() + n * sizeof(binder_size_t), sizeof(offset));
+    if (offset > request->GetDataSize() || request->GetDataSize() - offset < sizeof(flat_binder_object))
+      return Status::BadValue;
 
-  auto current = objects.GetBegin();
-  while (current != objects.GetEnd()) {
-    auto offset = static_cast<binder_size_t>(*current);
     auto obj = reinterpret_cast<flat_binder_object*>(request->GetMutableData() + offset);
 
     switch (obj->type) {
@@ -61,17 +66,51 @@ Status ObjectTranslator::ProcessTransaction(TransactionData *request, const Dire
     case BINDER_TYPE_WEAK_HANDLE:
       WARNING("Got a weak binder/handle which we can't handle yet");
       break;
-    case BINDER_TYPE_FD:
-      // FIXME Need to support file descriptors
+    case BINDER_TYPE_FD: {
+      auto status = ProcessFdObject(obj, direction, fds, num_fds++);
+      if (status != Status::OK)
+        return status;
       break;
+    }
     default:
       WARNING("Invalid object type %d", obj->type);
       return Status::InvalidOperation;
     }
+  }
+
+  return Status::OK;
+}
 
-    current += sizeof(binder_size_t);
+Status ObjectTranslator::ProcessFdObject(flat_binder_object *obj, const Direction &direction,
+                                         std::vector<Fd> *fds, std::size_t index) {
+  switch (direction) {
+  case Direction::In: {
+    // The server replaced the fd number of the sender with the index
+    // of the fd in the list we received next to the message.
+    if (!fds || index >= fds->size() || obj->handle != index)
+      return Status::BadValue;
+
+    // The fd stays owned by the message the transaction came with
+    obj->handle = (*fds)[index];
+    break;
   }
+  case Direction::Out: {
+    if (!fds)
+      return Status::FdsNotAllowed;
 
+    // The fd still belongs to the caller so we send our own copy
+    // which goes away once it was written out.
+    const auto fd = ::fcntl(obj->handle, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+      WARNING("Can't pass invalid fd %d: %s", obj->handle, strerror(errno));
+      return Status::BadValue;
+    }
+    fds->push_back(Fd{fd});
+    break;
+  }
+  default:
+    break;
+  }
   return Status::OK;
 }
 
@@ -22,9 +22,11 @@
 #include "binderd/transaction_data.h"
 #include "binderd/object.h"
 #include "binderd/binder_api.h"
+#include "binderd/common/fd.h"
 
 #include <unordered_map>
 #include <atomic>
+#include <vector>
 
 namespace binderd {
 class ObjectTranslator {
@@ -39,7 +41,11 @@ class ObjectTranslator {
   ObjectTranslator();
   ~ObjectTranslator();
 
-  Status ProcessTransaction(TransactionData *request, const Direction &direction);
+  // For outgoing transactions a duplicate of every passed file
+  // descriptor is appended to fds. Incoming transactions get their
+  // file descriptor objects pointed to the received fds in order.
+  Status ProcessTransaction(TransactionData *request, const Direction &direction,
+                            std::vector<Fd> *fds = nullptr);
   uint64_t ProcessObject(const std::shared_ptr<Object> &object);
 
   uintptr_t TranslateCookie(uint64_t cookie);
@@ -49,6 +55,8 @@ class ObjectTranslator {
 
  private:
   Status ProcessBinderObject(flat_binder_object *obj, const Direction &direction);
+  Status ProcessFdObject(flat_binder_object *obj, const Direction &direction,
+                         std::vector<Fd> *fds, std::size_t index);
 
   std::unordered_map<uint64_t,uintptr_t> objects_;
   std::atomic<uint64_t> next_object_id_{1};
@@ -81,4 +81,12 @@ std::shared_ptr<Object> ParcelTransactionDataReader::ReadObject(const std::share
 
   return nullptr;
 }
+
+int ParcelTransactionDataReader::ReadFileDescriptor() {
+  auto buffer = impl->data_reader.ReadData(sizeof(flat_binder_object));
+  auto flat = reinterpret_cast<flat_binder_object*>(buffer->GetData());
+  if (flat->type != BINDER_TYPE_FD)
+    return -1;
+  return static_cast<int>(flat->handle);
+}
 } // namespace binderd
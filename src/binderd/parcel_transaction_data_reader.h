@@ -34,6 +34,9 @@ class ParcelTransactionDataReader {
   int32_t ReadInt32();
   std::u16string ReadString16();
   std::shared_ptr<Object> ReadObject(const std::shared_ptr<Client> &client);
+  // Returns -1 if the next object is not a file descriptor. The fd is
+  // owned by the transaction data and has to be duplicated to keep it.
+  int ReadFileDescriptor();
 
  private:
   struct Implementation;
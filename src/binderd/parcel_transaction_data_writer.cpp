@@ -44,8 +44,11 @@ void ParcelTransactionDataWriter::WriteInt32(int32_t value) {
 }
 
 void ParcelTransactionDataWriter::WriteInterfaceToken(const std::string &name, int32_t strict_mode_policy) {
+  const auto token = utils::to_string16(name);
+  // Policy, string length and the padded string with its terminator
+  data_writer_.Reserve(2 * sizeof(int32_t) + (((token.size() + 1) * sizeof(char16_t) + 3) & ~3));
   data_writer_.WriteInt32(kStrictModePenaltyGather | strict_mode_policy);
-  data_writer_.WriteString(utils::to_string16(name));
+  data_writer_.WriteString(token);
 }
 
 void ParcelTransactionDataWriter::WriteString16(const std::string &str) {
@@ -96,6 +99,16 @@ void ParcelTransactionDataWriter::WriteObject(const std::shared_ptr<Client> &cli
   local_objects_.push_back(object);
 }
 
+void ParcelTransactionDataWriter::WriteFileDescriptor(int fd) {
+  flat_binder_object flat{};
+  flat.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+  flat.type = BINDER_TYPE_FD;
+  flat.handle = static_cast<__u32>(fd);
+
+  objects_writer_.WriteUint64(data_writer_.GetBytesWritten());
+  data_writer_.WriteData(reinterpret_cast<uint8_t*>(&flat), sizeof(flat_binder_object));
+}
+
 std::unique_ptr<TransactionData> ParcelTransactionDataWriter::Finalize() {
   auto data = std::make_unique<WritableTransactionData>();
   data->SetCode(code_);
@@ -40,6 +40,9 @@ class ParcelTransactionDataWriter {
   void WriteString16(const std::u16string &str);
   void WriteString16(const std::string &str);
   void WriteObject(const std::shared_ptr<Client> &client, const std::shared_ptr<Object> &object);
+  // The fd stays owned by the caller and has to stay open until the
+  // transaction was sent.
+  void WriteFileDescriptor(int fd);
 
   std::unique_ptr<TransactionData> Finalize();
 
@@ -18,101 +18,200 @@
 #include "binderd/registry.h"
 #include "binderd/constants.h"
 
+#include <limits>
+
 namespace binderd {
 RegistryPtr Registry::Create() {
   auto self = std::shared_ptr<Registry>(new Registry);
   return self;
 }
 
-Registry::Registry() : next_object_handle_{1} {}
+Registry::Registry() {}
 
 Registry::~Registry() {}
 
-void Registry::SetContextManager(const ServerSessionPtr &session) {
-  context_mgr_ = session;
+bool Registry::SetRole(RcuPointer<ServerSessionPtr> &role, const ServerSessionPtr &session) {
+  std::lock_guard<std::mutex> l(roles_lock_);
+  if (role.Read([](const ServerSessionPtr &current) { return current != nullptr; }))
+    return false;
+  role.Update([&](ServerSessionPtr &current) { current = session; });
+  return true;
+}
+
+void Registry::ClearRole(RcuPointer<ServerSessionPtr> &role, const ServerSessionPtr &session) {
+  std::lock_guard<std::mutex> l(roles_lock_);
+  if (role.Read([&](const ServerSessionPtr &current) { return current == session; }))
+    role.Update([](ServerSessionPtr &current) { current.reset(); });
 }
 
-ServerSessionPtr Registry::GetContextManager() const { return context_mgr_; }
+bool Registry::SetContextManager(const ServerSessionPtr &session) {
+  return SetRole(context_mgr_, session);
+}
+
+void Registry::ClearContextManager(const ServerSessionPtr &session) {
+  ClearRole(context_mgr_, session);
+}
 
-void Registry::SetMonitor(const ServerSessionPtr &session) {
-  monitor_ = session;
+ServerSessionPtr Registry::GetContextManager() const {
+  return context_mgr_.Read([](const ServerSessionPtr &session) { return session; });
 }
 
-ServerSessionPtr Registry::GetMonitor() const { return monitor_; }
+bool Registry::SetMonitor(const ServerSessionPtr &session) {
+  return SetRole(monitor_, session);
+}
 
-ServerSessionPtr Registry::FindSessionByHandle(std::uint64_t handle) {
+void Registry::ClearMonitor(const ServerSessionPtr &session) {
+  ClearRole(monitor_, session);
+}
+
+ServerSessionPtr Registry::GetMonitor() const {
+  return monitor_.Read([](const ServerSessionPtr &session) { return session; });
+}
+
+ServerSessionPtr Registry::FindSessionByHandle(std::uint64_t handle) const {
   if (handle == kContextManagerHandle)
     return GetContextManager();
 
-  auto iter = handles_.find(handle);
-  if (iter == handles_.end())
+  auto node = nodes_.Find(handle);
+  if (!node)
     return nullptr;
+  return node->owner;
+}
 
-  return iter->second;
+std::shared_ptr<const Registry::Node> Registry::FindNode(std::uint64_t handle) const {
+  return nodes_.Find(handle);
 }
 
-std::uint64_t Registry::NewObjectHandle(const ServerSessionPtr &session) {
-  const auto handle = next_object_handle_++;
-  handles_.insert({handle, session});
+std::uint64_t Registry::NewObjectHandle(const ServerSessionPtr &session,
+                                        std::uintptr_t binder,
+                                        std::uintptr_t cookie) {
+  auto node = std::make_shared<const Node>(Node{session, binder, cookie});
+
+  std::lock_guard<std::mutex> l(nodes_lock_);
+  const auto handle = nodes_.Insert(node);
+  if (handle == 0)
+    ERROR("Ran out of object handles");
   return handle;
 }
 
 void Registry::RemoveHandle(std::uint64_t handle) {
-  auto iter = handles_.find(handle);
-  if (iter == handles_.end()) {
-    WARNING("Cannot remove unknown handle %d", handle);
-    return;
-  }
-
-  auto references = references_.find(handle);
-  if (references != references_.end()) {
-    for (const auto &session : references->second)
-      session->SendDeathNotification(handle);
-    references_.erase(references);
+  References references;
+  {
+    auto &shard = GetShard(handle);
+    std::lock_guard<std::mutex> l(shard.lock);
+
+    {
+      std::lock_guard<std::mutex> nodes_lock(nodes_lock_);
+      if (!nodes_.Remove(handle)) {
+        WARNING("Cannot remove unknown handle %d", handle);
+        return;
+      }
+    }
+
+    auto iter = shard.references.find(handle);
+    if (iter != shard.references.end()) {
+      references = std::move(iter->second);
+      shard.references.erase(iter);
+    }
+
+    for (const auto &reference : references) {
+      auto handles = shard.sessions.find(reference.first);
+      handles->second.erase(handle);
+      if (handles->second.empty())
+        shard.sessions.erase(handles);
+    }
   }
 
-  handles_.erase(iter);
+  // Sessions take their own locks when notified so we don't call
+  // them with ours held.
+  for (const auto &reference : references)
+    reference.second.session->SendDeathNotification(handle);
 }
 
 bool Registry::IsHandleKnown(std::uint64_t handle) const {
-  return handles_.find(handle) != handles_.end();
+  return nodes_.Find(handle) != nullptr;
 }
 
 bool Registry::IsHandleReferenced(std::uint64_t handle) const {
-  auto iter = references_.find(handle);
-  if (iter == references_.end())
+  auto &shard = GetShard(handle);
+  std::lock_guard<std::mutex> l(shard.lock);
+
+  auto iter = shard.references.find(handle);
+  if (iter == shard.references.end())
     return false;
 
   return iter->second.size() > 0;
 }
 
-Status Registry::AddReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle) {
+Status Registry::AddReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle,
+                                       std::uint32_t count) {
+  auto &shard = GetShard(handle);
+  std::lock_guard<std::mutex> l(shard.lock);
+
   if (!IsHandleKnown(handle))
     return Status::DeadObject;
 
-  auto reference = references_.find(handle);
-  if (reference == references_.end())
-    references_.insert({handle, {session}});
-  else
-    reference->second.push_back(session);
+  auto &reference = shard.references[handle][session->GetId()];
+  if (count > std::numeric_limits<std::uint32_t>::max() - reference.count)
+    return Status::BadValue;
+
+  if (reference.count == 0) {
+    reference.session = session;
+    shard.sessions[session->GetId()].insert(handle);
+  }
+  reference.count += count;
 
   return Status::OK;
 }
 
-Status Registry::RemoveReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle) {
+Status Registry::RemoveReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle,
+                                          std::uint32_t count) {
+  auto &shard = GetShard(handle);
+  std::lock_guard<std::mutex> l(shard.lock);
+
   if (!IsHandleKnown(handle))
     return Status::DeadObject;
 
-  auto reference = references_.find(handle);
-  if (reference == references_.end())
+  auto reference = shard.references.find(handle);
+  if (reference == shard.references.end())
     return Status::BadValue;
 
-  auto iter = std::find(reference->second.begin(), reference->second.end(), session);
-  if (iter == reference->second.end())
+  auto iter = reference->second.find(session->GetId());
+  if (iter == reference->second.end() || count > iter->second.count)
     return Status::BadValue;
 
+  iter->second.count -= count;
+  if (iter->second.count > 0)
+    return Status::OK;
+
   reference->second.erase(iter);
+  if (reference->second.empty())
+    shard.references.erase(reference);
+
+  auto handles = shard.sessions.find(session->GetId());
+  handles->second.erase(handle);
+  if (handles->second.empty())
+    shard.sessions.erase(handles);
 
   return Status::OK;
 }
+
+void Registry::RemoveReferencesOfSession(const ServerSessionPtr &session) {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> l(shard.lock);
+
+    auto handles = shard.sessions.find(session->GetId());
+    if (handles == shard.sessions.end())
+      continue;
+
+    for (const auto handle : handles->second) {
+      auto reference = shard.references.find(handle);
+      reference->second.erase(session->GetId());
+      if (reference->second.empty())
+        shard.references.erase(reference);
+    }
+
+    shard.sessions.erase(handles);
+  }
+}
 } // namespace binderd
@@ -19,44 +19,102 @@
 #define BINDER_REGISTRY_H_
 
 #include "binderd/server_session.h"
+#include "binderd/common/handle_table.h"
+#include "binderd/common/rcu_pointer.h"
 
 #include <memory>
-#include <atomic>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace binderd {
+// The registry is shared by all sessions and accessed concurrently from
+// all workers of the server. Looking up the node for a handle, which
+// happens for every transaction, never takes a lock. References are
+// changed under one of several locks selected by the handle.
 class Registry {
  public:
   static std::shared_ptr<Registry> Create();
 
   ~Registry();
 
-  void SetContextManager(const ServerSessionPtr &session);
+  // Returns false if another session already took the role.
+  bool SetContextManager(const ServerSessionPtr &session);
+  // Only clears the role if the session has it.
+  void ClearContextManager(const ServerSessionPtr &session);
   ServerSessionPtr GetContextManager() const;
 
-  void SetMonitor(const ServerSessionPtr &session);
+  bool SetMonitor(const ServerSessionPtr &session);
+  void ClearMonitor(const ServerSessionPtr &session);
   ServerSessionPtr GetMonitor() const;
 
-  ServerSessionPtr FindSessionByHandle(std::uint64_t handle);
+  // A node is an object provided by a session which other sessions
+  // reference through its handle.
+  struct Node {
+    ServerSessionPtr owner;
+    std::uintptr_t binder;
+    std::uintptr_t cookie;
+  };
 
-  std::uint64_t NewObjectHandle(const ServerSessionPtr &session);
+  ServerSessionPtr FindSessionByHandle(std::uint64_t handle) const;
+  std::shared_ptr<const Node> FindNode(std::uint64_t handle) const;
+
+  // Returns 0 when no more handles are available.
+  std::uint64_t NewObjectHandle(const ServerSessionPtr &session,
+                                std::uintptr_t binder,
+                                std::uintptr_t cookie);
 
   void RemoveHandle(std::uint64_t handle);
 
   bool IsHandleKnown(std::uint64_t handle) const;
   bool IsHandleReferenced(std::uint64_t handle) const;
 
-  Status AddReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle);
-  Status RemoveReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle);
+  // Adds or removes count references of the session at once. A
+  // session can't drop more references than it holds and its count
+  // must not wrap around.
+  Status AddReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle,
+                               std::uint32_t count = 1);
+  Status RemoveReferenceForHandle(const ServerSessionPtr &session, std::uint64_t handle,
+                                  std::uint32_t count = 1);
+  // Drops all references the session still holds. Called when the
+  // session goes away.
+  void RemoveReferencesOfSession(const ServerSessionPtr &session);
 
  private:
+  static constexpr const std::size_t kNumShards{16};
+
+  // A session holds a single counted reference per handle no matter
+  // how often it acquired it.
+  struct Reference {
+    ServerSessionPtr session;
+    std::uint32_t count;
+  };
+  using References = std::unordered_map<unsigned int,Reference>;
+
+  struct Shard {
+    mutable std::mutex lock;
+    // Handle to the sessions referencing it, keyed by session id
+    std::unordered_map<std::uint64_t,References> references;
+    // Session id to the handles of this shard it references
+    std::unordered_map<unsigned int,std::unordered_set<std::uint64_t>> sessions;
+  };
+
   Registry();
 
-  ServerSessionPtr context_mgr_;
-  ServerSessionPtr monitor_;
-  std::atomic<std::uint64_t> next_object_handle_;
-  std::unordered_map<std::uint64_t,ServerSessionPtr> handles_;
-  std::unordered_map<std::uint64_t,std::vector<ServerSessionPtr>> references_;
+  Shard& GetShard(std::uint64_t handle) { return shards_[handle % kNumShards]; }
+  const Shard& GetShard(std::uint64_t handle) const { return shards_[handle % kNumShards]; }
+
+  bool SetRole(RcuPointer<ServerSessionPtr> &role, const ServerSessionPtr &session);
+  void ClearRole(RcuPointer<ServerSessionPtr> &role, const ServerSessionPtr &session);
+
+  std::mutex roles_lock_;
+  RcuPointer<ServerSessionPtr> context_mgr_;
+  RcuPointer<ServerSessionPtr> monitor_;
+  // Serializes all changes to the nodes. Removing a node takes the
+  // lock of its shard first.
+  std::mutex nodes_lock_;
+  HandleTable<const Node> nodes_;
+  Shard shards_[kNumShards];
 };
 using RegistryPtr = std::shared_ptr<Registry>;
 } // namespace binderd
@@ -19,7 +19,9 @@
 #include "binderd/server_impl.h"
 
 namespace binderd {
-std::shared_ptr<Server> Server::Create(const std::string &socket_path) {
-  return std::shared_ptr<Server>(new ServerImpl(socket_path));
+std::shared_ptr<Server> Server::Create(const std::string &socket_path,
+                                       std::size_t max_message_size,
+                                       IoBackend io_backend) {
+  return std::shared_ptr<Server>(new ServerImpl(socket_path, max_message_size, io_backend));
 }
 } // namespace binderd
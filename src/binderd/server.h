@@ -21,11 +21,21 @@
 #include "binderd/constants.h"
 
 #include <memory>
+#include <string>
 
 namespace binderd {
 class Server : public std::enable_shared_from_this<Server> {
  public:
-  static std::shared_ptr<Server> Create(const std::string &socket_path = kDefaultSocketPath);
+  // How the server performs I/O on the sockets of its clients
+  enum class IoBackend {
+    Asio,
+    // Falls back to Asio when the kernel doesn't support it
+    IoUring,
+  };
+
+  static std::shared_ptr<Server> Create(const std::string &socket_path = kDefaultSocketPath,
+                                        std::size_t max_message_size = kDefaultMaxMessageSize,
+                                        IoBackend io_backend = IoBackend::Asio);
 
   virtual ~Server() {}
 
@@ -17,6 +17,7 @@
 
 #include "binderd/server_impl.h"
 #include "binderd/server_session.h"
+#include "binderd/uring_messenger.h"
 #include "binderd/logger.h"
 #include "binderd/registry.h"
 
@@ -81,12 +82,19 @@ std::string remove_socket_if_stale(std::string const& socket_name) {
 }
 
 namespace binderd {
-ServerImpl::ServerImpl(const std::string &socket_path) :
+ServerImpl::ServerImpl(const std::string &socket_path, std::size_t max_message_size, IoBackend io_backend) :
   io_{new ba::io_service},
   acceptor_(*io_, remove_socket_if_stale(socket_path)),
   socket_(*io_),
   sessions_(std::make_shared<ServerSessions>()),
-  registry_(Registry::Create()) {
+  registry_(Registry::Create()),
+  max_message_size_{max_message_size} {
+  if (io_backend == IoBackend::IoUring) {
+    uring_ = IoUring::Create(io_);
+    if (!uring_)
+      WARNING("io_uring is not available, falling back to asio");
+  }
+
   StartAccept();
   ::chmod(socket_path.c_str(), 0777);
 }
@@ -102,7 +110,11 @@ void ServerImpl::CloseAllSessions() {
 void ServerImpl::StartAccept() {
   acceptor_.async_accept(socket_, [this](const asio::error_code &err) {
     if (!err) {
-      auto messenger = std::make_shared<SocketMessenger>(io_, std::move(socket_));
+      std::shared_ptr<SocketMessenger> messenger;
+      if (uring_)
+        messenger = std::make_shared<UringMessenger>(io_, uring_, std::move(socket_), max_message_size_);
+      else
+        messenger = std::make_shared<SocketMessenger>(io_, std::move(socket_), max_message_size_);
       auto session = ServerSession::Create(sessions_, io_, messenger, registry_);
       sessions_->Add(session);
       session->Start();
@@ -21,6 +21,7 @@
 #include "binderd/constants.h"
 #include "binderd/server.h"
 #include "binderd/registry.h"
+#include "binderd/io_uring.h"
 
 #include <memory>
 #include <thread>
@@ -30,7 +31,9 @@
 namespace binderd {
 class ServerImpl : public Server {
  public:
-  explicit ServerImpl(const std::string &socket_path = kDefaultSocketPath);
+  explicit ServerImpl(const std::string &socket_path = kDefaultSocketPath,
+                      std::size_t max_message_size = kDefaultMaxMessageSize,
+                      IoBackend io_backend = IoBackend::Asio);
   ~ServerImpl() override;
 
   void Run() override;
@@ -42,11 +45,13 @@ class ServerImpl : public Server {
   void CloseAllSessions();
 
   std::shared_ptr<asio::io_service> io_;
+  std::shared_ptr<IoUring> uring_;
   asio::local::stream_protocol::acceptor acceptor_;
   asio::local::stream_protocol::socket socket_;
   std::shared_ptr<ServerSessions> sessions_;
   std::vector<std::thread> workers_;
   RegistryPtr registry_;
+  std::size_t max_message_size_;
   std::atomic_bool exit_{false};
 };
 } // namespace binderd
@@ -21,15 +21,21 @@
 #include "binderd/message_parser.h"
 #include "binderd/logger.h"
 #include "binderd/registry.h"
+#include "binderd/shm_messenger.h"
 #include "binderd/transaction_status.h"
 #include "binderd/transaction_data_from_message.h"
-#include "binderd/writable_transaction_data.h"
 
 #include "binderd/binder_api.h"
+#include "binderd/common/slab_allocator.h"
+
+#include <cstring>
 
 namespace {
 static constexpr std::size_t default_buffer_size{1024};
 static std::atomic<unsigned int> next_session_id{0};
+// Transaction cookies are unique across all sessions so that the caller
+// can track its pending transactions by cookie as well.
+static std::atomic<std::uint64_t> next_transaction_cookie{0};
 }
 
 namespace binderd {
@@ -48,11 +54,10 @@ ServerSession::ServerSession(
     const std::shared_ptr<Messenger> &messenger,
     const std::shared_ptr<Registry> &registry) :
   sessions_{sessions},
+  io_{io},
   messenger_{messenger},
   read_strand_(*io),
   registry_(registry),
-  next_transaction_cookie_{0},
-  next_node_handle_{0},
   id_{next_session_id++} {}
 
 ServerSession::~ServerSession() {}
@@ -64,24 +69,55 @@ void ServerSession::Start() {
 }
 
 void ServerSession::Terminate() {
-  // Tell everyone that all objects we provide are dead now
-  for (const auto &iter : objects_)
-    registry_->RemoveHandle(iter.first);
+  // Everything other sessions can reach us through is taken out at
+  // once. From here on nothing new gets added.
+  std::vector<std::uint64_t> handles;
+  std::unordered_map<std::uint64_t,TransactionRecord> incoming;
+  std::unordered_map<std::uint64_t,std::weak_ptr<ServerSession>> outgoing;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    if (terminated_)
+      return;
+    terminated_ = true;
+    handles.swap(handles_);
+    incoming.swap(pending_transactions_);
+    outgoing.swap(outgoing_transactions_);
+    death_notifications_.clear();
+  }
+
+  // Callers waiting for us to reply will never get one
+  for (const auto &iter : incoming)
+    iter.second.caller->SendDeadReply(iter.first, iter.second.reply_cookie);
 
-  if (registry_->GetContextManager() == shared_from_this())
-    registry_->SetContextManager(nullptr);
+  // Nobody is interested in the replies to our transactions anymore
+  for (const auto &iter : outgoing) {
+    if (auto target = iter.second.lock())
+      target->DiscardTransaction(iter.first);
+  }
+
+  // Tell everyone that all objects we provide are dead now. Removing
+  // a handle notifies other sessions so we must not hold our lock.
+  for (const auto handle : handles)
+    registry_->RemoveHandle(handle);
+  registry_->RemoveReferencesOfSession(shared_from_this());
 
-  if (registry_->GetMonitor() == shared_from_this())
-    registry_->SetMonitor(nullptr);
+  registry_->ClearContextManager(shared_from_this());
+  registry_->ClearMonitor(shared_from_this());
 
   messenger_->Flush();
   messenger_->Close();
   sessions_->Remove(GetId());
+
+  const auto stats = slab::GetStats();
+  DEBUG("Session %d terminated, %d of %d small allocations were served from free lists",
+        GetId(), stats.hits, stats.allocations);
 }
 
 void ServerSession::ReadNextMessage() {
   messenger_->ReadMessageAsync([this](const asio::error_code &err, const BufferPtr &buffer) {
     if (err) {
+      if (err == asio::error::message_size)
+        WARNING("Session %d exceeded the message size limit, closing it", GetId());
       Terminate();
       return;
     }
@@ -95,7 +131,10 @@ void ServerSession::ReadNextMessage() {
 }
 
 void ServerSession::WriteMessage(const MessagePtr &msg) {
-  messenger_->WriteData(msg->Pack());
+  if (msg->GetFds().empty())
+    messenger_->WriteData(msg->Pack());
+  else
+    messenger_->WriteData(msg->Pack(), msg->GetFds());
   ForwardToMonitor(msg);
 }
 
@@ -103,174 +142,319 @@ void ServerSession::OnSetContextManager(const MessagePtr &msg) {
   ForwardToMonitor(msg);
 
   auto status = Status::AlreadyExists;
-  if (!registry_->GetContextManager()) {
-    registry_->SetContextManager(shared_from_this());
+  if (registry_->SetContextManager(shared_from_this()))
     status = Status::OK;
-  }
 
   SendStatus(msg, status);
 }
 
 void ServerSession::OnSetMonitor(const MessagePtr &msg) {
   auto status = Status::AlreadyExists;
-  if (!registry_->GetMonitor()) {
-    registry_->SetMonitor(shared_from_this());
+  if (registry_->SetMonitor(shared_from_this()))
     status = Status::OK;
-  }
 
   SendStatus(msg, status);
 }
 
-Status ServerSession::PostTransaction(const TransactionRecord &record) {
-  const auto tr_cookie = next_transaction_cookie_++;
-
-  auto old_msg = record.message;
-
-  WritableTransactionData new_tr;
-  auto new_msg = Message::Create(Message::Type::Transaction);
-  new_msg->SetCookie(tr_cookie);
-  new_msg->SetDestination(old_msg->GetDestination());
-
-  auto iter = objects_.find(old_msg->GetDestination());
-  if (iter != objects_.end()) {
-    auto obj = iter->second;
-    new_tr.SetBinder(obj.binder);
-    new_tr.SetCookie(obj.cookie);
-  } else if (old_msg->GetDestination() == 0) {
+Status ServerSession::PostTransaction(const TransactionRecord &record, TransactionDataFromMessage &tr) {
+  const auto tr_cookie = next_transaction_cookie++;
+
+  // The transaction is forwarded in the frame it arrived in. Only
+  // the header fields and the objects are patched in place.
+  auto msg = record.message;
+
+  // Translating objects adds handles to the caller. Both locks are
+  // taken at once so that two sessions sending to each other can't
+  // deadlock.
+  std::unique_lock<std::mutex> target_lock{lock_, std::defer_lock};
+  std::unique_lock<std::mutex> caller_lock{record.caller->lock_, std::defer_lock};
+  if (record.caller.get() == this)
+    target_lock.lock();
+  else
+    std::lock(target_lock, caller_lock);
+
+  if (terminated_)
+    return Status::DeadObject;
+
+  auto node = registry_->FindNode(msg->GetDestination());
+  if (node && node->owner.get() == this) {
+    tr.SetBinder(node->binder);
+    tr.SetCookie(node->cookie);
+  } else if (msg->GetDestination() == 0) {
     // The context manager as destination is a special case as we don't
     // store the object handle for it but just forward all messages we
     // get without binder/cookie set.
+    tr.SetBinder(0);
+    tr.SetCookie(0);
   } else {
     // If this happens then there is really something with the synchronization
     // between the registry and the object map wrong. A handle which doesn't
     // point to any object anymore should have been remove from the registry.
-    WARNING("Cannot find object for handle %d", old_msg->GetDestination());
+    WARNING("Cannot find object for handle %d", msg->GetDestination());
     return Status::InvalidOperation;
   }
 
-  TransactionDataFromMessage old_tr(old_msg);
-  new_tr.SetCode(old_tr.GetCode());
-  new_tr.SetData(Buffer::Create(reinterpret_cast<uint8_t*>(old_tr.GetMutableData()),
-                                old_tr.GetDataSize()));
-  // FIXME we do not really want a const_cast<> here..
-  auto objects = Buffer::Create(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(old_tr.GetObjectOffsets())),
-                                old_tr.GetNumObjectOffsets() * sizeof(binder_size_t));
-  new_tr.SetObjectOffsets(objects);
-
-  auto status = TranslateObjects(new_tr);
+  auto status = TranslateObjects(tr, record.caller);
   if (status != Status::OK)
     return status;
 
-  auto writer = new_msg->GetWriter();
-  writer.WriteData(new_tr.Pack());
+  msg->SetCookie(tr_cookie);
+
+  // The message is a slice of the receive buffer of the caller. Keeping
+  // it until the reply arrives would keep that whole buffer alive.
+  auto pending = record;
+  pending.message.reset();
+  pending_transactions_.insert({tr_cookie, pending});
+  record.caller->outgoing_transactions_.insert({tr_cookie, shared_from_this()});
 
-  pending_transactions_.insert({tr_cookie, record});
+  WriteMessage(msg);
 
-  WriteMessage(new_msg);
+  // We don't need to keep our copies of the fds around until the
+  // reply arrives.
+  msg->SetFds(std::vector<Fd>{});
 
   return Status::OK;
 }
 
-Status ServerSession::TranslateObjects(TransactionData &tr) {
-  if (tr.GetNumObjectOffsets() == 0)
+Status ServerSession::TranslateObjects(TransactionData &tr, const std::shared_ptr<ServerSession> &caller) {
+  const auto num_objects = tr.GetNumObjectOffsets();
+  if (num_objects == 0)
     return Status::OK;
 
-  // FIXME: We really don't want the const_cast<> here.
-  Buffer objects(const_cast<uint8_t*>(tr.GetObjectOffsets()),
-                 tr.GetNumObjectOffsets() * sizeof(binder_size_t));
-
-  auto current = objects.GetBegin();
-  while (current != objects.GetEnd()) {
-    auto offset = static_cast<binder_size_t>(*current);
-    auto obj = reinterpret_cast<flat_binder_object*>(tr.GetMutableData() + offset);
+  // Check all offsets before we touch anything so that a bad one
+  // doesn't leave us with half translated objects and handles which
+  // nobody knows about. Objects have to be ordered and must not
+  // overlap.
+  const auto data_size = tr.GetDataSize();
+  binder_size_t min_offset = 0;
+  for (size_t n = 0; n < num_objects; n++) {
+    binder_size_t offset = 0;
+    ::memcpy(&offset, tr.GetObjectOffsets() + n * sizeof(binder_size_t), sizeof(offset));
+    if (offset < min_offset || offset > data_size || data_size - offset < sizeof(flat_binder_object))
+      return Status::BadValue;
+    min_offset = offset + sizeof(flat_binder_object);
+  }
 
+  auto data = tr.GetMutableData();
+  auto object_at = [&](size_t n) {
+    binder_size_t offset = 0;
+    ::memcpy(&offset, tr.GetObjectOffsets() + n * sizeof(binder_size_t), sizeof(offset));
+    return reinterpret_cast<flat_binder_object*>(data + offset);
+  };
+
+  // Every handle the caller's objects need is allocated before any
+  // object is changed. When we fail halfway only the handles we got
+  // so far have to be given back. Nobody references them yet, so
+  // removing them doesn't notify anyone.
+  std::vector<std::uint64_t> new_handles;
+  auto release_new_handles = [&]() {
+    for (const auto handle : new_handles)
+      registry_->RemoveHandle(handle);
+  };
+  for (size_t n = 0; n < num_objects; n++) {
+    auto obj = object_at(n);
     switch (obj->type) {
     case BINDER_TYPE_BINDER: {
-      const auto handle = registry_->NewObjectHandle(shared_from_this());
-      objects_.insert({handle, BinderObject{obj->binder, obj->cookie}});
+      // A local object of the caller becomes a handle for everyone
+      // else. Only when the caller talks to itself it gets the object
+      // back as is.
+      if (caller.get() == this)
+        break;
+
+      const auto handle = registry_->NewObjectHandle(caller, obj->binder, obj->cookie);
+      if (handle == 0) {
+        release_new_handles();
+        return Status::NoMemory;
+      }
+      new_handles.push_back(handle);
+      break;
+    }
+    case BINDER_TYPE_HANDLE:
+    case BINDER_TYPE_WEAK_BINDER:
+    case BINDER_TYPE_WEAK_HANDLE:
+    case BINDER_TYPE_FD:
+      break;
+    default:
+      WARNING("Invalid object type %d", obj->type);
+      release_new_handles();
+      return Status::InvalidOperation;
+    }
+  }
+
+  caller->handles_.insert(caller->handles_.end(), new_handles.begin(), new_handles.end());
+
+  // Nothing can fail from here on. Each object is converted from the
+  // view of the caller into the view of the target.
+  auto next_handle = new_handles.begin();
+  for (size_t n = 0; n < num_objects; n++) {
+    auto obj = object_at(n);
+    switch (obj->type) {
+    case BINDER_TYPE_BINDER:
+      if (caller.get() == this) {
+        obj->type = BINDER_TYPE_WEAK_BINDER;
+        break;
+      }
+
       obj->type = BINDER_TYPE_HANDLE;
       obj->binder = 0;
       obj->cookie = 0;
-      obj->handle = handle;
+      obj->handle = *next_handle++;
       break;
-    }
     case BINDER_TYPE_HANDLE: {
-      // Check if we own the handle. If we don't own it we just pass
-      // it the callee which then can use it for a proxy again.
-      if (objects_.find(obj->handle) == objects_.end())
+      // Only the target may see the pointers of its own objects. A
+      // handle to an object of anyone else, the caller included, is
+      // passed on as handle which the target then can use for a
+      // proxy. Handles are the same for all sessions.
+      auto node = registry_->FindNode(obj->handle);
+      if (!node || node->owner.get() != this)
         break;
 
-      const auto b = objects_[obj->handle];
       obj->type = BINDER_TYPE_WEAK_BINDER;
-      obj->binder = b.binder;
-      obj->cookie = b.cookie;
-      obj->handle = 0;
+      obj->binder = node->binder;
+      obj->cookie = node->cookie;
       break;
     }
     case BINDER_TYPE_WEAK_BINDER:
     case BINDER_TYPE_WEAK_HANDLE:
       WARNING("Got a weak binder/handle which we can't handle yet");
       break;
-    case BINDER_TYPE_FD:
-      break;
     default:
-      WARNING("Invalid object type %d", obj->type);
-      return Status::InvalidOperation;
+      // Fds were already taken care of when the message arrived
+      break;
     }
+  }
 
-    current += sizeof(binder_size_t);
+  return Status::OK;
+}
+
+Status ServerSession::TakeFds(const MessagePtr &msg) {
+  TransactionDataFromMessage data(msg);
+  const auto num_fds = data.GetNumFds();
+  if (num_fds == 0)
+    return Status::OK;
+
+  // Fds arrive in the same order as the messages they belong to
+  auto fds = messenger_->TakeFds(num_fds);
+  if (fds.size() != num_fds) {
+    WARNING("Session %d sent %d fd objects but only %d fds", GetId(), num_fds, fds.size());
+    return Status::BadValue;
   }
 
+  auto objects = data.GetFileDescriptorObjects();
+
+  // The fd numbers of the sender mean nothing to the receiver. It
+  // finds the fds it got next to the message by their position.
+  for (std::size_t n = 0; n < objects.size(); n++)
+    objects[n]->handle = static_cast<__u32>(n);
+
+  msg->SetFds(fds);
   return Status::OK;
 }
 
 void ServerSession::SendStatus(const MessagePtr &msg, const Status &status) {
+  SendStatus(msg->GetCookie(), status);
+}
+
+void ServerSession::SendStatus(std::uint64_t cookie, const Status &status) {
   auto reply = Message::Create(Message::Type::Status);
-  reply->SetCookie(msg->GetCookie());
+  reply->SetCookie(cookie);
   auto writer = reply->GetWriter();
   writer.WriteInt32(static_cast<int32_t>(status));
   WriteMessage(reply);
 }
 
 void ServerSession::OnTransaction(const MessagePtr &msg) {
+  // Forwarding the transaction rewrites the cookie of the message
+  const auto cookie = msg->GetCookie();
+
   try {
-    TransactionDataFromMessage data(msg);
-    TranslateObjects(data);
+    auto status = TakeFds(msg);
+    if (status != Status::OK) {
+      SendStatus(cookie, status);
+      return;
+    }
 
     auto target = registry_->FindSessionByHandle(msg->GetDestination());
     if (!target) {
       WARNING("Cannot find a target for handle %d", msg->GetDestination());
-      SendStatus(msg, Status::NameNotFound);
+      SendStatus(cookie, Status::NameNotFound);
       return;
     }
 
-    TransactionRecord record{shared_from_this(), msg->GetCookie(), msg};
-    auto status = target->PostTransaction(record);
+    TransactionDataFromMessage data(msg);
+    TransactionRecord record{shared_from_this(), cookie, msg};
+    status = target->PostTransaction(record, data);
 
     // Let the caller know that we delivered the transaction
     // to the target. This keeps in mind that delivery might
     // have given a problem which is reflected by the status
-    // we send back here.
-    SendStatus(msg, status);
+    // we send back here. One-way transactions have nothing else
+    // to wait for so they always get it.
+    const auto ack_failures_only = options_ & static_cast<std::uint32_t>(Message::Option::AckFailedDeliveryOnly);
+    if (status != Status::OK || data.IsOneWay() || !ack_failures_only)
+      SendStatus(cookie, status);
   } catch (std::out_of_range&) {
-    SendStatus(msg, Status::BadValue);
+    SendStatus(cookie, Status::BadValue);
   } catch (std::exception &err) {
-    SendStatus(msg, Status::UnknownError);
+    SendStatus(cookie, Status::UnknownError);
   }
 }
 
 void ServerSession::OnReply(const MessagePtr &msg) {
-  auto iter = pending_transactions_.find(msg->GetCookie());
-  if (iter == pending_transactions_.end())
-    return;
+  auto status = Status::OK;
+  if (msg->GetType() == Message::Type::TransactionReply) {
+    try {
+      status = TakeFds(msg);
+    } catch (std::exception&) {
+      status = Status::BadValue;
+    }
+  }
+
+  TransactionRecord record;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto iter = pending_transactions_.find(msg->GetCookie());
+    if (iter == pending_transactions_.end())
+      return;
 
-  auto record = iter->second;
-  pending_transactions_.erase(iter);
+    record = iter->second;
+    pending_transactions_.erase(iter);
+  }
+
+  {
+    std::lock_guard<std::mutex> l(record.caller->lock_);
+    record.caller->outgoing_transactions_.erase(msg->GetCookie());
+    if (record.caller->terminated_)
+      return;
+  }
 
   msg->SetCookie(record.reply_cookie);
+  if (status != Status::OK) {
+    record.caller->SendStatus(msg, status);
+    return;
+  }
+
   record.caller->WriteMessage(msg);
 }
 
+void ServerSession::SendDeadReply(std::uint64_t tr_cookie, std::uint64_t reply_cookie) {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    outgoing_transactions_.erase(tr_cookie);
+    if (terminated_)
+      return;
+  }
+
+  // This is how a failed delivery is reported as well so the caller
+  // doesn't need to know anything new.
+  SendStatus(reply_cookie, Status::DeadObject);
+}
+
+void ServerSession::DiscardTransaction(std::uint64_t tr_cookie) {
+  std::lock_guard<std::mutex> l(lock_);
+  pending_transactions_.erase(tr_cookie);
+}
+
 void ServerSession::OnReference(const MessagePtr &msg) {
   auto reader = msg->GetReader();
 
@@ -291,12 +475,41 @@ void ServerSession::OnReference(const MessagePtr &msg) {
   SendStatus(msg, status);
 }
 
+void ServerSession::OnUpdateReferences(const MessagePtr &msg) {
+  auto reader = msg->GetReader();
+
+  try {
+    const auto count = reader.ReadUint32();
+    for (std::uint32_t n = 0; n < count; n++) {
+      const auto handle = reader.ReadUint64();
+      const auto delta = reader.ReadInt32();
+
+      // Nobody waits for an answer so all we can do about failures
+      // is to complain.
+      auto status = Status::OK;
+      if (delta > 0)
+        status = registry_->AddReferenceForHandle(shared_from_this(), handle,
+                                                  static_cast<std::uint32_t>(delta));
+      else if (delta < 0)
+        status = registry_->RemoveReferenceForHandle(shared_from_this(), handle,
+                                                     static_cast<std::uint32_t>(-static_cast<std::int64_t>(delta)));
+
+      if (status != Status::OK)
+        WARNING("Failed to update references of handle %d: %s", handle, status);
+    }
+  } catch (std::out_of_range&) {
+    WARNING("Session %d sent malformed reference updates", GetId());
+  }
+}
+
 void ServerSession::OnDeathNotification(const MessagePtr &msg) {
   auto reader = msg->GetReader();
 
   const auto handle = reader.ReadUint64();
   const auto object_id = reader.ReadUint64();
 
+  std::unique_lock<std::mutex> l(lock_);
+
   auto status = Status::DeadObject;
   switch (msg->GetType()) {
   case Message::Type::RequestDeathNotification: {
@@ -324,6 +537,8 @@ void ServerSession::OnDeathNotification(const MessagePtr &msg) {
     break;
   }
 
+  l.unlock();
+
   SendStatus(msg, status);
 }
 
@@ -342,8 +557,53 @@ void ServerSession::SendMessage(const MessagePtr &msg) {
   messenger_->WriteData(msg->Pack());
 }
 
+void ServerSession::OnVersion(const MessagePtr &msg) {
+  auto reader = msg->GetReader();
+  const auto version = reader.ReadUint32();
+  const auto capacity = reader.ReadUint64();
+  auto fds = messenger_->TakeFds(ShmMessenger::kNumFds);
+
+  // The transport can only change before anything else happened on
+  // the session as nobody else knows about it until then.
+  auto socket_messenger = std::dynamic_pointer_cast<SocketMessenger>(messenger_);
+  if (!transport_negotiable_ || !socket_messenger || version != ShmMessenger::kVersion) {
+    SendStatus(msg, Status::InvalidOperation);
+    return;
+  }
+
+  auto shm_messenger = ShmMessenger::Accept(io_, socket_messenger, capacity, fds);
+  if (!shm_messenger) {
+    SendStatus(msg, Status::BadValue);
+    return;
+  }
+
+  // The answer still goes over the socket which the client waits on
+  SendStatus(msg, Status::OK);
+  messenger_ = shm_messenger;
+}
+
+void ServerSession::OnSetOptions(const MessagePtr &msg) {
+  auto reader = msg->GetReader();
+  const auto options = reader.ReadUint32();
+
+  const auto known_options = static_cast<std::uint32_t>(Message::Option::AckFailedDeliveryOnly);
+  if (options & ~known_options) {
+    SendStatus(msg, Status::BadValue);
+    return;
+  }
+
+  options_ = options;
+  SendStatus(msg, Status::OK);
+}
+
 void ServerSession::ProcessMessage(const MessagePtr &msg) {
   switch (msg->GetType()) {
+  case Message::Type::Version:
+    OnVersion(msg);
+    break;
+  case Message::Type::SetOptions:
+    OnSetOptions(msg);
+    break;
   case Message::Type::SetContextMgr:
     OnSetContextManager(msg);
     break;
@@ -361,6 +621,9 @@ void ServerSession::ProcessMessage(const MessagePtr &msg) {
   case Message::Type::Release:
     OnReference(msg);
     break;
+  case Message::Type::UpdateReferences:
+    OnUpdateReferences(msg);
+    break;
   case Message::Type::RequestDeathNotification:
   case Message::Type::ClearDeathNotification:
     OnDeathNotification(msg);
@@ -370,16 +633,26 @@ void ServerSession::ProcessMessage(const MessagePtr &msg) {
     SendStatus(msg, Status::InvalidOperation);
     break;
   }
+
+  transport_negotiable_ = false;
 }
 
 void ServerSession::SendDeathNotification(uint64_t handle) {
-  auto iter = death_notifications_.find(handle);
-  if (iter == death_notifications_.end())
-    return;
+  std::uint64_t object_id = 0;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto iter = death_notifications_.find(handle);
+    if (iter == death_notifications_.end())
+      return;
+    object_id = iter->second;
+    // The handle is never used again
+    death_notifications_.erase(iter);
+  }
+
   auto msg = Message::Create(Message::Type::DeadBinder);
   auto writer = msg->GetWriter();
   writer.WriteUint64(handle);
-  writer.WriteUint64(iter->second);
+  writer.WriteUint64(object_id);
   WriteMessage(msg);
 }
 } // namespace binderd
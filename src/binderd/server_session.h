@@ -25,7 +25,10 @@
 #include "binderd/transaction_data_from_message.h"
 
 #include <memory>
+#include <deque>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <asio.hpp>
 
@@ -71,7 +74,12 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
   // Status::OK only when the transaction was successfully added
   // to the write queue. In all other cases a proper error status
   // is returned and the transaction discarded.
-  Status PostTransaction(const TransactionRecord &tr);
+  Status PostTransaction(const TransactionRecord &tr, TransactionDataFromMessage &data);
+  // Fails a transaction we sent when its target went away before
+  // replying.
+  void SendDeadReply(std::uint64_t tr_cookie, std::uint64_t reply_cookie);
+  // Drops a transaction we received when its caller went away.
+  void DiscardTransaction(std::uint64_t tr_cookie);
 
   void ReadNextMessage();
   void ProcessMessage(const MessagePtr &msg);
@@ -82,31 +90,43 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
   void OnTransaction(const MessagePtr &msg);
   void OnReply(const MessagePtr &msg);
   void OnReference(const MessagePtr &msg);
+  void OnUpdateReferences(const MessagePtr &msg);
   void OnDeathNotification(const MessagePtr &msg);
+  void OnVersion(const MessagePtr &msg);
+  void OnSetOptions(const MessagePtr &msg);
 
   void ForwardToMonitor(const MessagePtr &msg);
 
-  Status TranslateObjects(TransactionData &tr);
+  // Translates all objects of a transaction from the caller to us
+  // as target in a single pass.
+  Status TranslateObjects(TransactionData &tr, const std::shared_ptr<ServerSession> &caller);
+  Status TakeFds(const MessagePtr &msg);
   void SendStatus(const MessagePtr &msg, const Status &status);
+  void SendStatus(std::uint64_t cookie, const Status &status);
 
   void WriteMessage(const MessagePtr &msg);
 
-  struct BinderObject {
-    uintptr_t binder;
-    uintptr_t cookie;
-  };
-
   unsigned int id_;
   std::shared_ptr<ServerSessions> sessions_;
+  std::shared_ptr<asio::io_service> io_;
   std::shared_ptr<Messenger> messenger_;
   asio::strand read_strand_;
   std::shared_ptr<Registry> registry_;
+  // Other sessions post transactions and death notifications to us
+  // from their workers. This protects everything they touch.
+  std::mutex lock_;
   std::deque<MessagePtr> unread_messages_;
-  std::atomic<std::uint64_t> next_transaction_cookie_;
+  // Transactions delivered to us and waiting for our reply
   std::unordered_map<std::uint64_t,TransactionRecord> pending_transactions_;
-  std::atomic<std::uint64_t> next_node_handle_;
-  std::unordered_map<std::uint64_t,BinderObject> objects_;
+  // Transactions we sent and their targets, keyed by transaction cookie
+  std::unordered_map<std::uint64_t,std::weak_ptr<ServerSession>> outgoing_transactions_;
+  // Handles of all objects we provide. The objects themselves are
+  // stored in the registry.
+  std::vector<std::uint64_t> handles_;
   std::unordered_map<std::uint64_t,std::uint64_t> death_notifications_;
+  bool terminated_ = false;
+  bool transport_negotiable_ = true;
+  std::uint32_t options_ = 0;
 };
 using ServerSessionPtr = std::shared_ptr<ServerSession>;
 } // namespace binderd
@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "binderd/shm_messenger.h"
+#include "binderd/logger.h"
+
+#include <algorithm>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Upper limit for the ring capacity a peer can ask us to map
+constexpr const std::size_t kMaxShmRingCapacity{64 * 1024 * 1024};
+// The peer must not be able to change the size of the memory while
+// we have it mapped.
+constexpr const int kRequiredSeals{F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL};
+}
+
+namespace binderd {
+constexpr std::uint32_t ShmMessenger::kVersion;
+constexpr std::size_t ShmMessenger::kNumFds;
+
+std::shared_ptr<ShmMessenger> ShmMessenger::Create(const std::shared_ptr<asio::io_service> &io,
+                                                   const std::shared_ptr<SocketMessenger> &control,
+                                                   std::size_t capacity) {
+  Fd memory{::memfd_create("binderd-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+  if (memory < 0) {
+    WARNING("Failed to create shared memory: %s", strerror(errno));
+    return nullptr;
+  }
+
+  const auto size = 2 * ShmRing::GetMappingSize(capacity);
+  if (::ftruncate(memory, size) < 0 || ::fcntl(memory, F_ADD_SEALS, kRequiredSeals) < 0) {
+    WARNING("Failed to setup shared memory: %s", strerror(errno));
+    return nullptr;
+  }
+
+  Fd creator_wakeup{::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+  Fd acceptor_wakeup{::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+  if (creator_wakeup < 0 || acceptor_wakeup < 0) {
+    WARNING("Failed to create eventfd: %s", strerror(errno));
+    return nullptr;
+  }
+
+  auto messenger = std::shared_ptr<ShmMessenger>(
+      new ShmMessenger(io, control, {memory, creator_wakeup, acceptor_wakeup}, capacity));
+  if (!messenger->Map(true))
+    return nullptr;
+
+  return messenger;
+}
+
+std::shared_ptr<ShmMessenger> ShmMessenger::Accept(const std::shared_ptr<asio::io_service> &io,
+                                                   const std::shared_ptr<SocketMessenger> &control,
+                                                   std::size_t capacity,
+                                                   const std::vector<Fd> &fds) {
+  if (fds.size() != kNumFds)
+    return nullptr;
+
+  if (capacity < FrameHeader::kSize + kFrameChunkSize ||
+      capacity > kMaxShmRingCapacity ||
+      (capacity & (capacity - 1)) != 0) {
+    WARNING("Peer offered invalid ring capacity %d", capacity);
+    return nullptr;
+  }
+
+  struct stat st;
+  const auto seals = ::fcntl(fds[0], F_GET_SEALS);
+  if (seals < 0 || (seals & kRequiredSeals) != kRequiredSeals ||
+      ::fstat(fds[0], &st) < 0 ||
+      static_cast<std::size_t>(st.st_size) != 2 * ShmRing::GetMappingSize(capacity)) {
+    WARNING("Peer offered unusable shared memory");
+    return nullptr;
+  }
+
+  auto messenger = std::shared_ptr<ShmMessenger>(new ShmMessenger(io, control, fds, capacity));
+  if (!messenger->Map(false))
+    return nullptr;
+
+  return messenger;
+}
+
+ShmMessenger::ShmMessenger(const std::shared_ptr<asio::io_service> &io,
+                           const std::shared_ptr<SocketMessenger> &control,
+                           const std::vector<Fd> &fds,
+                           std::size_t capacity) :
+  control_{control},
+  fds_{fds},
+  capacity_{capacity},
+  memory_{MAP_FAILED},
+  wakeup_{*io},
+  receiver_{control->GetMaxMessageSize()} {}
+
+ShmMessenger::~ShmMessenger() {
+  exit_ = true;
+  if (memory_ != MAP_FAILED)
+    ::munmap(memory_, memory_size_);
+}
+
+bool ShmMessenger::Map(bool is_creator) {
+  memory_size_ = 2 * ShmRing::GetMappingSize(capacity_);
+  memory_ = ::mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fds_[0], 0);
+  if (memory_ == MAP_FAILED) {
+    WARNING("Failed to map shared memory: %s", strerror(errno));
+    return false;
+  }
+
+  // The creator writes into the first ring and reads from the second
+  auto first = reinterpret_cast<std::uint8_t*>(memory_);
+  auto second = first + ShmRing::GetMappingSize(capacity_);
+  tx_.reset(new ShmRing(is_creator ? first : second, capacity_));
+  rx_.reset(new ShmRing(is_creator ? second : first, capacity_));
+
+  own_wakeup_fd_ = is_creator ? fds_[1] : fds_[2];
+  peer_wakeup_fd_ = is_creator ? fds_[2] : fds_[1];
+
+  const auto fd = ::dup(own_wakeup_fd_);
+  if (fd < 0)
+    return false;
+
+  asio::error_code err;
+  wakeup_.assign(fd, err);
+  if (err) {
+    ::close(fd);
+    return false;
+  }
+
+  return true;
+}
+
+std::vector<Fd> ShmMessenger::GetFds() const {
+  return fds_;
+}
+
+std::size_t ShmMessenger::GetCapacity() const {
+  return capacity_;
+}
+
+bool ShmMessenger::Connect(const std::string&) {
+  // We're only ever created on top of an existing connection
+  return false;
+}
+
+void ShmMessenger::Close() {
+  exit_ = true;
+  control_->Close();
+
+  asio::error_code err;
+  wakeup_.cancel(err);
+}
+
+void ShmMessenger::Flush() {
+}
+
+void ShmMessenger::Wake(int fd) {
+  const std::uint64_t value = 1;
+  if (::write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    WARNING("Failed to wake up peer: %s", strerror(errno));
+}
+
+void ShmMessenger::WriteData(const BufferPtr &data) {
+  std::lock_guard<std::mutex> l(write_lock_);
+  pending_writes_.push_back(PendingWrite{data, 0, false});
+  WritePending();
+}
+
+void ShmMessenger::WriteData(const BufferPtr &data, const std::vector<Fd> &fds) {
+  if (fds.empty()) {
+    WriteData(data);
+    return;
+  }
+
+  // Fds can't travel through shared memory so the message goes over
+  // the control channel while an empty detached frame keeps its place
+  // in the ring.
+  std::lock_guard<std::mutex> l(write_lock_);
+  control_->WriteData(data, fds);
+  pending_writes_.push_back(PendingWrite{nullptr, 0, true});
+  WritePending();
+}
+
+std::vector<Fd> ShmMessenger::TakeFds(std::size_t count) {
+  return control_->TakeFds(count);
+}
+
+void ShmMessenger::WritePending() {
+  if (exit_)
+    return;
+
+  bool written = false;
+  while (!pending_writes_.empty()) {
+    auto &pending = pending_writes_.front();
+    const auto size = pending.data ? pending.data->GetSize() : 0;
+
+    FrameHeader header;
+    header.length = static_cast<std::uint32_t>(std::min(size - pending.offset, kFrameChunkSize));
+    if (pending.detached)
+      header.flags = FrameHeader::Detached;
+    else if (pending.offset + header.length < size)
+      header.flags = FrameHeader::More;
+
+    // When the ring is full the peer wakes us up once it made space.
+    // Until then the remaining messages stay queued.
+    const auto frame_size = FrameHeader::kSize + header.length;
+    if (tx_->GetFreeSpace() < frame_size && !tx_->PrepareWaitForSpace(frame_size))
+      break;
+
+    std::uint8_t encoded[FrameHeader::kSize];
+    header.Encode(encoded);
+    tx_->Write(encoded, sizeof(encoded));
+    if (header.length > 0)
+      tx_->Write(pending.data->GetData() + pending.offset, header.length);
+
+    written = true;
+    pending.offset += header.length;
+    if (pending.offset >= size)
+      pending_writes_.pop_front();
+  }
+
+  has_pending_writes_ = !pending_writes_.empty();
+
+  if (written && tx_->Publish())
+    Wake(peer_wakeup_fd_);
+}
+
+void ShmMessenger::ReadMessageAsync(const ReadHandler &handler) {
+  // Handlers usually ask for the next message right away. Instead of
+  // recursing with every message we pick that up in the loop below
+  // once they returned.
+  if (dispatching_) {
+    next_handler_ = handler;
+    return;
+  }
+
+  if (!monitoring_) {
+    monitoring_ = true;
+    MonitorControl();
+  }
+
+  auto current = handler;
+  while (current) {
+    bool delivered = false;
+    dispatching_ = true;
+    try {
+      delivered = TryDeliver(current);
+    } catch (...) {
+      dispatching_ = false;
+      next_handler_ = nullptr;
+      throw;
+    }
+    dispatching_ = false;
+
+    if (!delivered) {
+      WaitForData(current);
+      return;
+    }
+
+    current = std::move(next_handler_);
+    next_handler_ = nullptr;
+  }
+}
+
+bool ShmMessenger::TryDeliver(const ReadHandler &handler) {
+  if (has_pending_writes_) {
+    std::lock_guard<std::mutex> l(write_lock_);
+    WritePending();
+  }
+
+  while (true) {
+    if (awaiting_detached_) {
+      BufferPtr message;
+      asio::error_code err;
+      {
+        std::lock_guard<std::mutex> l(control_lock_);
+        if (!detached_messages_.empty()) {
+          message = detached_messages_.front();
+          detached_messages_.pop_front();
+        }
+        err = control_err_;
+      }
+
+      if (message) {
+        awaiting_detached_ = false;
+        handler(asio::error_code{}, message);
+        return true;
+      } else if (err) {
+        handler(err, nullptr);
+        return true;
+      }
+      return false;
+    }
+
+    switch (receiver_.Deliver(handler)) {
+    case FrameReceiver::Result::Delivered:
+      return true;
+    case FrameReceiver::Result::Detached:
+      awaiting_detached_ = true;
+      continue;
+    default:
+      break;
+    }
+
+    std::size_t space = 0;
+    std::size_t size = 0;
+    bool wake_producer = false;
+    auto data = receiver_.PrepareSpace(&space);
+    if (!rx_->Read(data, space, &size, &wake_producer)) {
+      ERROR("Peer corrupted the shared memory ring");
+      handler(asio::error::invalid_argument, nullptr);
+      return true;
+    }
+
+    if (wake_producer)
+      Wake(peer_wakeup_fd_);
+
+    if (size > 0) {
+      receiver_.Commit(size);
+      continue;
+    }
+
+    asio::error_code err;
+    {
+      std::lock_guard<std::mutex> l(control_lock_);
+      err = control_err_;
+    }
+    if (err) {
+      handler(err, nullptr);
+      return true;
+    }
+
+    if (!rx_->PrepareWaitForData())
+      return false;
+  }
+}
+
+void ShmMessenger::WaitForData(const ReadHandler &handler) {
+  wakeup_.async_read_some(asio::buffer(&wakeup_value_, sizeof(wakeup_value_)),
+                          [this, handler](const asio::error_code &err, std::size_t) {
+    if (exit_)
+      return;
+
+    if (err) {
+      handler(err, nullptr);
+      return;
+    }
+
+    ReadMessageAsync(handler);
+  });
+}
+
+void ShmMessenger::MonitorControl() {
+  control_->ReadMessageAsync([this](const asio::error_code &err, const BufferPtr &buffer) {
+    if (exit_)
+      return;
+
+    {
+      std::lock_guard<std::mutex> l(control_lock_);
+      if (err) {
+        control_err_ = err;
+      } else {
+        // Every frame gets its own slice so that it can be handed out
+        // on its own once its position in the stream is reached.
+        std::size_t offset = 0;
+        while (buffer->GetSize() - offset >= FrameHeader::kSize) {
+          const auto header = FrameHeader::Decode(buffer->GetData() + offset);
+          const auto size = FrameHeader::kSize + header.length;
+          detached_messages_.push_back(CreateBufferSlice(buffer, offset, size));
+          offset += size;
+        }
+      }
+    }
+
+    Wake(own_wakeup_fd_);
+
+    if (!err)
+      MonitorControl();
+  });
+}
+} // namespace binderd
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_SHM_MESSENGER_H_
+#define BINDERD_SHM_MESSENGER_H_
+
+#include "binderd/messenger.h"
+#include "binderd/constants.h"
+#include "binderd/frame.h"
+#include "binderd/shm_ring.h"
+#include "binderd/socket_messenger.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace binderd {
+// ShmMessenger moves messages between two processes on the same host
+// through a pair of rings in shared memory. A peer is only woken up
+// through an eventfd when it waits for data; as long as it is busy
+// processing messages no syscall is needed on either side.
+//
+// The socket the transport was negotiated over stays around as
+// control channel. Messages carrying fds are sent over it while an
+// empty detached frame in the ring keeps their position. Its hangup
+// tells us when the peer is gone.
+class ShmMessenger : public Messenger {
+ public:
+  // Version of the transport we offer with a Message::Type::Version
+  static constexpr std::uint32_t kVersion{1};
+  // The memfd and one eventfd per side are passed to the peer
+  static constexpr std::size_t kNumFds{3};
+
+  // Sets up a new transport and returns nullptr if the system doesn't
+  // support what we need for it.
+  static std::shared_ptr<ShmMessenger> Create(const std::shared_ptr<asio::io_service> &io,
+                                              const std::shared_ptr<SocketMessenger> &control,
+                                              std::size_t capacity = kDefaultShmRingCapacity);
+  // Maps a transport offered by the peer and returns nullptr if it is
+  // not usable.
+  static std::shared_ptr<ShmMessenger> Accept(const std::shared_ptr<asio::io_service> &io,
+                                              const std::shared_ptr<SocketMessenger> &control,
+                                              std::size_t capacity,
+                                              const std::vector<Fd> &fds);
+
+  ~ShmMessenger();
+
+  // The fds the peer needs to accept the transport
+  std::vector<Fd> GetFds() const;
+  std::size_t GetCapacity() const;
+
+  bool Connect(const std::string &socket_path) override;
+  void Close() override;
+  void ReadMessageAsync(const ReadHandler &handler) override;
+  void WriteData(const BufferPtr &data) override;
+  void WriteData(const BufferPtr &data, const std::vector<Fd> &fds) override;
+  std::vector<Fd> TakeFds(std::size_t count) override;
+  void Flush() override;
+
+ private:
+  ShmMessenger(const std::shared_ptr<asio::io_service> &io,
+               const std::shared_ptr<SocketMessenger> &control,
+               const std::vector<Fd> &fds,
+               std::size_t capacity);
+
+  bool Map(bool is_creator);
+  bool TryDeliver(const ReadHandler &handler);
+  void WaitForData(const ReadHandler &handler);
+  void MonitorControl();
+  void WritePending();
+  void Wake(int fd);
+
+  struct PendingWrite {
+    BufferPtr data;
+    std::size_t offset;
+    bool detached;
+  };
+
+  std::shared_ptr<SocketMessenger> control_;
+  std::vector<Fd> fds_;
+  std::size_t capacity_;
+  void *memory_;
+  std::size_t memory_size_ = 0;
+  std::unique_ptr<ShmRing> tx_;
+  std::unique_ptr<ShmRing> rx_;
+  int own_wakeup_fd_ = Fd::invalid;
+  int peer_wakeup_fd_ = Fd::invalid;
+  asio::posix::stream_descriptor wakeup_;
+  std::uint64_t wakeup_value_ = 0;
+  std::atomic_bool exit_{false};
+
+  std::mutex write_lock_;
+  std::deque<PendingWrite> pending_writes_;
+  std::atomic_bool has_pending_writes_{false};
+
+  // Only accessed from the read path which has at most one read
+  // pending at any time.
+  FrameReceiver receiver_;
+  bool monitoring_ = false;
+  bool dispatching_ = false;
+  bool awaiting_detached_ = false;
+  ReadHandler next_handler_;
+
+  // Filled by the control channel
+  std::mutex control_lock_;
+  std::deque<BufferPtr> detached_messages_;
+  asio::error_code control_err_;
+};
+} // namespace binderd
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "binderd/shm_ring.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+namespace binderd {
+static_assert(sizeof(ShmRingHeader) <= ShmRing::kHeaderSize, "Ring header does not fit");
+
+constexpr std::size_t ShmRing::kHeaderSize;
+
+std::size_t ShmRing::GetMappingSize(std::size_t capacity) {
+  return kHeaderSize + capacity;
+}
+
+ShmRing::ShmRing(std::uint8_t *memory, std::size_t capacity) :
+  header_{reinterpret_cast<ShmRingHeader*>(memory)},
+  data_{memory + kHeaderSize},
+  capacity_{capacity},
+  head_{header_->head.load(std::memory_order_acquire)},
+  tail_{header_->tail.load(std::memory_order_acquire)} {}
+
+std::size_t ShmRing::GetCapacity() const {
+  return capacity_;
+}
+
+std::size_t ShmRing::GetFreeSpace() const {
+  const auto used = head_ - header_->tail.load(std::memory_order_acquire);
+  if (used > capacity_)
+    return 0;
+  return capacity_ - used;
+}
+
+void ShmRing::Write(const std::uint8_t *data, std::size_t size) {
+  const auto offset = head_ & (capacity_ - 1);
+  const auto first = std::min(size, capacity_ - offset);
+  std::memcpy(data_ + offset, data, first);
+  std::memcpy(data_, data + first, size - first);
+  head_ += size;
+}
+
+bool ShmRing::Publish() {
+  // Pairs with the store to consumer_waiting in PrepareWaitForData:
+  // either we see the flag or the consumer sees our new head.
+  header_->head.store(head_, std::memory_order_seq_cst);
+  if (header_->consumer_waiting.load(std::memory_order_seq_cst) == 0)
+    return false;
+  return header_->consumer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+}
+
+bool ShmRing::PrepareWaitForSpace(std::size_t size) {
+  // Pairs with the store to tail in Read
+  header_->producer_waiting.store(1, std::memory_order_seq_cst);
+  const auto used = head_ - header_->tail.load(std::memory_order_seq_cst);
+  return used <= capacity_ && capacity_ - used >= size;
+}
+
+bool ShmRing::Read(std::uint8_t *data, std::size_t max_size, std::size_t *size, bool *wake_producer) {
+  const auto available = header_->head.load(std::memory_order_acquire) - tail_;
+  if (available > capacity_)
+    return false;
+
+  const auto count = std::min<std::size_t>(available, max_size);
+  const auto offset = tail_ & (capacity_ - 1);
+  const auto first = std::min(count, capacity_ - offset);
+  std::memcpy(data, data_ + offset, first);
+  std::memcpy(data + first, data_, count - first);
+  tail_ += count;
+
+  *size = count;
+  *wake_producer = false;
+  if (count == 0)
+    return true;
+
+  header_->tail.store(tail_, std::memory_order_seq_cst);
+  if (header_->producer_waiting.load(std::memory_order_seq_cst) != 0)
+    *wake_producer = header_->producer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+
+  return true;
+}
+
+bool ShmRing::PrepareWaitForData() {
+  header_->consumer_waiting.store(1, std::memory_order_seq_cst);
+  return header_->head.load(std::memory_order_seq_cst) != tail_;
+}
+} // namespace binderd
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_SHM_RING_H_
+#define BINDERD_SHM_RING_H_
+
+#include "binderd/macros.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace binderd {
+// Control block of a ring placed in front of its data in shared
+// memory. Both positions only ever grow and are wrapped by the
+// capacity. The producer is the only one writing head and the
+// consumer the only one writing tail.
+struct ShmRingHeader {
+  alignas(64) std::atomic<std::uint64_t> head;
+  alignas(64) std::atomic<std::uint64_t> tail;
+  // Set by a side before it goes to sleep so the other one knows it
+  // has to send a wakeup. Nobody is woken up while it is busy.
+  alignas(64) std::atomic<std::uint32_t> consumer_waiting;
+  std::atomic<std::uint32_t> producer_waiting;
+};
+
+// ShmRing is a single producer single consumer byte ring living in
+// memory shared with another process. The peer can't be trusted so
+// every position read from the shared header is validated first.
+class ShmRing {
+ public:
+  static constexpr std::size_t kHeaderSize{256};
+
+  // The number of bytes a ring with the given capacity needs
+  static std::size_t GetMappingSize(std::size_t capacity);
+
+  // capacity needs to be a power of two
+  ShmRing(std::uint8_t *memory, std::size_t capacity);
+
+  std::size_t GetCapacity() const;
+
+  // Producer side: data is copied in with Write and becomes visible
+  // to the consumer with Publish which returns true if the consumer
+  // needs a wakeup.
+  std::size_t GetFreeSpace() const;
+  void Write(const std::uint8_t *data, std::size_t size);
+  bool Publish();
+  // Returns true if size bytes became available in the meantime
+  bool PrepareWaitForSpace(std::size_t size);
+
+  // Consumer side: copies out at most max_size bytes. Returns false
+  // if the peer corrupted the ring. wake_producer is set when the
+  // producer waits for the space we just freed.
+  bool Read(std::uint8_t *data, std::size_t max_size, std::size_t *size, bool *wake_producer);
+  // Returns true if data arrived in the meantime
+  bool PrepareWaitForData();
+
+ private:
+  ShmRingHeader *header_;
+  std::uint8_t *data_;
+  std::size_t capacity_;
+  std::uint64_t head_;
+  std::uint64_t tail_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmRing);
+};
+} // namespace binderd
+
+#endif
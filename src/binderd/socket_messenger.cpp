@@ -18,19 +18,37 @@
 #include "binderd/socket_messenger.h"
 #include "binderd/logger.h"
 
+#include <algorithm>
 #include <functional>
+#include <thread>
+
+#include <cstring>
+
+#include <sys/socket.h>
+
+namespace {
+// asio hands at most 64 buffers to a single sendmsg call
+constexpr const std::size_t kMaxBuffersPerWrite{64};
+// Upper limit of fds we accept with a single read. The kernel doesn't
+// allow more than 253 fds per message anyway.
+constexpr const std::size_t kMaxFdsPerRead{253};
+}
 
 namespace binderd {
-SocketMessenger::SocketMessenger(const std::shared_ptr<asio::io_service> &io) :
+SocketMessenger::SocketMessenger(const std::shared_ptr<asio::io_service> &io,
+                                 std::size_t max_message_size) :
   socket_(asio::local::stream_protocol::socket(*io)),
-  write_strand_(*io),
-  body_{CreateBufferWithSize(0)} {}
+  max_buffers_per_write_{kMaxBuffersPerWrite},
+  receiver_{max_message_size},
+  max_message_size_{max_message_size} {}
 
-SocketMessenger::SocketMessenger(const std::shared_ptr<asio::io_service> &io,
-                                 asio::local::stream_protocol::socket socket) :
+SocketMessenger::SocketMessenger(const std::shared_ptr<asio::io_service>&,
+                                 asio::local::stream_protocol::socket socket,
+                                 std::size_t max_message_size) :
   socket_(std::move(socket)),
-  write_strand_(*io),
-  body_{CreateBufferWithSize(0)} {}
+  max_buffers_per_write_{kMaxBuffersPerWrite},
+  receiver_{max_message_size},
+  max_message_size_{max_message_size} {}
 
 SocketMessenger::~SocketMessenger() {}
 
@@ -43,8 +61,10 @@ void SocketMessenger::OnMessageSent(const asio::error_code &err) {
     return;
   }
 
-  write_queue_.pop_front();
-  if (write_queue_.size() > 0)
+  const auto num_written = batch_.size();
+  batch_.clear();
+
+  if (num_pending_writes_.fetch_sub(num_written) > num_written)
     WriteNext();
 
   if (exit_) {
@@ -63,77 +83,290 @@ void SocketMessenger::Close() {
   exit_ = true;
 }
 
+void SocketMessenger::AddFramesToBatch(const BufferPtr &data) {
+  const auto size = data->GetSize();
+  std::size_t offset = 0;
+
+  // Split the message into frames of at most kFrameChunkSize bytes
+  // each. An empty message still gets a single frame. The space for
+  // all headers was already reserved by WriteNext.
+  do {
+    FrameHeader header;
+    header.length = static_cast<std::uint32_t>(std::min(size - offset, kFrameChunkSize));
+    if (offset + header.length < size)
+      header.flags = FrameHeader::More;
+
+    const auto header_offset = batch_headers_.size();
+    batch_headers_.resize(header_offset + FrameHeader::kSize);
+    header.Encode(batch_headers_.data() + header_offset);
+
+    batch_buffers_.push_back(asio::buffer(batch_headers_.data() + header_offset, FrameHeader::kSize));
+    if (header.length > 0)
+      batch_buffers_.push_back(asio::buffer(data->GetData() + offset, header.length));
+
+    offset += header.length;
+  } while (offset < size);
+}
+
 void SocketMessenger::WriteNext() {
   if (exit_)
     return;
 
-  auto &item = write_queue_.front();
-  auto handler = write_strand_.wrap(std::bind(&SocketMessenger::OnMessageSent, this, std::placeholders::_1));
+  // Collect as many pending messages as fit into a single sendmsg
+  // call and write their headers and bodies without copying them.
+  auto num_frames = [](const BufferPtr &data) {
+    return std::max<std::size_t>(1, (data->GetSize() + kFrameChunkSize - 1) / kFrameChunkSize);
+  };
+
+  std::size_t total_frames = 0;
+
+  // Fds are sent with the first byte of a batch so only its first
+  // message can carry any.
+  auto add_to_batch = [&](OutgoingMessage &msg) {
+    total_frames += num_frames(msg.data);
+    batch_.push_back(std::move(msg.data));
+    batch_fds_ = std::move(msg.fds);
+  };
+
+  if (carry_.data)
+    add_to_batch(carry_);
+
+  OutgoingMessage item;
+  while (batch_.size() < num_pending_writes_) {
+    if (!write_queue_.Pop(item)) {
+      // Another producer is still in the middle of pushing its item.
+      // We only need to wait for it when we have nothing to write yet.
+      if (!batch_.empty())
+        break;
+      std::this_thread::yield();
+      continue;
+    }
+
+    if (batch_.empty()) {
+      add_to_batch(item);
+      continue;
+    }
+
+    const auto frames = num_frames(item.data);
+    if (!item.fds.empty() || (total_frames + frames) * 2 > max_buffers_per_write_) {
+      carry_ = std::move(item);
+      break;
+    }
+
+    total_frames += frames;
+    batch_.push_back(std::move(item.data));
+  }
+
+  batch_headers_.clear();
+  batch_headers_.reserve(total_frames * FrameHeader::kSize);
+  batch_buffers_.clear();
+  for (const auto &data : batch_)
+    AddFramesToBatch(data);
+
+  SendBatch();
+}
+
+void SocketMessenger::SendBatch() {
+  if (!batch_fds_.empty()) {
+    WriteBatchWithFds();
+    return;
+  }
+
+  asio::async_write(socket_, batch_buffers_, [this](const asio::error_code &err, std::size_t) {
+    OnMessageSent(err);
+  });
+}
+
+void SocketMessenger::WriteBatchWithFds() {
+  // asio has no support for ancillary data so the first part of the
+  // batch goes out with a plain sendmsg. Whatever the kernel didn't
+  // take is written the usual way afterwards.
+  std::vector<iovec> iov;
+  iov.reserve(batch_buffers_.size());
+  for (const auto &buffer : batch_buffers_)
+    iov.push_back(iovec{const_cast<void*>(asio::buffer_cast<const void*>(buffer)),
+                        asio::buffer_size(buffer)});
+
+  std::vector<std::uint8_t> control(CMSG_SPACE(sizeof(int) * batch_fds_.size()));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov.data();
+  msg.msg_iovlen = iov.size();
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch_fds_.size());
+  auto fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+  for (const auto &fd : batch_fds_)
+    *fds++ = fd;
+
+  const auto sent = ::sendmsg(socket_.native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      socket_.async_write_some(asio::null_buffers(), [this](const asio::error_code &err, std::size_t) {
+        if (err) {
+          OnMessageSent(err);
+          return;
+        }
+        WriteBatchWithFds();
+      });
+      return;
+    }
+
+    OnMessageSent(asio::error_code(errno, asio::error::get_system_category()));
+    return;
+  }
+
+  // Our copies of the fds can go now that the kernel has its own
+  batch_fds_.clear();
 
-  auto whole_message = CreateBufferWithSize(header_size + item->GetSize());
-  whole_message->GetData()[0] = static_cast<std::uint8_t>((item->GetSize() >> 8) & 0xff);
-  whole_message->GetData()[1] = static_cast<std::uint8_t>((item->GetSize() >> 0) & 0xff);
-  std::copy(item->GetData(), item->GetData() + item->GetSize(), whole_message->GetData() + header_size);
+  std::vector<asio::const_buffer> remaining;
+  auto skip = static_cast<std::size_t>(sent);
+  for (const auto &buffer : batch_buffers_) {
+    const auto size = asio::buffer_size(buffer);
+    if (skip >= size) {
+      skip -= size;
+      continue;
+    }
+    remaining.push_back(buffer + skip);
+    skip = 0;
+  }
 
-  asio::async_write(socket_, asio::buffer(whole_message->GetData(), whole_message->GetSize()), handler);
+  if (remaining.empty()) {
+    socket_.get_io_service().post([this]() { OnMessageSent(asio::error_code{}); });
+    return;
+  }
+
+  batch_buffers_ = std::move(remaining);
+  asio::async_write(socket_, batch_buffers_, [this](const asio::error_code &err, std::size_t) {
+    OnMessageSent(err);
+  });
 }
 
 void SocketMessenger::Flush() {
 }
 
+std::size_t SocketMessenger::GetMaxMessageSize() const {
+  return max_message_size_;
+}
+
 void SocketMessenger::WriteData(const BufferPtr &data) {
-  write_queue_.push_back(data);
-  if (write_queue_.size() > 1)
+  WriteData(data, std::vector<Fd>{});
+}
+
+void SocketMessenger::WriteData(const BufferPtr &data, const std::vector<Fd> &fds) {
+  write_queue_.Push(OutgoingMessage{data, fds});
+  if (num_pending_writes_++ > 0)
     return;
 
   WriteNext();
 }
 
+void SocketMessenger::AddReceivedFds(std::vector<Fd> fds) {
+  if (fds.empty())
+    return;
+
+  std::lock_guard<std::mutex> l(received_fds_lock_);
+  for (auto &fd : fds)
+    received_fds_.push_back(std::move(fd));
+}
+
+std::vector<Fd> SocketMessenger::TakeFds(std::size_t count) {
+  std::lock_guard<std::mutex> l(received_fds_lock_);
+  count = std::min(count, received_fds_.size());
+  std::vector<Fd> fds{received_fds_.begin(), received_fds_.begin() + count};
+  received_fds_.erase(received_fds_.begin(), received_fds_.begin() + count);
+  return fds;
+}
+
 void SocketMessenger::ReadMessageAsync(const ReadHandler &handler) {
-  auto buffer = asio::buffer(header_, header_size);
-  asio::async_read(socket_,
-                 buffer,
-                 asio::transfer_exactly(asio::buffer_size(buffer)),
-                 [this, handler](const asio::error_code &err, size_t) {
-    if (err) {
-      handler(err, nullptr);
-      return;
-    }
+  switch (receiver_.Deliver(handler)) {
+  case FrameReceiver::Result::Delivered:
+    return;
+  case FrameReceiver::Result::Detached:
+    // We don't have another channel detached messages could use
+    handler(asio::error::invalid_argument, nullptr);
+    return;
+  default:
+    break;
+  }
 
-    const size_t body_size = (header_[0] << 8) + header_[1];
-    body_->Resize(body_size);
-
-    if (GetAvailableBytes() >= body_size) {
-      handler(ReadBuffer(asio::buffer(body_->GetData(), body_->GetSize())), body_);
-    } else {
-      auto buffer = asio::buffer(body_->GetData(), body_->GetSize());
-      asio::async_read(socket_,
-                     buffer,
-                     asio::transfer_exactly(asio::buffer_size(buffer)),
-                     [this, handler](const asio::error_code &err, size_t) { handler(err, body_); });
-    }
-  });
+  WaitForData(handler);
 }
 
-asio::error_code SocketMessenger::ReadBuffer(const asio::mutable_buffers_1 &buffer) {
-  asio::error_code err;
-  size_t nread = 0;
+void SocketMessenger::WaitForData(const ReadHandler &handler) {
+  // We read ourself with recvmsg to get hold of any fds the peer sent
+  // and only let asio tell us when there is something to read.
+  socket_.async_read_some(asio::null_buffers(), [this, handler](const asio::error_code &err, std::size_t) {
+    OnDataAvailable(handler, err);
+  });
+}
 
-  while (nread < asio::buffer_size(buffer)) {
-    nread += asio::read(socket_,
-                      asio::mutable_buffers_1{buffer+nread},
-                      err);
+void SocketMessenger::OnDataAvailable(const ReadHandler &handler, const asio::error_code &err) {
+  if (err) {
+    handler(err, nullptr);
+    return;
+  }
 
-    if (err && err!= asio::error::would_block)
-      break;
+  std::size_t size = 0;
+  const auto read_err = ReceiveData(&size);
+  if (read_err == asio::error::would_block) {
+    ReadMessageAsync(handler);
+    return;
+  } else if (read_err) {
+    handler(read_err, nullptr);
+    return;
   }
 
-  return err;
+  receiver_.Commit(size);
+  ReadMessageAsync(handler);
 }
 
-size_t SocketMessenger::GetAvailableBytes() {
-  asio::socket_base::bytes_readable cmd{true};
-  socket_.io_control(cmd);
-  return cmd.get();
+asio::error_code SocketMessenger::ReceiveData(std::size_t *size) {
+  std::size_t space = 0;
+  iovec iov;
+  iov.iov_base = receiver_.PrepareSpace(&space);
+  iov.iov_len = space;
+
+  std::uint8_t control[CMSG_SPACE(sizeof(int) * kMaxFdsPerRead)];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  const auto received = ::recvmsg(socket_.native_handle(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (received < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return asio::error::would_block;
+    return asio::error_code(errno, asio::error::get_system_category());
+  } else if (received == 0) {
+    return asio::error::eof;
+  }
+
+  std::vector<Fd> fds;
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    const auto num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const auto received_fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+    for (std::size_t n = 0; n < num_fds; n++)
+      fds.push_back(Fd{received_fds[n]});
+  }
+  AddReceivedFds(std::move(fds));
+
+  // Once fds got lost we can't tell anymore which of the following
+  // ones belong to which message.
+  if (msg.msg_flags & MSG_CTRUNC) {
+    ERROR("Peer sent more fds than we can receive at once");
+    return asio::error::no_buffer_space;
+  }
+
+  *size = static_cast<std::size_t>(received);
+  return asio::error_code{};
 }
 } // namespace binderd
@@ -19,41 +19,80 @@
 #define BINDERD_SOCKET_MESSENGER_H_
 
 #include "binderd/messenger.h"
+#include "binderd/constants.h"
+#include "binderd/frame.h"
+#include "binderd/common/mpsc_queue.h"
 
+#include <atomic>
 #include <deque>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include <cstdint>
 
 namespace binderd {
 class ClientImpl;
 class SocketMessenger : public Messenger {
  public:
-  explicit SocketMessenger(const std::shared_ptr<asio::io_service> &io);
+  explicit SocketMessenger(const std::shared_ptr<asio::io_service> &io,
+                           std::size_t max_message_size = kDefaultMaxMessageSize);
   SocketMessenger(const std::shared_ptr<asio::io_service> &io,
-                  asio::local::stream_protocol::socket socket);
+                  asio::local::stream_protocol::socket socket,
+                  std::size_t max_message_size = kDefaultMaxMessageSize);
   ~SocketMessenger();
 
   bool Connect(const std::string &socket_path) override;
   void Close() override;
   void ReadMessageAsync(const ReadHandler &handler) override;
   void WriteData(const BufferPtr &data) override;
+  void WriteData(const BufferPtr &data, const std::vector<Fd> &fds) override;
+  std::vector<Fd> TakeFds(std::size_t count) override;
   void Flush() override;
 
+  std::size_t GetMaxMessageSize() const;
+
  protected:
+  // Writes batch_buffers_ together with batch_fds_ and calls
+  // OnMessageSent once done.
+  virtual void SendBatch();
+  // Waits until data arrived in receiver_ or an error occurred and
+  // then continues with ReadMessageAsync or calls the handler.
+  virtual void WaitForData(const ReadHandler &handler);
+
+  void OnMessageSent(const asio::error_code &err);
+  void AddReceivedFds(std::vector<Fd> fds);
+
   asio::local::stream_protocol::socket socket_;
-  asio::strand write_strand_;
   std::atomic_bool exit_{false};
+  std::size_t max_buffers_per_write_;
+  std::vector<Fd> batch_fds_;
+  std::vector<asio::const_buffer> batch_buffers_;
+  FrameReceiver receiver_;
 
  private:
-  asio::error_code ReadBuffer(const asio::mutable_buffers_1 &buffer);
-  size_t GetAvailableBytes();
-  void OnMessageSent(const asio::error_code &err);
+  struct OutgoingMessage {
+    BufferPtr data;
+    std::vector<Fd> fds;
+  };
+
+  void OnDataAvailable(const ReadHandler &handler, const asio::error_code &err);
+  asio::error_code ReceiveData(std::size_t *size);
   void WriteNext();
+  void WriteBatchWithFds();
+  void AddFramesToBatch(const BufferPtr &data);
+
+  // WriteData can be called from any thread. Whoever moves
+  // num_pending_writes_ away from zero becomes the only writer until
+  // all queued messages are written out.
+  MpscQueue<OutgoingMessage> write_queue_;
+  std::atomic<std::size_t> num_pending_writes_{0};
+  OutgoingMessage carry_;
+  std::vector<BufferPtr> batch_;
+  std::vector<std::uint8_t> batch_headers_;
 
-  std::deque<BufferPtr> write_queue_;
-  static const size_t header_size = 2;
-  std::uint8_t header_[header_size];
-  BufferPtr body_;
+  std::size_t max_message_size_;
+  std::mutex received_fds_lock_;
+  std::deque<Fd> received_fds_;
 };
 } // namespace binderd
 
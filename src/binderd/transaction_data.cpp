@@ -18,14 +18,65 @@
 #include "binderd/transaction_data.h"
 #include "binderd/common/binary_writer.h"
 #include "binderd/common/utils.h"
+#include "binderd/logger.h"
 
-#include <asm/types.h>
-#include <linux/binder.h>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+binderd::Fd CreateSealedMemfd(const uint8_t *data, size_t size) {
+  binderd::Fd memory{::memfd_create("binderd-transaction", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+  if (memory < 0) {
+    WARNING("Failed to create memfd: %s", strerror(errno));
+    return binderd::Fd{};
+  }
+
+  size_t offset = 0;
+  while (offset < size) {
+    const auto written = ::write(memory, data + offset, size - offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      WARNING("Failed to write transaction data to memfd: %s", strerror(errno));
+      return binderd::Fd{};
+    }
+    offset += static_cast<size_t>(written);
+  }
+
+  // The receiver maps the memory so it must not change anymore
+  if (::fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    WARNING("Failed to seal memfd: %s", strerror(errno));
+    return binderd::Fd{};
+  }
+
+  return memory;
+}
+}
 
 namespace binderd {
-BufferPtr TransactionData::Pack() const {
+Fd TransactionData::GetDataFd() const {
+  return Fd{};
+}
+
+BufferPtr TransactionData::Pack(std::vector<Fd> *fds, size_t out_of_line_threshold) const {
+  // Objects get rewritten in place on their way through the server
+  // which a sealed memfd doesn't allow.
+  Fd data_fd;
+  if (fds && GetNumObjectOffsets() == 0) {
+    data_fd = GetDataFd();
+    if (data_fd < 0 && GetDataSize() >= out_of_line_threshold)
+      data_fd = CreateSealedMemfd(GetData(), GetDataSize());
+  }
+
+  const auto data_size = data_fd >= 0 ? sizeof(uint64_t) : GetDataSize();
+  const auto objects_size = GetNumObjectOffsets() * sizeof(binder_size_t);
+
   BinaryWriter writer;
   writer.SetPadding(false);
+  writer.Reserve(2 * sizeof(uint64_t) + 4 * sizeof(uint32_t) + data_size + objects_size);
 
   writer.WriteUint64(GetBinder());
   writer.WriteUint64(GetCookie());
@@ -36,16 +87,38 @@ BufferPtr TransactionData::Pack() const {
     flags |= static_cast<uint32_t>(Flags::OneWay);
   if (HasStatus())
     flags |= static_cast<uint32_t>(Flags::HasStatus);
+  if (data_fd >= 0)
+    flags |= static_cast<uint32_t>(Flags::OutOfLine);
   writer.WriteUint32(flags);
 
-  writer.WriteSizedData(GetData(),
-                        GetDataSize());
-  writer.WriteSizedData(GetObjectOffsets(),
-                        GetNumObjectOffsets() * sizeof(binder_size_t));
+  if (data_fd >= 0) {
+    const uint64_t size = GetDataSize();
+    writer.WriteSizedData(reinterpret_cast<const uint8_t*>(&size), sizeof(size));
+    fds->push_back(data_fd);
+  } else {
+    writer.WriteSizedData(GetData(),
+                          GetDataSize());
+  }
+  writer.WriteSizedData(GetObjectOffsets(), objects_size);
 
   return writer.Finalize();
 }
 
+std::vector<flat_binder_object*> TransactionData::GetFileDescriptorObjects() const {
+  std::vector<flat_binder_object*> objects;
+  for (size_t n = 0; n < GetNumObjectOffsets(); n++) {
+    binder_size_t offset = 0;
+    ::memcpy(&offset, GetObjectOffsets() + n * sizeof(binder_size_t), sizeof(offset));
+    if (offset > GetDataSize() || GetDataSize() - offset < sizeof(flat_binder_object))
+      continue;
+
+    auto obj = reinterpret_cast<flat_binder_object*>(GetMutableData() + offset);
+    if (obj->type == BINDER_TYPE_FD)
+      objects.push_back(obj);
+  }
+  return objects;
+}
+
 std::ostream& operator<<(std::ostream &out, const TransactionData &data) {
   out << utils::string_format("Binder=%d Cookie=%d Code=%d Flags={ IsOneWay=%d HasStatus=%d }",
                               data.GetBinder(), data.GetCookie(), data.GetCode(),
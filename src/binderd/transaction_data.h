@@ -20,6 +20,11 @@
 
 #include "binderd/status.h"
 #include "binderd/buffer.h"
+#include "binderd/binder_api.h"
+#include "binderd/constants.h"
+#include "binderd/common/fd.h"
+
+#include <vector>
 
 namespace binderd {
 class TransactionData {
@@ -29,6 +34,9 @@ class TransactionData {
     RootObject = 0x4,
     HasStatus = 0x8,
     AcceptFds = 0x10,
+    // The data section lives in a sealed memfd passed as last fd
+    // next to the message.
+    OutOfLine = 0x20,
   };
 
   virtual ~TransactionData() {}
@@ -44,8 +52,19 @@ class TransactionData {
   virtual size_t GetDataSize() const = 0;
   virtual const uint8_t* GetObjectOffsets() const = 0;
   virtual size_t GetNumObjectOffsets() const = 0;
+  // Returns the sealed memfd holding the data section if it doesn't
+  // live in our memory already.
+  virtual Fd GetDataFd() const;
+
+  // Data sections of at least out_of_line_threshold bytes are put in
+  // a sealed memfd which is appended to fds. Without fds everything is
+  // packed inline.
+  BufferPtr Pack(std::vector<Fd> *fds = nullptr,
+                 size_t out_of_line_threshold = kDefaultOutOfLineThreshold) const;
 
-  BufferPtr Pack() const;
+  // Returns all file descriptor objects in the order they appear in
+  // the data. Objects not fully inside the data are skipped.
+  std::vector<flat_binder_object*> GetFileDescriptorObjects() const;
 };
 std::ostream& operator<<(std::ostream &out, const TransactionData &data);
 } // namespace binderd
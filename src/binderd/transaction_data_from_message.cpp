@@ -19,23 +19,97 @@
 #include "binderd/binder_api.h"
 #include "binderd/logger.h"
 
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+namespace {
+constexpr const int kRequiredSeals{F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE};
+
+// Layout of the fixed header written by TransactionData::Pack()
+constexpr const std::size_t kBinderOffset{0};
+constexpr const std::size_t kCookieOffset{8};
+constexpr const std::size_t kCodeOffset{16};
+constexpr const std::size_t kFlagsOffset{20};
+constexpr const std::size_t kHeaderSize{24};
+}
+
 namespace binderd {
-struct TransactionDataFromMessage::Implementation {
+struct TransactionDataFromMessage::Implementation : public slab::Allocated {
   Implementation(const MessagePtr &msg) : msg{msg} {
     auto reader = msg->GetReader();
 
     reader.SetPadding(false);
 
-    binder = static_cast<uintptr_t>(reader.ReadUint64());
-    cookie = static_cast<uintptr_t>(reader.ReadUint64());
-    code = reader.ReadUint32();
-    flags = reader.ReadUint32();
+    // Keep a view on the header so that binder and cookie can be
+    // rewritten in place when the server forwards the transaction.
+    header = reader.ReadData(kHeaderSize);
+    uint64_t value = 0;
+    ::memcpy(&value, header->GetData() + kBinderOffset, sizeof(value));
+    binder = static_cast<uintptr_t>(value);
+    ::memcpy(&value, header->GetData() + kCookieOffset, sizeof(value));
+    cookie = static_cast<uintptr_t>(value);
+    ::memcpy(&code, header->GetData() + kCodeOffset, sizeof(code));
+    ::memcpy(&flags, header->GetData() + kFlagsOffset, sizeof(flags));
     data = reader.ReadSizedData();
     objects = reader.ReadSizedData();
     num_objects = objects->GetSize() / sizeof(binder_size_t);
+
+    if (flags & static_cast<uint32_t>(Flags::OutOfLine))
+      SetupOutOfLineData();
+  }
+
+  ~Implementation() {
+    if (mapping != MAP_FAILED)
+      ::munmap(mapping, data_size);
+  }
+
+  void SetupOutOfLineData() {
+    uint64_t size = 0;
+    if (data->GetSize() != sizeof(size) || num_objects > 0)
+      throw std::out_of_range{"Invalid out of line data"};
+    ::memcpy(&size, data->GetData(), sizeof(size));
+    data_size = static_cast<size_t>(size);
+
+    // The memfd is only attached once the messenger handed out the
+    // fds of the message. Until then only the size is known.
+    const auto &fds = msg->GetFds();
+    if (fds.empty())
+      return;
+    data_fd = fds.back();
+
+    // Nobody must be able to change the memory below us while we
+    // have it mapped.
+    struct stat st;
+    const auto seals = ::fcntl(data_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & kRequiredSeals) != kRequiredSeals ||
+        ::fstat(data_fd, &st) < 0 || static_cast<uint64_t>(st.st_size) != size)
+      throw std::out_of_range{"Unusable out of line data"};
+  }
+
+  uint8_t* GetData() {
+    if (!(flags & static_cast<uint32_t>(Flags::OutOfLine)))
+      return data->GetData();
+
+    if (mapping == MAP_FAILED && data_size > 0) {
+      if (data_fd < 0)
+        throw std::runtime_error{"Out of line data is not available"};
+
+      // A private mapping lets us rewrite objects in place without
+      // the sender noticing and without copying anything upfront.
+      mapping = ::mmap(nullptr, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, data_fd, 0);
+      if (mapping == MAP_FAILED)
+        throw std::runtime_error{"Failed to map out of line data"};
+    }
+
+    return mapping == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t*>(mapping);
   }
 
   MessagePtr msg;
+  BufferPtr header;
   uintptr_t binder = 0;
   uintptr_t cookie = 0;
   uint32_t code = 0;
@@ -43,6 +117,9 @@ struct TransactionDataFromMessage::Implementation {
   BufferPtr data;
   BufferPtr objects;
   size_t num_objects = 0;
+  Fd data_fd;
+  size_t data_size = 0;
+  void *mapping = MAP_FAILED;
 };
 
 TransactionDataFromMessage::TransactionDataFromMessage(const MessagePtr &msg) :
@@ -51,7 +128,7 @@ TransactionDataFromMessage::TransactionDataFromMessage(const MessagePtr &msg) :
 TransactionDataFromMessage::~TransactionDataFromMessage() {}
 
 uint8_t* TransactionDataFromMessage::GetMutableData() const {
-  return impl->data->GetData();
+  return impl->GetData();
 }
 
 uintptr_t TransactionDataFromMessage::GetBinder() const {
@@ -62,6 +139,18 @@ uintptr_t TransactionDataFromMessage::GetCookie() const {
   return impl->cookie;
 }
 
+void TransactionDataFromMessage::SetBinder(uintptr_t binder) {
+  const uint64_t value = binder;
+  ::memcpy(impl->header->GetData() + kBinderOffset, &value, sizeof(value));
+  impl->binder = binder;
+}
+
+void TransactionDataFromMessage::SetCookie(uintptr_t cookie) {
+  const uint64_t value = cookie;
+  ::memcpy(impl->header->GetData() + kCookieOffset, &value, sizeof(value));
+  impl->cookie = cookie;
+}
+
 uint32_t TransactionDataFromMessage::GetCode() const {
   return impl->code;
 }
@@ -79,10 +168,12 @@ Status TransactionDataFromMessage::GetStatus() const {
 }
 
 const uint8_t* TransactionDataFromMessage::GetData() const {
-  return impl->data->GetData();
+  return impl->GetData();
 }
 
 size_t TransactionDataFromMessage::GetDataSize() const {
+  if (IsOutOfLine())
+    return impl->data_size;
   return impl->data->GetSize();
 }
 
@@ -93,4 +184,16 @@ const uint8_t* TransactionDataFromMessage::GetObjectOffsets() const {
 size_t TransactionDataFromMessage::GetNumObjectOffsets() const {
   return impl->num_objects;
 }
+
+Fd TransactionDataFromMessage::GetDataFd() const {
+  return impl->data_fd;
+}
+
+bool TransactionDataFromMessage::IsOutOfLine() const {
+  return (impl->flags & static_cast<uint32_t>(Flags::OutOfLine));
+}
+
+size_t TransactionDataFromMessage::GetNumFds() const {
+  return GetFileDescriptorObjects().size() + (IsOutOfLine() ? 1 : 0);
+}
 } // namespace binderd
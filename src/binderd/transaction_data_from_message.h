@@ -21,9 +21,10 @@
 #include "binderd/transaction_data.h"
 #include "binderd/message.h"
 #include "binderd/macros.h"
+#include "binderd/common/slab_allocator.h"
 
 namespace binderd {
-class TransactionDataFromMessage : public TransactionData {
+class TransactionDataFromMessage : public TransactionData, public slab::Allocated {
  public:
   explicit TransactionDataFromMessage(const MessagePtr &msg);
   ~TransactionDataFromMessage() override;
@@ -40,6 +41,15 @@ class TransactionDataFromMessage : public TransactionData {
   size_t GetDataSize() const override;
   const uint8_t* GetObjectOffsets() const override;
   size_t GetNumObjectOffsets() const override;
+  Fd GetDataFd() const override;
+
+  // Rewrite the header of the message we're reading from in place.
+  void SetBinder(uintptr_t binder);
+  void SetCookie(uintptr_t cookie);
+
+  bool IsOutOfLine() const;
+  // Number of fds the sender passed next to the message.
+  size_t GetNumFds() const;
 
  private:
   struct Implementation;
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "binderd/uring_messenger.h"
+#include "binderd/logger.h"
+
+#include <algorithm>
+
+#include <climits>
+#include <cstring>
+
+namespace {
+// Data we keep around for a reader which doesn't keep up before we
+// stop receiving from the socket and let the kernel apply backpressure.
+constexpr const std::size_t kMaxBacklogSize{1024 * 1024};
+}
+
+namespace binderd {
+UringMessenger::UringMessenger(const std::shared_ptr<asio::io_service> &io,
+                               const std::shared_ptr<IoUring> &uring,
+                               asio::local::stream_protocol::socket socket,
+                               std::size_t max_message_size) :
+  SocketMessenger(io, std::move(socket), max_message_size),
+  uring_{uring},
+  token_{std::make_shared<Token>()} {
+  token_->messenger = this;
+  // We are not limited by asio here but only by what sendmsg accepts
+  max_buffers_per_write_ = IOV_MAX;
+}
+
+UringMessenger::~UringMessenger() {
+  std::lock_guard<std::recursive_mutex> l(token_->lock);
+  token_->messenger = nullptr;
+  if (receiving_)
+    uring_->Cancel(receive_id_);
+}
+
+void UringMessenger::Close() {
+  SocketMessenger::Close();
+
+  std::lock_guard<std::mutex> l(receive_lock_);
+  if (receiving_)
+    uring_->Cancel(receive_id_);
+}
+
+void UringMessenger::SendBatch() {
+  auto token = token_;
+  uring_->Send(socket_.native_handle(), batch_buffers_, batch_fds_, [token](const asio::error_code &err) {
+    std::lock_guard<std::recursive_mutex> l(token->lock);
+    if (token->messenger)
+      token->messenger->OnMessageSent(err);
+  });
+  // The submission holds its own copies of the fds
+  batch_fds_.clear();
+}
+
+void UringMessenger::StartReceive() {
+  if (receiving_ || receive_err_ || exit_ || backlog_.size() >= kMaxBacklogSize)
+    return;
+
+  receiving_ = true;
+  throttled_ = false;
+
+  auto token = token_;
+  receive_id_ = uring_->Receive(socket_.native_handle(), [token](const asio::error_code &err,
+                                                                const std::uint8_t *data,
+                                                                std::size_t size,
+                                                                std::vector<Fd> fds,
+                                                                bool more) {
+    std::lock_guard<std::recursive_mutex> l(token->lock);
+    if (token->messenger)
+      token->messenger->OnReceive(err, data, size, std::move(fds), more);
+  });
+}
+
+void UringMessenger::OnReceive(const asio::error_code &err,
+                               const std::uint8_t *data,
+                               std::size_t size,
+                               std::vector<Fd> fds,
+                               bool more) {
+  ReadHandler handler;
+  {
+    std::lock_guard<std::mutex> l(receive_lock_);
+    AddReceivedFds(std::move(fds));
+
+    // While a reader waits it doesn't touch the receiver so we can
+    // store the data there right away.
+    if (pending_read_ && backlog_.empty() && size > 0) {
+      std::size_t space = 0;
+      auto dst = receiver_.PrepareSpace(&space);
+      const auto n = std::min(space, size);
+      std::memcpy(dst, data, n);
+      receiver_.Commit(n);
+      data += n;
+      size -= n;
+    }
+    backlog_.insert(backlog_.end(), data, data + size);
+
+    if (err && !receive_err_ && !(err == asio::error::operation_aborted && throttled_ && !exit_))
+      receive_err_ = err;
+
+    if (!more) {
+      receiving_ = false;
+      StartReceive();
+    } else if (backlog_.size() >= kMaxBacklogSize && !throttled_) {
+      throttled_ = true;
+      uring_->Cancel(receive_id_);
+    }
+
+    if (!pending_read_)
+      return;
+    handler = std::move(pending_read_);
+    pending_read_ = nullptr;
+  }
+
+  ReadMessageAsync(handler);
+}
+
+bool UringMessenger::MoveBacklogToReceiver() {
+  if (backlog_.empty())
+    return false;
+
+  std::size_t space = 0;
+  auto dst = receiver_.PrepareSpace(&space);
+  const auto n = std::min(space, backlog_.size());
+  std::memcpy(dst, backlog_.data(), n);
+  receiver_.Commit(n);
+  backlog_.erase(backlog_.begin(), backlog_.begin() + n);
+  return n > 0;
+}
+
+void UringMessenger::WaitForData(const ReadHandler &handler) {
+  asio::error_code err;
+  {
+    std::lock_guard<std::mutex> l(receive_lock_);
+    if (!MoveBacklogToReceiver()) {
+      if (!receive_err_) {
+        pending_read_ = handler;
+        StartReceive();
+        return;
+      }
+      err = receive_err_;
+    } else {
+      StartReceive();
+    }
+  }
+
+  if (err) {
+    handler(err, nullptr);
+    return;
+  }
+
+  ReadMessageAsync(handler);
+}
+} // namespace binderd
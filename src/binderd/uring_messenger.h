@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BINDERD_URING_MESSENGER_H_
+#define BINDERD_URING_MESSENGER_H_
+
+#include "binderd/socket_messenger.h"
+#include "binderd/io_uring.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace binderd {
+// UringMessenger speaks the same protocol as SocketMessenger but moves
+// the socket I/O onto an io_uring instance. A single multishot receive
+// stays armed for the whole lifetime of the messenger and each batch
+// of outgoing messages is written with one submission.
+class UringMessenger : public SocketMessenger {
+ public:
+  UringMessenger(const std::shared_ptr<asio::io_service> &io,
+                 const std::shared_ptr<IoUring> &uring,
+                 asio::local::stream_protocol::socket socket,
+                 std::size_t max_message_size = kDefaultMaxMessageSize);
+  ~UringMessenger();
+
+  void Close() override;
+
+ protected:
+  void SendBatch() override;
+  void WaitForData(const ReadHandler &handler) override;
+
+ private:
+  // Completions can still arrive while the messenger goes away. They
+  // only reach it through this token which the destructor resets.
+  struct Token {
+    std::recursive_mutex lock;
+    UringMessenger *messenger;
+  };
+
+  void StartReceive();
+  void OnReceive(const asio::error_code &err,
+                 const std::uint8_t *data,
+                 std::size_t size,
+                 std::vector<Fd> fds,
+                 bool more);
+  bool MoveBacklogToReceiver();
+
+  std::shared_ptr<IoUring> uring_;
+  std::shared_ptr<Token> token_;
+
+  std::mutex receive_lock_;
+  std::uint64_t receive_id_ = 0;
+  bool receiving_ = false;
+  // Set when we stopped receiving because nobody reads from us
+  bool throttled_ = false;
+  asio::error_code receive_err_;
+  std::vector<std::uint8_t> backlog_;
+  ReadHandler pending_read_;
+};
+} // namespace binderd
+
+#endif
@@ -20,9 +20,10 @@
 
 #include "binderd/transaction_data.h"
 #include "binderd/macros.h"
+#include "binderd/common/slab_allocator.h"
 
 namespace binderd {
-class WritableTransactionData : public TransactionData {
+class WritableTransactionData : public TransactionData, public slab::Allocated {
  public:
   explicit WritableTransactionData();
   ~WritableTransactionData() override;
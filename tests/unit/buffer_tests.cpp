@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "binderd/buffer.h"
+#include "binderd/constants.h"
+#include "binderd/common/binary_writer.h"
+
+TEST(Buffer, SmallBuffersUseInlineStorage) {
+  auto buffer = binderd::CreateBufferWithSize(10);
+  ASSERT_EQ(buffer->GetSize(), 10);
+  ASSERT_EQ(buffer->GetCapacity(), binderd::kInlineBufferSize);
+
+  buffer->GetData()[0] = 42;
+  buffer->Resize(binderd::kInlineBufferSize);
+  ASSERT_EQ(buffer->GetCapacity(), binderd::kInlineBufferSize);
+  ASSERT_EQ(buffer->GetData()[0], 42);
+}
+
+TEST(Buffer, GrowsGeometrically) {
+  auto buffer = binderd::CreateBufferWithSize(1);
+  buffer->GetData()[0] = 42;
+  buffer->Resize(binderd::kInlineBufferSize + 1);
+  ASSERT_EQ(buffer->GetSize(), binderd::kInlineBufferSize + 1);
+  ASSERT_EQ(buffer->GetCapacity(), 2 * binderd::kInlineBufferSize);
+  ASSERT_EQ(buffer->GetData()[0], 42);
+
+  buffer->Resize(2 * binderd::kInlineBufferSize + 1);
+  ASSERT_EQ(buffer->GetCapacity(), 4 * binderd::kInlineBufferSize);
+
+  // Shrinking keeps the memory around
+  buffer->Resize(1);
+  ASSERT_EQ(buffer->GetCapacity(), 4 * binderd::kInlineBufferSize);
+}
+
+TEST(Buffer, ReserveKeepsContent) {
+  auto buffer = binderd::CreateBufferWithCapacity(4);
+  ASSERT_EQ(buffer->GetSize(), 0);
+  ASSERT_GE(buffer->GetCapacity(), 4);
+
+  binderd::BinaryWriter writer(buffer);
+  writer.WriteUint32(0x12345678);
+  writer.Reserve(4096);
+  ASSERT_GE(buffer->GetCapacity(), 4100);
+  ASSERT_EQ(buffer->GetSize(), 4);
+
+  for (std::uint32_t n = 0; n < 1024; n++)
+    writer.WriteUint32(n);
+  ASSERT_EQ(buffer->GetSize(), 4100);
+  ASSERT_EQ(*reinterpret_cast<std::uint32_t*>(buffer->GetData()), 0x12345678);
+}
+
+TEST(Buffer, ImmutableBufferCanNotGrow) {
+  std::uint8_t data[4] = {};
+  auto buffer = binderd::Buffer::Create(data, sizeof(data));
+  ASSERT_THROW(buffer->Reserve(8), std::runtime_error);
+  ASSERT_THROW(buffer->Resize(8), std::runtime_error);
+}
+
+TEST(Buffer, SliceSharesParentMemory) {
+  auto parent = binderd::CreateBufferWithSize(8);
+  auto slice = binderd::CreateBufferSlice(parent, 4, 4);
+  ASSERT_EQ(slice->GetData(), parent->GetData() + 4);
+  ASSERT_THROW(binderd::CreateBufferSlice(parent, 4, 5), std::out_of_range);
+
+  // The slice follows the parent when it grows
+  parent->Resize(4096);
+  ASSERT_EQ(slice->GetData(), parent->GetData() + 4);
+
+  slice->GetData()[0] = 42;
+  std::weak_ptr<binderd::Buffer> weak_parent = parent;
+  parent.reset();
+  ASSERT_FALSE(weak_parent.expired());
+  ASSERT_EQ(slice->GetData()[0], 42);
+}
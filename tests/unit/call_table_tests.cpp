@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "binderd/call_table.h"
+#include "binderd/status.h"
+
+#include <thread>
+
+using namespace binderd;
+
+namespace {
+MessagePtr CreateReply(Message::Type type, std::uint64_t cookie, Status status = Status::OK) {
+  auto msg = Message::Create(type);
+  msg->SetCookie(cookie);
+  msg->GetWriter().WriteInt32(static_cast<std::int32_t>(status));
+  return msg;
+}
+}
+
+TEST(CallTable, WaiterReceivesReplyFromOtherThread) {
+  CallTable calls;
+  const auto cookie = calls.Start(false);
+
+  auto reply = CreateReply(Message::Type::Status, cookie);
+  std::thread reader{[&]() { ASSERT_TRUE(calls.Complete(reply)); }};
+
+  ASSERT_EQ(reply, calls.Wait(cookie));
+  reader.join();
+}
+
+TEST(CallTable, DeliveryStatusDoesNotCompleteCall) {
+  CallTable calls;
+  const auto cookie = calls.Start(true);
+
+  ASSERT_TRUE(calls.Complete(CreateReply(Message::Type::Status, cookie)));
+
+  auto reply = CreateReply(Message::Type::TransactionReply, cookie);
+  ASSERT_TRUE(calls.Complete(reply));
+  ASSERT_EQ(reply, calls.Wait(cookie));
+}
+
+TEST(CallTable, FailedDeliveryCompletesCall) {
+  CallTable calls;
+  const auto cookie = calls.Start(true);
+
+  auto reply = CreateReply(Message::Type::Status, cookie, Status::DeadObject);
+  ASSERT_TRUE(calls.Complete(reply));
+  ASSERT_EQ(reply, calls.Wait(cookie));
+}
+
+TEST(CallTable, StaleReplyDoesNotCompleteReusedSlot) {
+  CallTable calls;
+  const auto first = calls.Start(false);
+  calls.Complete(CreateReply(Message::Type::Status, first));
+  calls.Wait(first);
+
+  // Cycle through all slots until the first one is used again
+  auto cookie = calls.Start(false);
+  for (std::size_t n = 1; n < CallTable::kNumSlots; n++) {
+    calls.Cancel(cookie);
+    cookie = calls.Start(false);
+  }
+  ASSERT_NE(first, cookie);
+
+  ASSERT_FALSE(calls.Complete(CreateReply(Message::Type::Status, first)));
+  ASSERT_FALSE(calls.Complete(CreateReply(Message::Type::Status, 1)));
+  calls.Cancel(cookie);
+}
+
+TEST(CallTable, AbortWakesUpWaiters) {
+  CallTable calls;
+  const auto cookie = calls.Start(false);
+
+  std::thread aborter{[&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    calls.Abort();
+  }};
+
+  ASSERT_EQ(nullptr, calls.Wait(cookie));
+  aborter.join();
+}
+
+TEST(CallTable, CompletionHandlerReceivesReply) {
+  CallTable calls;
+  MessagePtr received;
+  const auto cookie = calls.Start(false, [&](const MessagePtr &msg) { received = msg; });
+
+  auto reply = CreateReply(Message::Type::Status, cookie);
+  ASSERT_TRUE(calls.Complete(reply));
+  ASSERT_EQ(reply, received);
+
+  // The slot is free again right away
+  ASSERT_FALSE(calls.Complete(reply));
+}
@@ -20,9 +20,10 @@
 
 #include "binderd/client_impl.h"
 #include "binderd/buffer.h"
-#include "binderd/message_parser.h"
+#include "binderd/frame.h"
 #include "binderd/remote_object.h"
 #include "binderd/logger.h"
+#include "binderd/writable_transaction_data.h"
 
 using namespace binderd;
 
@@ -43,6 +44,8 @@ class MockMessenger : public Messenger {
 
   MOCK_METHOD1(ReadMessageAsync, void(const ReadHandler&));
   MOCK_METHOD1(WriteData, void(const BufferPtr&));
+  MOCK_METHOD2(WriteData, void(const BufferPtr&, const std::vector<Fd>&));
+  MOCK_METHOD1(TakeFds, std::vector<Fd>(std::size_t));
 };
 
 class MockObject : public Object {
@@ -109,37 +112,30 @@ class ClientTest : public ::testing::Test {
   }
 
   void SendMessage(const MessagePtr &msg) {
-    read_handler(asio::error_code(0, asio::system_category()), msg->Pack());
+    read_handler(asio::error_code(0, asio::system_category()), CreateFrame(msg->Pack()));
   }
 
   std::shared_ptr<RemoteObject> CreateRemoteObject(uint64_t handle) {
-    EXPECT_CALL(*messenger, WriteData(_))
-        .Times(1)
-        .WillOnce(Invoke([&](const BufferPtr &buffer) {
-      MessageParser parser(buffer, buffer->GetSize());
-      auto msg = parser.Next();
-      ASSERT_EQ(Message::Type::Acquire, msg->GetType());
+    // This will call Client::AddReference internally which only queues
+    // the reference until the next message is sent.
+    return RemoteObject::Create(client, handle);
+  }
 
-      auto reader = msg->GetReader();
-      const auto read_handle = reader.ReadUint64();
-      ASSERT_EQ(handle, read_handle);
+  void ExpectReferenceUpdate(const BufferPtr &buffer, uint64_t handle, int32_t delta) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::UpdateReferences, msg->GetType());
 
-      auto reply = Message::Create(Message::Type::TransactionReply);
-      reply->SetCookie(msg->GetCookie());
-      auto writer = reply->GetWriter();
-      writer.WriteInt32(static_cast<int32_t>(Status::OK));
-      SendMessage(reply);
-    }));
-
-    // This will call Client::AddReference internally to acquire a reference
-    // on the server side
-    return RemoteObject::Create(client, handle);
+    auto reader = msg->GetReader();
+    ASSERT_EQ(1, reader.ReadUint32());
+    ASSERT_EQ(handle, reader.ReadUint64());
+    ASSERT_EQ(delta, reader.ReadInt32());
   }
 
-  MessagePtr CreateDeathNotification(uint64_t object_id) {
+  MessagePtr CreateDeathNotification(uint64_t handle, uint64_t object_id) {
     auto msg = Message::Create(Message::Type::DeadBinder);
     msg->SetCookie(client->NewCookie());
     auto writer = msg->GetWriter();
+    writer.WriteUint64(handle);
     writer.WriteUint64(object_id);
     return msg;
   }
@@ -148,11 +144,14 @@ class ClientTest : public ::testing::Test {
                    std::shared_ptr<MockDeathRecipient> &death_recipient,
                    uint64_t expected_handle,
                    uint64_t &object_id) {
+    // The reference the object acquired goes out first
     EXPECT_CALL(*messenger, WriteData(_))
-        .Times(1)
+        .Times(2)
+        .WillOnce(Invoke([&](const BufferPtr &buffer) {
+      ExpectReferenceUpdate(buffer, expected_handle, 1);
+    }))
         .WillOnce(Invoke([&](const BufferPtr &buffer) {
-      MessageParser parser(buffer, buffer->GetSize());
-      auto msg = parser.Next();
+      auto msg = Message::CreateFromData(buffer);
       ASSERT_EQ(Message::Type::RequestDeathNotification, msg->GetType());
 
       auto reader = msg->GetReader();
@@ -176,8 +175,7 @@ class ClientTest : public ::testing::Test {
     EXPECT_CALL(*messenger, WriteData(_))
         .Times(1)
         .WillOnce(Invoke([&](const BufferPtr &buffer) {
-      MessageParser parser(buffer, buffer->GetSize());
-      auto msg = parser.Next();
+      auto msg = Message::CreateFromData(buffer);
       ASSERT_EQ(Message::Type::Status, msg->GetType());
       auto reader = msg->GetReader();
       ASSERT_EQ(status, static_cast<Status>(reader.ReadInt32()));
@@ -241,81 +239,72 @@ TEST_F(ClientTest, ContextObjReceivesIncomingTransaction) {
 }
 
 TEST_F(ClientTest, AddReference) {
-  EXPECT_CALL(*messenger, WriteData(_))
-      .Times(1)
-      .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
-    ASSERT_EQ(Message::Type::Acquire, msg->GetType());
-
-    auto reader = msg->GetReader();
-    const auto handle = reader.ReadUint64();
-    ASSERT_EQ(1337, handle);
-
-    auto reply = Message::Create(Message::Type::TransactionReply);
-    auto writer = reply->GetWriter();
-    writer.WriteInt32(static_cast<int32_t>(Status::OK));
-    SendMessage(reply);
-  }));
-
   const auto status = client->AddReference(1337);
   ASSERT_EQ(Status::OK, status);
-}
 
-TEST_F(ClientTest, ReferenceCanBeReleased) {
+  // The reference goes out right before the next message
   EXPECT_CALL(*messenger, WriteData(_))
-      .Times(1)
+      .Times(2)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
-    ASSERT_EQ(Message::Type::Release, msg->GetType());
+    ExpectReferenceUpdate(buffer, 1337, 1);
+  }))
+      .WillOnce(Return());
 
-    auto reader = msg->GetReader();
-    const auto handle = reader.ReadUint64();
-    ASSERT_EQ(1337, handle);
-
-    auto reply = Message::Create(Message::Type::TransactionReply);
-    auto writer = reply->GetWriter();
-    writer.WriteInt32(static_cast<int32_t>(Status::OK));
-    SendMessage(reply);
-  }));
+  client->QueueMessage(Message::Create(Message::Type::SetMonitor));
+}
 
+TEST_F(ClientTest, ReferenceCanBeReleased) {
   const auto status = client->ReleaseReference(1337);
   ASSERT_EQ(Status::OK, status);
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(2)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    ExpectReferenceUpdate(buffer, 1337, -1);
+  }))
+      .WillOnce(Return());
+
+  client->QueueMessage(Message::Create(Message::Type::SetMonitor));
 }
 
 TEST_F(ClientTest, ReferenceCanBeReleasedWithClosure) {
+  auto closure = client->GetReleaseReferenceClosure(1337);
+  const Status status = closure();
+  ASSERT_EQ(Status::OK, status);
+
   EXPECT_CALL(*messenger, WriteData(_))
-      .Times(1)
+      .Times(2)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
-    ASSERT_EQ(Message::Type::Release, msg->GetType());
+    ExpectReferenceUpdate(buffer, 1337, -1);
+  }))
+      .WillOnce(Return());
 
-    auto reader = msg->GetReader();
-    const auto handle = reader.ReadUint64();
-    ASSERT_EQ(1337, handle);
+  client->QueueMessage(Message::Create(Message::Type::SetMonitor));
+}
 
-    auto reply = Message::Create(Message::Type::TransactionReply);
-    auto writer = reply->GetWriter();
-    writer.WriteInt32(static_cast<int32_t>(Status::OK));
-    SendMessage(reply);
+TEST_F(ClientTest, ReferenceChangesCancelOut) {
+  ASSERT_EQ(Status::OK, client->AddReference(1337));
+  ASSERT_EQ(Status::OK, client->ReleaseReference(1337));
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(1)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::SetMonitor, msg->GetType());
   }));
 
-  auto closure = client->GetReleaseReferenceClosure(1337);
-  const Status status = closure();
-  ASSERT_EQ(Status::OK, status);
+  client->QueueMessage(Message::Create(Message::Type::SetMonitor));
 }
 
 TEST_F(ClientTest, CanBecomeContextManager) {
   EXPECT_CALL(*messenger, WriteData(_))
       .Times(1)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
+    auto msg = Message::CreateFromData(buffer);
     ASSERT_EQ(Message::Type::SetContextMgr, msg->GetType());
 
     auto reply = Message::Create(Message::Type::TransactionReply);
+    reply->SetCookie(msg->GetCookie());
     auto writer = reply->GetWriter();
     writer.WriteInt32(static_cast<int32_t>(Status::OK));
     SendMessage(reply);
@@ -336,7 +325,7 @@ TEST_F(ClientTest, CanReceiveDeathNotification) {
 
   // As we're now registered we should get a notification that
   // the object is dead when the serve says so.
-  auto death_notification = CreateDeathNotification(object_id);
+  auto death_notification = CreateDeathNotification(expected_handle, object_id);
   SendMessage(death_notification);
 
   // Sending the death notification for the same object should
@@ -363,8 +352,7 @@ TEST_F(ClientTest, AfterUnlinkedDeathNotificationRecipientIsntNotified) {
   EXPECT_CALL(*messenger, WriteData(_))
       .Times(1)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
+    auto msg = Message::CreateFromData(buffer);
     ASSERT_EQ(Message::Type::ClearDeathNotification, msg->GetType());
 
     auto reader = msg->GetReader();
@@ -383,26 +371,49 @@ TEST_F(ClientTest, AfterUnlinkedDeathNotificationRecipientIsntNotified) {
 
   // When the death notification is sent and processed it should not
   // be forwarded to the object anymore.
-  auto death_notification = CreateDeathNotification(object_id);
+  auto death_notification = CreateDeathNotification(expected_handle, object_id);
   SendMessage(death_notification);
 
   ExpectStatusSent(Status::DeadObject);
 
   client->ProcessAndExecuteCommand();
+}
 
-  // The remote object will be release once the test is over
+
+TEST_F(ClientTest, TransactAsyncRunsCallbackThroughExecutor) {
+  std::vector<MessagePtr> sent;
   EXPECT_CALL(*messenger, WriteData(_))
-      .Times(1)
-      .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
-    ASSERT_EQ(Message::Type::Release, msg->GetType());
+      .Times(2)
+      .WillRepeatedly(Invoke([&](const BufferPtr &buffer) {
+    sent.push_back(Message::CreateFromData(buffer));
+  }));
 
-    auto reply = Message::Create(Message::Type::TransactionReply);
-    reply->SetCookie(msg->GetCookie());
-    auto writer = reply->GetWriter();
-    writer.WriteInt32(static_cast<int32_t>(Status::OK));
+  std::vector<std::function<void()>> queued;
+  auto executor = [&](const std::function<void()> &f) { queued.push_back(f); };
+
+  std::vector<Status> results;
+  auto callback = [&](Status status, std::unique_ptr<TransactionData> reply) {
+    results.push_back(status);
+  };
+
+  // Both calls are in flight at the same time
+  client->TransactAsync(1, std::make_unique<WritableTransactionData>(), callback, executor);
+  client->TransactAsync(2, std::make_unique<WritableTransactionData>(), callback, executor);
+  ASSERT_EQ(2, sent.size());
+  ASSERT_NE(sent[0]->GetCookie(), sent[1]->GetCookie());
+
+  // Replies arrive in any order. Failed deliveries complete a call.
+  for (const auto &status : {Status::DeadObject, Status::NameNotFound}) {
+    auto reply = Message::Create(Message::Type::Status);
+    reply->SetCookie(sent[status == Status::DeadObject ? 1 : 0]->GetCookie());
+    reply->GetWriter().WriteInt32(static_cast<int32_t>(status));
     SendMessage(reply);
-  }));
-}
+  }
 
+  ASSERT_EQ(0, results.size());
+  ASSERT_EQ(2, queued.size());
+  for (const auto &f : queued)
+    f();
+
+  ASSERT_EQ(std::vector<Status>({Status::DeadObject, Status::NameNotFound}), results);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "binderd/common/handle_table.h"
+
+#include <atomic>
+#include <set>
+#include <thread>
+
+TEST(HandleTable, FindsInsertedValue) {
+  binderd::HandleTable<int> table;
+  const auto handle = table.Insert(std::make_shared<int>(42));
+  ASSERT_NE(0, handle);
+  ASSERT_EQ(1, table.Size());
+  auto value = table.Find(handle);
+  ASSERT_NE(nullptr, value);
+  ASSERT_EQ(42, *value);
+}
+
+TEST(HandleTable, StaleHandleDoesNotFindReusedSlot) {
+  binderd::HandleTable<int> table;
+  const auto first = table.Insert(std::make_shared<int>(1));
+  ASSERT_TRUE(table.Remove(first));
+  ASSERT_FALSE(table.Remove(first));
+
+  const auto second = table.Insert(std::make_shared<int>(2));
+  ASSERT_NE(first, second);
+  ASSERT_EQ(nullptr, table.Find(first));
+  ASSERT_EQ(2, *table.Find(second));
+  ASSERT_EQ(1, table.Size());
+}
+
+TEST(HandleTable, ReusesFreedSlots) {
+  binderd::HandleTable<int> table;
+  const auto mask = binderd::HandleTable<int>::kMaxSlots - 1;
+
+  // Churning through short lived values must not grow the table
+  // until a slot used up all its generations
+  std::set<std::uint64_t> indices;
+  for (std::uint32_t n = 0; n < binderd::HandleTable<int>::kMaxGeneration; n++) {
+    const auto handle = table.Insert(std::make_shared<int>(n));
+    ASSERT_NE(0, handle);
+    ASSERT_LE(handle, static_cast<std::uint64_t>(INT32_MAX));
+    indices.insert(handle & mask);
+    ASSERT_TRUE(table.Remove(handle));
+  }
+  ASSERT_EQ(1, indices.size());
+  ASSERT_EQ(0, table.Size());
+}
+
+TEST(HandleTable, NeverHandsOutAHandleTwice) {
+  binderd::HandleTable<int> table;
+  const auto mask = binderd::HandleTable<int>::kMaxSlots - 1;
+
+  // Go through all generations of a single slot
+  std::set<std::uint64_t> handles;
+  for (std::uint32_t n = 0; n < binderd::HandleTable<int>::kMaxGeneration; n++) {
+    const auto handle = table.Insert(std::make_shared<int>(n));
+    ASSERT_EQ(0, handle & mask);
+    ASSERT_TRUE(handles.insert(handle).second);
+    ASSERT_TRUE(table.Remove(handle));
+  }
+
+  // The slot is retired now instead of wrapping around
+  const auto handle = table.Insert(std::make_shared<int>(0));
+  ASSERT_EQ(1, handle & mask);
+  ASSERT_EQ(0, handles.count(handle));
+  for (const auto stale : handles)
+    ASSERT_EQ(nullptr, table.Find(stale));
+}
+
+TEST(HandleTable, RejectsInvalidHandles) {
+  binderd::HandleTable<int> table;
+  ASSERT_EQ(nullptr, table.Find(0));
+  ASSERT_EQ(nullptr, table.Find(1337));
+  ASSERT_EQ(nullptr, table.Find(~0ULL));
+}
+
+TEST(HandleTable, StaleHandleStaysInvalidWhileSlotIsReused) {
+  binderd::HandleTable<int> table;
+  const auto live = table.Insert(std::make_shared<int>(42));
+  const auto stale = table.Insert(std::make_shared<int>(1));
+  ASSERT_TRUE(table.Remove(stale));
+
+  // With a single free slot every insert takes over the slot of the
+  // stale handle with a new generation until the slot is retired.
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    for (std::uint32_t n = 1; n < binderd::HandleTable<int>::kMaxGeneration; n++) {
+      const auto handle = table.Insert(std::make_shared<int>(n));
+      ASSERT_NE(stale, handle);
+      ASSERT_EQ(handle & (binderd::HandleTable<int>::kMaxSlots - 1),
+                stale & (binderd::HandleTable<int>::kMaxSlots - 1));
+      ASSERT_TRUE(table.Remove(handle));
+    }
+    done = true;
+  });
+
+  std::size_t lookups = 0;
+  while (!done || lookups == 0) {
+    ASSERT_EQ(nullptr, table.Find(stale));
+    auto value = table.Find(live);
+    ASSERT_NE(nullptr, value);
+    ASSERT_EQ(42, *value);
+    lookups++;
+  }
+  writer.join();
+  ASSERT_EQ(1, table.Size());
+}
@@ -17,7 +17,13 @@
 
 #include <gtest/gtest.h>
 
+#include <cstring>
+
+#include <unistd.h>
+
 #include "binderd/message.h"
+#include "binderd/writable_transaction_data.h"
+#include "binderd/transaction_data_from_message.h"
 #include "binderd/common/utils.h"
 #include "binderd/logger.h"
 
@@ -86,3 +92,80 @@ TEST(Message, PackAndUnpack) {
   ASSERT_EQ(reader.ReadUint32(), 12345);
   ASSERT_EQ(reader.ReadString(), "foobar");
 }
+
+TEST(Message, MovesLargeTransactionDataOutOfLine) {
+  std::vector<uint8_t> payload(4096);
+  for (size_t n = 0; n < payload.size(); n++)
+    payload[n] = static_cast<uint8_t>(n);
+
+  binderd::WritableTransactionData tr;
+  tr.SetCode(42);
+  tr.SetData(binderd::Buffer::Create(payload.data(), payload.size()));
+
+  std::vector<binderd::Fd> fds;
+  auto packed = tr.Pack(&fds, 1024);
+  ASSERT_EQ(fds.size(), 1);
+  ASSERT_LT(packed->GetSize(), payload.size());
+
+  auto msg = binderd::Message::Create(binderd::Message::Type::Transaction);
+  msg->GetWriter().WriteData(packed);
+  msg->SetFds(fds);
+
+  binderd::TransactionDataFromMessage data(msg);
+  ASSERT_TRUE(data.IsOutOfLine());
+  ASSERT_EQ(data.GetNumFds(), 1);
+  ASSERT_EQ(data.GetCode(), 42);
+  ASSERT_EQ(data.GetDataSize(), payload.size());
+  ASSERT_EQ(::memcmp(data.GetData(), payload.data(), payload.size()), 0);
+
+  // The memfd is sealed so the sender can't change it anymore
+  ASSERT_LT(::write(fds[0], payload.data(), 1), 0);
+}
+
+TEST(Message, ForwardsUnpackedMessageInPlace) {
+  auto msg = binderd::Message::Create(binderd::Message::Type::Transaction);
+  msg->SetCookie(1);
+  msg->GetWriter().WriteUint32(12345);
+
+  auto received = binderd::Message::Create();
+  received->Unpack(msg->Pack());
+  received->SetCookie(2);
+
+  // Patching the header must not produce a new buffer
+  auto packed = received->Pack();
+  ASSERT_EQ(packed, received->Pack());
+
+  auto forwarded = binderd::Message::Create();
+  forwarded->Unpack(packed);
+  ASSERT_EQ(forwarded->GetType(), binderd::Message::Type::Transaction);
+  ASSERT_EQ(forwarded->GetCookie(), 2);
+  ASSERT_EQ(forwarded->GetReader().ReadUint32(), 12345);
+}
+
+TEST(Message, PackedFormOfCreatedMessageOutlivesIt) {
+  auto msg = binderd::Message::Create(binderd::Message::Type::Transaction);
+  msg->GetWriter().WriteUint32(12345);
+
+  auto received = binderd::Message::CreateFromData(msg->Pack());
+  ASSERT_EQ(received->GetPackedSize(), msg->Pack()->GetSize());
+  received->SetCookie(3);
+
+  auto packed = received->Pack();
+  received.reset();
+
+  auto forwarded = binderd::Message::CreateFromData(packed);
+  ASSERT_EQ(forwarded->GetType(), binderd::Message::Type::Transaction);
+  ASSERT_EQ(forwarded->GetCookie(), 3);
+  ASSERT_EQ(forwarded->GetReader().ReadUint32(), 12345);
+}
+
+TEST(Message, SharesMemoryOfBufferItWasCreatedFrom) {
+  auto msg = binderd::Message::Create(binderd::Message::Type::Transaction);
+  msg->GetWriter().WriteUint32(12345);
+  auto packed = msg->Pack();
+
+  auto received = binderd::Message::CreateFromData(packed);
+  auto payload = received->GetReader().ReadData(sizeof(std::uint32_t));
+  ASSERT_EQ(payload->GetData(), packed->GetData() + binderd::Message::kHeaderSize);
+  ASSERT_EQ(received->Pack(), packed);
+}
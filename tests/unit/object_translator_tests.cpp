@@ -21,6 +21,8 @@
 #include "binderd/writable_transaction_data.h"
 #include "binderd/common/binary_writer.h"
 
+#include <unistd.h>
+
 using namespace binderd;
 
 TEST(ObjectTranslator, TransactionWithNoObjectsIsOk) {
@@ -82,3 +84,48 @@ TEST(ObjectTranslator, MapsBinderObjectInAndOut) {
   ASSERT_EQ(Status::OK, translator.ProcessTransaction(&request, ObjectTranslator::Direction::In));
   ASSERT_EQ(0x1337, translated_obj->cookie);
 }
+
+TEST(ObjectTranslator, PassesFileDescriptorsInAndOut) {
+  ObjectTranslator translator;
+
+  int pipe_fds[2];
+  ASSERT_EQ(0, ::pipe(pipe_fds));
+  Fd read_end{pipe_fds[0]}, write_end{pipe_fds[1]};
+
+  BinaryWriter data;
+  BinaryWriter objects;
+
+  flat_binder_object obj{};
+  obj.type = BINDER_TYPE_FD;
+  obj.handle = static_cast<__u32>(static_cast<int>(write_end));
+
+  data.WriteData(reinterpret_cast<uint8_t*>(&obj), sizeof(flat_binder_object));
+  objects.WriteUint64(0);
+
+  WritableTransactionData request;
+  request.SetData(data.Finalize());
+  request.SetObjectOffsets(objects.Finalize());
+
+  ASSERT_EQ(Status::FdsNotAllowed, translator.ProcessTransaction(&request, ObjectTranslator::Direction::Out));
+
+  std::vector<Fd> fds;
+  ASSERT_EQ(Status::OK, translator.ProcessTransaction(&request, ObjectTranslator::Direction::Out, &fds));
+  ASSERT_EQ(1, fds.size());
+  ASSERT_NE(static_cast<int>(write_end), static_cast<int>(fds[0]));
+
+  // The server refers to the fd by its position on the way in
+  auto translated_obj = reinterpret_cast<flat_binder_object*>(request.GetMutableData());
+  translated_obj->handle = 0;
+
+  std::vector<Fd> no_fds;
+  ASSERT_EQ(Status::BadValue, translator.ProcessTransaction(&request, ObjectTranslator::Direction::In, &no_fds));
+
+  ASSERT_EQ(Status::OK, translator.ProcessTransaction(&request, ObjectTranslator::Direction::In, &fds));
+  ASSERT_EQ(static_cast<int>(fds[0]), static_cast<int>(translated_obj->handle));
+
+  const char c = 'x';
+  ASSERT_EQ(1, ::write(translated_obj->handle, &c, sizeof(c)));
+  char r = 0;
+  ASSERT_EQ(1, ::read(read_end, &r, sizeof(r)));
+  ASSERT_EQ(c, r);
+}
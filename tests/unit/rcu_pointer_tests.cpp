@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include "binderd/common/rcu_pointer.h"
+
+#include <thread>
+#include <vector>
+
+namespace {
+// Both fields are always updated together so readers must never see
+// them differ.
+struct Pair {
+  std::vector<int> first;
+  std::vector<int> second;
+};
+}
+
+TEST(RcuPointer, ReadsDefaultValue) {
+  binderd::RcuPointer<int> value;
+  ASSERT_EQ(0, value.Read([](const int &v) { return v; }));
+}
+
+TEST(RcuPointer, ReadersSeeConsistentValuesWhileUpdated) {
+  binderd::RcuPointer<Pair> pair;
+  std::atomic<bool> done{false};
+  std::atomic<int> mismatches{0};
+
+  std::vector<std::thread> readers;
+  for (int n = 0; n < 4; n++) {
+    readers.push_back(std::thread{[&]() {
+      while (!done) {
+        const auto equal = pair.Read([](const Pair &p) { return p.first == p.second; });
+        if (!equal)
+          mismatches++;
+      }
+    }});
+  }
+
+  for (int n = 0; n < 1000; n++) {
+    pair.Update([n](Pair &p) {
+      p.first.push_back(n);
+      p.second.push_back(n);
+    });
+  }
+
+  done = true;
+  for (auto &reader : readers)
+    reader.join();
+
+  ASSERT_EQ(0, mismatches);
+  ASSERT_EQ(1000, pair.Read([](const Pair &p) { return p.first.size(); }));
+}
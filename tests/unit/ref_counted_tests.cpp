@@ -37,3 +37,21 @@ TEST(RefCounted, CountStartsWithZero) {
   ASSERT_EQ(obj->GetCount(), 0);
   obj->Release();
 }
+
+TEST(RefCounted, RefPtrReleasesLastReference) {
+  auto obj = new TestObject;
+  binderd::RefPtr<TestObject> ptr{obj};
+  ASSERT_EQ(obj->GetCount(), 1);
+  {
+    auto copy = ptr;
+    ASSERT_EQ(obj->GetCount(), 2);
+    ASSERT_EQ(copy, ptr);
+  }
+  ASSERT_EQ(obj->GetCount(), 1);
+
+  auto moved = std::move(ptr);
+  ASSERT_EQ(ptr, nullptr);
+  ASSERT_EQ(obj->GetCount(), 1);
+  moved.reset();
+  ASSERT_FALSE(moved);
+}
@@ -17,9 +17,14 @@
 
 #include <gmock/gmock.h>
 
+#include <limits>
+
 #include "binderd/server_session.h"
 #include "binderd/registry.h"
-#include "binderd/message_parser.h"
+#include "binderd/frame.h"
+#include "binderd/binder_api.h"
+#include "binderd/writable_transaction_data.h"
+#include "binderd/transaction_data_from_message.h"
 
 using namespace binderd;
 
@@ -40,6 +45,8 @@ class MockMessenger : public Messenger {
 
   MOCK_METHOD1(ReadMessageAsync, void(const ReadHandler&));
   MOCK_METHOD1(WriteData, void(const BufferPtr&));
+  MOCK_METHOD2(WriteData, void(const BufferPtr&, const std::vector<Fd>&));
+  MOCK_METHOD1(TakeFds, std::vector<Fd>(std::size_t));
 };
 
 class ServerSessionTest : public ::testing::Test {
@@ -72,15 +79,14 @@ class ServerSessionTest : public ::testing::Test {
   }
 
   void SendMessage(const MessagePtr &msg) {
-    read_handler(asio::error_code(0, asio::system_category()), msg->Pack());
+    read_handler(asio::error_code(0, asio::system_category()), CreateFrame(msg->Pack()));
   }
 
   void RequestDeathNotification(const uint64_t &handle, const uint64_t &object_id) {
     EXPECT_CALL(*messenger, WriteData(_))
         .Times(1)
         .WillOnce(Invoke([&](const BufferPtr &buffer) {
-      MessageParser parser(buffer, buffer->GetSize());
-      auto msg = parser.Next();
+      auto msg = Message::CreateFromData(buffer);
       ASSERT_EQ(Message::Type::Status, msg->GetType());
       auto reader = msg->GetReader();
       const auto status = static_cast<Status>(reader.ReadInt32());
@@ -108,8 +114,7 @@ TEST_F(ServerSessionTest, AcceptsContextManager) {
   EXPECT_CALL(*messenger, WriteData(_))
       .Times(1)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
+    auto msg = Message::CreateFromData(buffer);
     ASSERT_EQ(Message::Type::Status, msg->GetType());
     auto reader = msg->GetReader();
     const auto status = static_cast<Status>(reader.ReadInt32());
@@ -126,8 +131,7 @@ TEST_F(ServerSessionTest, AcceptsContextManager) {
   EXPECT_CALL(*messenger, WriteData(_))
       .Times(1)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
+    auto msg = Message::CreateFromData(buffer);
     ASSERT_EQ(Message::Type::Status, msg->GetType());
     auto reader = msg->GetReader();
     const auto status = static_cast<Status>(reader.ReadInt32());
@@ -159,8 +163,7 @@ TEST_F(ServerSessionTest, ClientReceivesDeathNotificationWhenRegistered) {
   EXPECT_CALL(*messenger, WriteData(_))
       .Times(1)
       .WillOnce(Invoke([&](const BufferPtr &buffer) {
-    MessageParser parser(buffer, buffer->GetSize());
-    auto msg = parser.Next();
+    auto msg = Message::CreateFromData(buffer);
     ASSERT_EQ(Message::Type::DeadBinder, msg->GetType());
     auto reader = msg->GetReader();
     ASSERT_EQ(handle, reader.ReadUint64());
@@ -169,3 +172,314 @@ TEST_F(ServerSessionTest, ClientReceivesDeathNotificationWhenRegistered) {
 
   session->SendDeathNotification(1337);
 }
+
+TEST_F(ServerSessionTest, IsNotifiedOncePerHandleItReferences) {
+  const auto handle = registry->NewObjectHandle(session, 1, 2);
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, handle));
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, handle));
+
+  // References are counted per session
+  ASSERT_EQ(Status::OK, registry->RemoveReferenceForHandle(session, handle));
+  ASSERT_TRUE(registry->IsHandleReferenced(handle));
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, handle));
+
+  const auto object_id = 1;
+  RequestDeathNotification(handle, object_id);
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(1)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::DeadBinder, msg->GetType());
+  }));
+
+  registry->RemoveHandle(handle);
+  ASSERT_FALSE(registry->IsHandleReferenced(handle));
+}
+
+TEST_F(ServerSessionTest, DropsAllReferencesOfSession) {
+  const auto first = registry->NewObjectHandle(session, 1, 2);
+  const auto second = registry->NewObjectHandle(session, 3, 4);
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, first));
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, first));
+  ASSERT_EQ(Status::OK, registry->AddReferenceForHandle(session, second));
+
+  registry->RemoveReferencesOfSession(session);
+
+  ASSERT_FALSE(registry->IsHandleReferenced(first));
+  ASSERT_FALSE(registry->IsHandleReferenced(second));
+  ASSERT_EQ(Status::BadValue, registry->RemoveReferenceForHandle(session, first));
+}
+
+TEST_F(ServerSessionTest, RejectsTransactionWithOverlappingObjects) {
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(1);
+
+  auto msg = Message::Create(Message::Type::SetContextMgr);
+  msg->SetCookie(1);
+  SendMessage(msg);
+
+  // The second object starts in the middle of the first one
+  auto data = Buffer::Create(2 * sizeof(flat_binder_object));
+  for (size_t n = 0; n < 2; n++) {
+    auto obj = reinterpret_cast<flat_binder_object*>(data->GetData() + n * sizeof(flat_binder_object));
+    obj->type = BINDER_TYPE_BINDER;
+    obj->binder = 0x1000;
+    obj->cookie = 0x2000;
+  }
+  auto objects = Buffer::Create(2 * sizeof(binder_size_t));
+  reinterpret_cast<binder_size_t*>(objects->GetData())[0] = 0;
+  reinterpret_cast<binder_size_t*>(objects->GetData())[1] = sizeof(flat_binder_object) / 2;
+
+  WritableTransactionData tr;
+  tr.SetData(data);
+  tr.SetObjectOffsets(objects);
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(1)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::Status, msg->GetType());
+    ASSERT_EQ(2, msg->GetCookie());
+    auto reader = msg->GetReader();
+    const auto status = static_cast<Status>(reader.ReadInt32());
+    ASSERT_EQ(Status::BadValue, status);
+  }));
+
+  msg = Message::Create(Message::Type::Transaction);
+  msg->SetCookie(2);
+  msg->SetDestination(0);
+  msg->GetWriter().WriteData(tr.Pack());
+  SendMessage(msg);
+}
+
+TEST_F(ServerSessionTest, RejectedTransactionLeavesNoHandlesBehind) {
+  // The target becomes context manager so we can reach it with handle 0
+  auto target_messenger = std::make_shared<MockMessenger>();
+  ::testing::Mock::AllowLeak(target_messenger.get());
+  Messenger::ReadHandler target_read_handler = nullptr;
+  EXPECT_CALL(*target_messenger, ReadMessageAsync(_))
+      .WillRepeatedly(SaveArg<0>(&target_read_handler));
+  auto target = ServerSession::Create(sessions, io, target_messenger, registry);
+  target->Start();
+
+  // Only the status for becoming context manager, the transaction
+  // never arrives
+  EXPECT_CALL(*target_messenger, WriteData(_))
+      .Times(1);
+
+  auto msg = Message::Create(Message::Type::SetContextMgr);
+  msg->SetCookie(1);
+  target_read_handler(asio::error_code(0, asio::system_category()), CreateFrame(msg->Pack()));
+
+  // Two binders which need a handle each followed by an object
+  // nobody knows
+  const size_t num_objects = 3;
+  auto data = Buffer::Create(num_objects * sizeof(flat_binder_object));
+  auto objects = Buffer::Create(num_objects * sizeof(binder_size_t));
+  for (size_t n = 0; n < num_objects; n++) {
+    auto obj = reinterpret_cast<flat_binder_object*>(data->GetData() + n * sizeof(flat_binder_object));
+    obj->type = BINDER_TYPE_BINDER;
+    obj->binder = 0x1000 + n;
+    obj->cookie = 0x2000 + n;
+    reinterpret_cast<binder_size_t*>(objects->GetData())[n] = n * sizeof(flat_binder_object);
+  }
+  reinterpret_cast<flat_binder_object*>(data->GetData())[num_objects - 1].type = 0;
+
+  WritableTransactionData tr;
+  tr.SetData(data);
+  tr.SetObjectOffsets(objects);
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(1)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::Status, msg->GetType());
+    ASSERT_EQ(2, msg->GetCookie());
+    ASSERT_EQ(Status::InvalidOperation, static_cast<Status>(msg->GetReader().ReadInt32()));
+  }));
+
+  msg = Message::Create(Message::Type::Transaction);
+  msg->SetCookie(2);
+  msg->SetDestination(0);
+  msg->GetWriter().WriteData(tr.Pack());
+  SendMessage(msg);
+
+  // The first two slots of the table were used for the binders and
+  // have to be free again
+  const auto first_handle = std::uint64_t{1} << HandleTable<int>::kIndexBits;
+  ASSERT_FALSE(registry->IsHandleKnown(first_handle));
+  ASSERT_FALSE(registry->IsHandleKnown(first_handle + 1));
+}
+
+TEST_F(ServerSessionTest, TargetOnlyGetsItsOwnObjectsForHandles) {
+  auto target_messenger = std::make_shared<MockMessenger>();
+  ::testing::Mock::AllowLeak(target_messenger.get());
+  Messenger::ReadHandler target_read_handler = nullptr;
+  EXPECT_CALL(*target_messenger, ReadMessageAsync(_))
+      .WillRepeatedly(SaveArg<0>(&target_read_handler));
+  auto target = ServerSession::Create(sessions, io, target_messenger, registry);
+  target->Start();
+
+  auto create_transaction = [](std::uint64_t destination, const std::vector<flat_binder_object> &objs) {
+    auto data = Buffer::Create(objs.size() * sizeof(flat_binder_object));
+    auto objects = Buffer::Create(objs.size() * sizeof(binder_size_t));
+    for (size_t n = 0; n < objs.size(); n++) {
+      ::memcpy(data->GetData() + n * sizeof(flat_binder_object), &objs[n], sizeof(flat_binder_object));
+      reinterpret_cast<binder_size_t*>(objects->GetData())[n] = n * sizeof(flat_binder_object);
+    }
+
+    WritableTransactionData tr;
+    tr.SetData(data);
+    tr.SetObjectOffsets(objects);
+
+    auto msg = Message::Create(Message::Type::Transaction);
+    msg->SetCookie(2);
+    msg->SetDestination(destination);
+    msg->GetWriter().WriteData(tr.Pack());
+    return msg;
+  };
+
+  auto binder_object = [](uintptr_t binder, uintptr_t cookie) {
+    flat_binder_object obj;
+    ::memset(&obj, 0, sizeof(obj));
+    obj.type = BINDER_TYPE_BINDER;
+    obj.binder = binder;
+    obj.cookie = cookie;
+    return obj;
+  };
+
+  auto handle_object = [](std::uint64_t handle) {
+    flat_binder_object obj;
+    ::memset(&obj, 0, sizeof(obj));
+    obj.type = BINDER_TYPE_HANDLE;
+    obj.handle = static_cast<__u32>(handle);
+    return obj;
+  };
+
+  // Objects the last transaction a session got came with
+  auto received_objects = [](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    EXPECT_EQ(Message::Type::Transaction, msg->GetType());
+    TransactionDataFromMessage data(msg);
+    auto objs = reinterpret_cast<const flat_binder_object*>(data.GetData());
+    return std::vector<flat_binder_object>(objs, objs + data.GetNumObjectOffsets());
+  };
+
+  // Statuses for the caller come after the transaction the target
+  // gets so only keep what was written last to each side
+  BufferPtr received, target_received;
+  EXPECT_CALL(*messenger, WriteData(_))
+      .WillRepeatedly(SaveArg<0>(&received));
+  EXPECT_CALL(*target_messenger, WriteData(_))
+      .WillRepeatedly(SaveArg<0>(&target_received));
+
+  // We become context manager so the target can reach us with handle 0
+  auto msg = Message::Create(Message::Type::SetContextMgr);
+  msg->SetCookie(1);
+  SendMessage(msg);
+
+  // The target hands us one of its objects ...
+  msg = create_transaction(0, {binder_object(0x3000, 0x4000)});
+  target_read_handler(asio::error_code(0, asio::system_category()), CreateFrame(msg->Pack()));
+  auto objs = received_objects(received);
+  ASSERT_EQ(1, objs.size());
+  ASSERT_EQ(BINDER_TYPE_HANDLE, objs[0].type);
+  const std::uint64_t target_handle = objs[0].handle;
+
+  // ... and we hand it one of ours
+  SendMessage(create_transaction(target_handle, {binder_object(0x1000, 0x2000)}));
+  objs = received_objects(target_received);
+  ASSERT_EQ(1, objs.size());
+  ASSERT_EQ(BINDER_TYPE_HANDLE, objs[0].type);
+  const std::uint64_t caller_handle = objs[0].handle;
+
+  SendMessage(create_transaction(target_handle, {handle_object(caller_handle), handle_object(target_handle)}));
+  objs = received_objects(target_received);
+  ASSERT_EQ(2, objs.size());
+
+  // The object of the caller stays a handle so its pointer never
+  // reaches another process
+  ASSERT_EQ(BINDER_TYPE_HANDLE, objs[0].type);
+  ASSERT_EQ(caller_handle, objs[0].handle);
+
+  ASSERT_EQ(BINDER_TYPE_WEAK_BINDER, objs[1].type);
+  ASSERT_EQ(0x3000, objs[1].binder);
+  ASSERT_EQ(0x4000, objs[1].cookie);
+}
+
+TEST_F(ServerSessionTest, AppliesReferenceUpdatesAtOnce) {
+  const auto handle = registry->NewObjectHandle(session, 0x1000, 0x2000);
+
+  // Reference updates are never answered
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(0);
+
+  auto update_references = [&](std::int32_t delta) {
+    auto msg = Message::Create(Message::Type::UpdateReferences);
+    auto writer = msg->GetWriter();
+    writer.WriteUint32(1);
+    writer.WriteUint64(handle);
+    writer.WriteInt32(delta);
+    SendMessage(msg);
+  };
+
+  update_references(std::numeric_limits<std::int32_t>::max());
+  update_references(std::numeric_limits<std::int32_t>::max());
+  update_references(1);
+  ASSERT_TRUE(registry->IsHandleReferenced(handle));
+
+  // The count is now at its maximum and must not wrap around
+  update_references(1);
+
+  // Dropping more references than we hold is rejected as well
+  update_references(std::numeric_limits<std::int32_t>::min());
+  update_references(std::numeric_limits<std::int32_t>::min());
+  ASSERT_TRUE(registry->IsHandleReferenced(handle));
+
+  update_references(-std::numeric_limits<std::int32_t>::max());
+  ASSERT_FALSE(registry->IsHandleReferenced(handle));
+}
+
+TEST_F(ServerSessionTest, CallerGetsDeadReplyWhenTargetGoesAway) {
+  // The target becomes context manager so we can reach it with handle 0
+  auto target_messenger = std::make_shared<MockMessenger>();
+  ::testing::Mock::AllowLeak(target_messenger.get());
+  Messenger::ReadHandler target_read_handler = nullptr;
+  EXPECT_CALL(*target_messenger, ReadMessageAsync(_))
+      .WillRepeatedly(SaveArg<0>(&target_read_handler));
+  auto target = ServerSession::Create(sessions, io, target_messenger, registry);
+  target->Start();
+
+  EXPECT_CALL(*target_messenger, WriteData(_))
+      .Times(2);
+
+  auto msg = Message::Create(Message::Type::SetContextMgr);
+  msg->SetCookie(1);
+  target_read_handler(asio::error_code(0, asio::system_category()), CreateFrame(msg->Pack()));
+
+  EXPECT_CALL(*messenger, WriteData(_))
+      .Times(2)
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::Status, msg->GetType());
+    ASSERT_EQ(Status::OK, static_cast<Status>(msg->GetReader().ReadInt32()));
+  }))
+      .WillOnce(Invoke([&](const BufferPtr &buffer) {
+    auto msg = Message::CreateFromData(buffer);
+    ASSERT_EQ(Message::Type::Status, msg->GetType());
+    ASSERT_EQ(2, msg->GetCookie());
+    ASSERT_EQ(Status::DeadObject, static_cast<Status>(msg->GetReader().ReadInt32()));
+  }));
+
+  WritableTransactionData tr;
+  msg = Message::Create(Message::Type::Transaction);
+  msg->SetCookie(2);
+  msg->SetDestination(0);
+  msg->GetWriter().WriteData(tr.Pack());
+  SendMessage(msg);
+
+  target_read_handler(asio::error::eof, nullptr);
+
+  ASSERT_EQ(nullptr, registry->GetContextManager());
+}
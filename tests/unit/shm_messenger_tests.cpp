@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2017 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include "binderd/shm_messenger.h"
+#include "binderd/socket_messenger.h"
+#include "binderd/frame.h"
+
+#include <sys/eventfd.h>
+
+using namespace binderd;
+
+namespace {
+class ShmMessengerTest : public ::testing::Test {
+ public:
+  ShmMessengerTest() :
+    io{std::make_shared<asio::io_service>()} {}
+
+  void Connect(std::size_t capacity = kDefaultShmRingCapacity) {
+    asio::local::stream_protocol::socket a(*io), b(*io);
+    asio::local::connect_pair(a, b);
+    sender_control = std::make_shared<SocketMessenger>(io, std::move(a));
+    receiver_control = std::make_shared<SocketMessenger>(io, std::move(b));
+
+    sender = ShmMessenger::Create(io, sender_control, capacity);
+    ASSERT_NE(nullptr, sender);
+    receiver = ShmMessenger::Accept(io, receiver_control, capacity, sender->GetFds());
+    ASSERT_NE(nullptr, receiver);
+  }
+
+  BufferPtr CreatePayload(std::size_t size, std::uint8_t seed) {
+    auto buffer = CreateBufferWithSize(size);
+    for (std::size_t n = 0; n < size; n++)
+      buffer->GetData()[n] = static_cast<std::uint8_t>((n + seed) % 251);
+    return buffer;
+  }
+
+  // Calls handler with every message the receiver gets until it
+  // returns false.
+  void Receive(const std::function<bool(const BufferPtr&)> &handler) {
+    read_handler = [this, handler](const asio::error_code &err, const BufferPtr &buffer) {
+      ASSERT_FALSE(err);
+      std::size_t offset = 0;
+      while (offset < buffer->GetSize()) {
+        const auto header = FrameHeader::Decode(buffer->GetData() + offset);
+        offset += FrameHeader::kSize;
+        if (!handler(Buffer::Create(buffer->GetData() + offset, header.length))) {
+          io->stop();
+          return;
+        }
+        offset += header.length;
+      }
+      receiver->ReadMessageAsync(read_handler);
+    };
+    receiver->ReadMessageAsync(read_handler);
+  }
+
+  std::shared_ptr<asio::io_service> io;
+  std::shared_ptr<SocketMessenger> sender_control;
+  std::shared_ptr<SocketMessenger> receiver_control;
+  std::shared_ptr<ShmMessenger> sender;
+  std::shared_ptr<ShmMessenger> receiver;
+  Messenger::ReadHandler read_handler;
+};
+}
+
+TEST_F(ShmMessengerTest, RejectsInvalidCapacity) {
+  asio::local::stream_protocol::socket a(*io), b(*io);
+  asio::local::connect_pair(a, b);
+  auto control = std::make_shared<SocketMessenger>(io, std::move(a));
+  auto other_control = std::make_shared<SocketMessenger>(io, std::move(b));
+
+  auto messenger = ShmMessenger::Create(io, control);
+  ASSERT_NE(nullptr, messenger);
+  ASSERT_EQ(nullptr, ShmMessenger::Accept(io, other_control, messenger->GetCapacity() * 2, messenger->GetFds()));
+  ASSERT_EQ(nullptr, ShmMessenger::Accept(io, other_control, messenger->GetCapacity() - 1, messenger->GetFds()));
+}
+
+TEST_F(ShmMessengerTest, TransfersMessagesLargerThanTheRing) {
+  const std::size_t capacity = 128 * 1024;
+  Connect(capacity);
+
+  // The sender only gets to know about free space in the ring through
+  // its read path.
+  sender->ReadMessageAsync([](const asio::error_code&, const BufferPtr&) {});
+
+  std::vector<BufferPtr> payloads;
+  for (std::uint8_t n = 0; n < 100; n++)
+    payloads.push_back(CreatePayload(n * 10, n));
+  payloads.push_back(CreatePayload(8 * capacity + 3, 42));
+  payloads.push_back(CreatePayload(0, 0));
+
+  for (const auto &payload : payloads)
+    sender->WriteData(payload);
+
+  std::size_t num_received = 0;
+  Receive([&](const BufferPtr &buffer) {
+    const auto &expected = payloads[num_received++];
+    EXPECT_EQ(expected->GetSize(), buffer->GetSize());
+    EXPECT_TRUE(std::equal(buffer->GetBegin(), buffer->GetEnd(), expected->GetBegin()));
+    return num_received < payloads.size();
+  });
+
+  io->run();
+
+  ASSERT_EQ(payloads.size(), num_received);
+}
+
+TEST_F(ShmMessengerTest, KeepsOrderOfMessagesWithFds) {
+  Connect();
+
+  Fd fd{::eventfd(0, EFD_CLOEXEC)};
+  sender->WriteData(CreatePayload(10, 1));
+  sender->WriteData(CreatePayload(20, 2), {fd});
+  sender->WriteData(CreatePayload(30, 3));
+
+  std::vector<std::size_t> sizes;
+  Receive([&](const BufferPtr &buffer) {
+    sizes.push_back(buffer->GetSize());
+    if (buffer->GetSize() == 20) {
+      auto fds = receiver->TakeFds(1);
+      EXPECT_EQ(1, fds.size());
+      EXPECT_LE(0, fds[0]);
+    }
+    return sizes.size() < 3;
+  });
+
+  io->run();
+
+  ASSERT_EQ(std::vector<std::size_t>({10, 20, 30}), sizes);
+}
+
+TEST_F(ShmMessengerTest, ReportsHangupOfPeer) {
+  Connect();
+
+  sender.reset();
+  sender_control.reset();
+
+  asio::error_code received_err;
+  receiver->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    received_err = err;
+    io->stop();
+  });
+
+  io->run();
+
+  ASSERT_EQ(asio::error::eof, received_err);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "binderd/common/slab_allocator.h"
+
+#include <memory>
+#include <thread>
+
+namespace {
+struct TestObject : public binderd::slab::Allocated {
+  std::uint64_t values[5];
+};
+}
+
+TEST(SlabAllocator, RecyclesFreedBlocks) {
+  const auto before = binderd::slab::GetStats();
+
+  auto obj = new TestObject;
+  delete obj;
+  auto next = new TestObject;
+  ASSERT_EQ(next, obj);
+  delete next;
+
+  const auto after = binderd::slab::GetStats();
+  ASSERT_EQ(after.allocations - before.allocations, 2);
+  ASSERT_EQ(after.hits - before.hits, 1);
+  ASSERT_EQ(after.recycled - before.recycled, 2);
+}
+
+TEST(SlabAllocator, LargeAllocationsBypassFreeLists) {
+  const auto before = binderd::slab::GetStats();
+  auto ptr = binderd::slab::Allocate(4096);
+  binderd::slab::Free(ptr, 4096);
+  const auto after = binderd::slab::GetStats();
+  ASSERT_EQ(after.allocations, before.allocations);
+}
+
+TEST(SlabAllocator, BlocksCanBeFreedOnOtherThreads) {
+  std::thread([]() {
+    auto ptr = std::allocate_shared<TestObject>(binderd::slab::Allocator<TestObject>());
+    std::thread([ptr]() mutable { ptr.reset(); }).join();
+  }).join();
+
+  // Counters of exited threads are kept
+  ASSERT_GE(binderd::slab::GetStats().allocations, 1);
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2017 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include "binderd/socket_messenger.h"
+#include "binderd/constants.h"
+#include "binderd/frame.h"
+
+#include <thread>
+
+using namespace binderd;
+
+namespace {
+class SocketMessengerTest : public ::testing::Test {
+ public:
+  SocketMessengerTest() :
+    io{std::make_shared<asio::io_service>()} {}
+
+  void Connect(std::size_t max_message_size = kDefaultMaxMessageSize) {
+    asio::local::stream_protocol::socket a(*io), b(*io);
+    asio::local::connect_pair(a, b);
+    sender = std::make_shared<SocketMessenger>(io, std::move(a));
+    receiver = std::make_shared<SocketMessenger>(io, std::move(b), max_message_size);
+  }
+
+  BufferPtr CreatePayload(std::size_t size) {
+    auto buffer = CreateBufferWithSize(size);
+    for (std::size_t n = 0; n < size; n++)
+      buffer->GetData()[n] = static_cast<std::uint8_t>(n % 251);
+    return buffer;
+  }
+
+  std::vector<BufferPtr> SplitFrames(const BufferPtr &buffer) {
+    std::vector<BufferPtr> payloads;
+    std::size_t offset = 0;
+    while (offset < buffer->GetSize()) {
+      const auto header = FrameHeader::Decode(buffer->GetData() + offset);
+      EXPECT_EQ(0, header.flags);
+      offset += FrameHeader::kSize;
+      payloads.push_back(Buffer::Create(buffer->GetData() + offset, header.length));
+      offset += header.length;
+    }
+    EXPECT_EQ(buffer->GetSize(), offset);
+    return payloads;
+  }
+
+  std::shared_ptr<asio::io_service> io;
+  std::shared_ptr<SocketMessenger> sender;
+  std::shared_ptr<SocketMessenger> receiver;
+};
+}
+
+TEST_F(SocketMessengerTest, TransfersMessagesLargerThanOneFrame) {
+  Connect();
+
+  const auto size = 3 * kFrameChunkSize + 123;
+  auto payload = CreatePayload(size);
+
+  std::vector<std::uint8_t> received;
+  asio::error_code received_err;
+  receiver->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    received_err = err;
+    if (buffer) {
+      auto payloads = SplitFrames(buffer);
+      EXPECT_EQ(1, payloads.size());
+      received.assign(payloads[0]->GetBegin(), payloads[0]->GetEnd());
+    }
+    io->stop();
+  });
+
+  sender->WriteData(payload);
+  io->run();
+
+  ASSERT_FALSE(received_err);
+  ASSERT_EQ(size, received.size());
+  ASSERT_TRUE(std::equal(received.begin(), received.end(), payload->GetData()));
+}
+
+TEST_F(SocketMessengerTest, RejectsMessagesAboveLimit) {
+  const std::size_t max_message_size = 1024;
+  Connect(max_message_size);
+
+  asio::error_code received_err;
+  receiver->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    received_err = err;
+    ASSERT_EQ(nullptr, buffer);
+    io->stop();
+  });
+
+  sender->WriteData(CreatePayload(max_message_size + 1));
+  io->run();
+
+  ASSERT_EQ(asio::error::message_size, received_err);
+}
+
+TEST_F(SocketMessengerTest, ConcurrentWritersKeepTheirOrder) {
+  Connect();
+
+  const std::uint32_t num_writers = 4;
+  const std::uint32_t num_messages = 500;
+
+  std::vector<std::uint32_t> next_expected(num_writers, 0);
+  std::uint32_t num_received = 0;
+
+  Messenger::ReadHandler handler = [&](const asio::error_code &err, const BufferPtr &buffer) {
+    ASSERT_FALSE(err);
+    for (const auto &payload : SplitFrames(buffer)) {
+      ASSERT_EQ(2 * sizeof(std::uint32_t), payload->GetSize());
+      const auto values = reinterpret_cast<const std::uint32_t*>(payload->GetData());
+      ASSERT_EQ(next_expected[values[0]]++, values[1]);
+      num_received++;
+    }
+    if (num_received == num_writers * num_messages) {
+      io->stop();
+      return;
+    }
+    receiver->ReadMessageAsync(handler);
+  };
+  receiver->ReadMessageAsync(handler);
+
+  std::vector<std::thread> writers;
+  for (std::uint32_t n = 0; n < num_writers; n++) {
+    writers.push_back(std::thread([&, n]() {
+      for (std::uint32_t m = 0; m < num_messages; m++) {
+        auto buffer = CreateBufferWithSize(2 * sizeof(std::uint32_t));
+        auto values = reinterpret_cast<std::uint32_t*>(buffer->GetData());
+        values[0] = n;
+        values[1] = m;
+        sender->WriteData(buffer);
+      }
+    }));
+  }
+
+  io->run();
+
+  for (auto &writer : writers)
+    writer.join();
+
+  ASSERT_EQ(num_writers * num_messages, num_received);
+}
+
+TEST_F(SocketMessengerTest, CarriesIncompleteFramesOverToNextRead) {
+  asio::local::stream_protocol::socket sender_socket(*io), receiver_socket(*io);
+  asio::local::connect_pair(sender_socket, receiver_socket);
+  receiver = std::make_shared<SocketMessenger>(io, std::move(receiver_socket));
+
+  std::vector<std::uint8_t> data;
+  for (std::size_t n = 0; n < 4; n++) {
+    auto frame = CreateFrame(CreatePayload(100 + n));
+    data.insert(data.end(), frame->GetBegin(), frame->GetEnd());
+  }
+
+  // Three complete frames followed by the first half of the fourth one
+  const auto split = data.size() - 50;
+  asio::write(sender_socket, asio::buffer(data.data(), split));
+
+  std::vector<std::size_t> delivered;
+  Messenger::ReadHandler handler = [&](const asio::error_code &err, const BufferPtr &buffer) {
+    ASSERT_FALSE(err);
+    auto payloads = SplitFrames(buffer);
+    delivered.push_back(payloads.size());
+    if (delivered.size() == 1) {
+      asio::write(sender_socket, asio::buffer(data.data() + split, data.size() - split));
+      receiver->ReadMessageAsync(handler);
+      return;
+    }
+    ASSERT_EQ(103, payloads[0]->GetSize());
+    io->stop();
+  };
+  receiver->ReadMessageAsync(handler);
+
+  io->run();
+
+  ASSERT_EQ(std::vector<std::size_t>({3, 1}), delivered);
+}
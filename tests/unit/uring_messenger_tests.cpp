@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 Simon Fels <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include "binderd/uring_messenger.h"
+#include "binderd/constants.h"
+#include "binderd/frame.h"
+
+#include <unistd.h>
+
+using namespace binderd;
+
+namespace {
+class UringMessengerTest : public ::testing::Test {
+ public:
+  UringMessengerTest() :
+    io{std::make_shared<asio::io_service>()},
+    uring{IoUring::Create(io)} {}
+
+  void Connect() {
+    asio::local::stream_protocol::socket a(*io), b(*io);
+    asio::local::connect_pair(a, b);
+    sender = std::make_shared<UringMessenger>(io, uring, std::move(a));
+    receiver = std::make_shared<UringMessenger>(io, uring, std::move(b));
+  }
+
+  BufferPtr CreatePayload(std::size_t size, std::uint8_t seed = 0) {
+    auto buffer = CreateBufferWithSize(size);
+    for (std::size_t n = 0; n < size; n++)
+      buffer->GetData()[n] = static_cast<std::uint8_t>((n + seed) % 251);
+    return buffer;
+  }
+
+  std::vector<BufferPtr> SplitFrames(const BufferPtr &buffer) {
+    std::vector<BufferPtr> payloads;
+    std::size_t offset = 0;
+    while (offset < buffer->GetSize()) {
+      const auto header = FrameHeader::Decode(buffer->GetData() + offset);
+      offset += FrameHeader::kSize;
+      payloads.push_back(Buffer::Create(buffer->GetData() + offset, header.length));
+      offset += header.length;
+    }
+    return payloads;
+  }
+
+  std::shared_ptr<asio::io_service> io;
+  std::shared_ptr<IoUring> uring;
+  std::shared_ptr<UringMessenger> sender;
+  std::shared_ptr<UringMessenger> receiver;
+};
+}
+
+TEST_F(UringMessengerTest, TransfersMessagesWithFds) {
+  if (!uring)
+    return;
+  Connect();
+
+  int pipe_fds[2];
+  ASSERT_EQ(0, ::pipe(pipe_fds));
+  Fd read_end{pipe_fds[0]}, write_end{pipe_fds[1]};
+
+  const auto size = 3 * kFrameChunkSize + 123;
+  auto payload = CreatePayload(size);
+
+  std::vector<std::uint8_t> received;
+  std::vector<Fd> received_fds;
+  receiver->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    ASSERT_FALSE(err);
+    auto payloads = SplitFrames(buffer);
+    ASSERT_EQ(1, payloads.size());
+    received.assign(payloads[0]->GetBegin(), payloads[0]->GetEnd());
+    received_fds = receiver->TakeFds(1);
+    io->stop();
+  });
+
+  sender->WriteData(payload, {write_end});
+  io->run();
+
+  ASSERT_EQ(size, received.size());
+  ASSERT_TRUE(std::equal(received.begin(), received.end(), payload->GetData()));
+  ASSERT_EQ(1, received_fds.size());
+
+  const char c = 'x';
+  ASSERT_EQ(1, ::write(received_fds[0], &c, sizeof(c)));
+  char r = 0;
+  ASSERT_EQ(1, ::read(read_end, &r, sizeof(r)));
+  ASSERT_EQ(c, r);
+}
+
+TEST_F(UringMessengerTest, KeepsDataOfSlowReaders) {
+  if (!uring)
+    return;
+  Connect();
+
+  // Enough data to make the receiver stop and restart receiving
+  const std::size_t num_messages = 64;
+  const std::size_t size = 60 * 1024;
+  for (std::size_t n = 0; n < num_messages; n++)
+    sender->WriteData(CreatePayload(size, static_cast<std::uint8_t>(n)));
+
+  // Let everything arrive before anyone reads
+  for (std::size_t n = 0; n < 100; n++)
+    io->poll();
+
+  std::size_t num_received = 0;
+  Messenger::ReadHandler handler = [&](const asio::error_code &err, const BufferPtr &buffer) {
+    ASSERT_FALSE(err);
+    for (const auto &data : SplitFrames(buffer)) {
+      auto expected = CreatePayload(size, static_cast<std::uint8_t>(num_received));
+      ASSERT_EQ(size, data->GetSize());
+      ASSERT_TRUE(std::equal(data->GetBegin(), data->GetEnd(), expected->GetData()));
+      num_received++;
+    }
+    if (num_received == num_messages) {
+      io->stop();
+      return;
+    }
+    receiver->ReadMessageAsync(handler);
+  };
+  receiver->ReadMessageAsync(handler);
+
+  io->run();
+
+  ASSERT_EQ(num_messages, num_received);
+}
+
+TEST_F(UringMessengerTest, ReportsHangupOfPeer) {
+  if (!uring)
+    return;
+  Connect();
+
+  asio::error_code received_err;
+  receiver->ReadMessageAsync([&](const asio::error_code &err, const BufferPtr &buffer) {
+    received_err = err;
+    io->stop();
+  });
+
+  sender.reset();
+  io->run();
+
+  ASSERT_EQ(asio::error::eof, received_err);
+}
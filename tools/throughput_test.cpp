@@ -278,8 +278,16 @@ int main(int argc, char *argv[])
             i++;
             continue;
         }
+        if (string(argv[i]) == "-a") {
+            // Let the server acknowledge every delivered transaction
+            // as it did before to compare against.
+            setenv("BINDERD_ACK_ALL_TRANSACTIONS", "1", 1);
+            continue;
+        }
     }
 
+    cout << "delivery acks: " << (getenv("BINDERD_ACK_ALL_TRANSACTIONS") ? "all" : "failures only") << endl;
+
     // Create all the workers and wait for them to spawn.
     for (int i = 0; i < workers; i++) {
         pipes.push_back(make_worker(i, iterations, workers));